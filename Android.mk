@@ -26,8 +26,10 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := fuse_sideload.cpp
 LOCAL_CFLAGS := -Wall -Werror
 LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
+LOCAL_CPP_STD := c++17
 LOCAL_MODULE := libfusesideload
 LOCAL_STATIC_LIBRARIES := \
+    libotautil \
     libcrypto \
     libbase
 include $(BUILD_STATIC_LIBRARY)
@@ -198,6 +200,7 @@ LOCAL_STATIC_LIBRARIES += \
     libminizip_static \
     libminiunz_static \
     libotautil \
+    libotafault \
     libmounts \
     libminadbd \
     libasyncio \
@@ -460,6 +463,7 @@ LOCAL_STATIC_LIBRARIES := \
     libcrypto \
     libbase
 LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CPP_STD := c++17
 include $(BUILD_STATIC_LIBRARY)
 
 # Wear default device
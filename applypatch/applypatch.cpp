@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <string>
@@ -41,6 +42,7 @@
 #include "edify/expr.h"
 #include "otafault/ota_io.h"
 #include "otautil/cache_location.h"
+#include "otautil/hash.h"
 #include "otautil/print_sha1.h"
 
 static int LoadPartitionContents(const std::string& filename, FileContents* file);
@@ -76,7 +78,7 @@ int LoadFileContents(const char* filename, FileContents* file) {
     return -1;
   }
   file->data = std::move(data);
-  SHA1(file->data.data(), file->data.size(), file->sha1);
+  ComputeDigest(HashAlgorithm::SHA1, file->data.data(), file->data.size(), file->sha1);
   return 0;
 }
 
@@ -122,8 +124,7 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     return -1;
   }
 
-  SHA_CTX sha_ctx;
-  SHA1_Init(&sha_ctx);
+  HashContext sha_ctx(HashAlgorithm::SHA1);
 
   // Allocate enough memory to hold the largest size.
   std::vector<unsigned char> buffer(pairs[pair_count - 1].first);
@@ -144,17 +145,14 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
         printf("short read (%zu bytes of %zu) for partition \"%s\"\n", read, next, partition);
         return -1;
       }
-      SHA1_Update(&sha_ctx, buffer_ptr, read);
+      sha_ctx.Update(buffer_ptr, read);
       buffer_size += read;
       buffer_ptr += read;
     }
 
-    // Duplicate the SHA context and finalize the duplicate so we can
-    // check it against this pair's expected hash.
-    SHA_CTX temp_ctx;
-    memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
+    // Take the intermediate digest so we can check it against this pair's expected hash.
     uint8_t sha_so_far[SHA_DIGEST_LENGTH];
-    SHA1_Final(sha_so_far, &temp_ctx);
+    sha_ctx.Peek(sha_so_far);
 
     uint8_t parsed_sha[SHA_DIGEST_LENGTH];
     if (ParseSha1(current_sha1.c_str(), parsed_sha) != 0) {
@@ -176,7 +174,7 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     return -1;
   }
 
-  SHA1_Final(file->sha1, &sha_ctx);
+  sha_ctx.Final(file->sha1);
 
   buffer.resize(buffer_size);
   file->data = std::move(buffer);
@@ -211,6 +209,19 @@ int SaveFileContents(const char* filename, const FileContents* file) {
   return 0;
 }
 
+// Drops the page cache, so that a subsequent verification read goes to the device.
+static void DropCaches() {
+  sync();
+  unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
+  if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
+    printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
+  } else {
+    printf("  caches dropped\n");
+  }
+  ota_close(dc);
+  sleep(1);
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "EMMC:<partition_device>[:...]". The target name
 // might contain multiple colons, but WriteToPartition() only uses the first
@@ -264,15 +275,7 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
     }
 
     // Drop caches so our subsequent verification read won't just be reading the cache.
-    sync();
-    unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
-    if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
-      printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
-    } else {
-      printf("  caches dropped\n");
-    }
-    ota_close(dc);
-    sleep(1);
+    DropCaches();
 
     // Verify.
     if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
@@ -479,6 +482,7 @@ int applypatch(const char* source_filename, const char* target_filename,
                const std::vector<std::string>& patch_sha1_str,
                const std::vector<std::unique_ptr<Value>>& patch_data, const Value* bonus_data) {
   printf("patch %s: ", source_filename);
+  SetPatchSpillSpaceHandler(MakeFreeSpaceOnCache);
 
   if (target_filename[0] == '-' && target_filename[1] == '\0') {
     target_filename = source_filename;
@@ -593,6 +597,134 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
   return 0;
 }
 
+// The size of each write to the target partition, once the patched output gets streamed.
+static constexpr size_t kTargetWriteWindow = 1024 * 1024;
+
+// Collects the patched output for GenerateTarget(). Output that fits into the patch memory budget
+// is kept in memory, so the partition isn't touched until the whole target has been generated and
+// its hash checked. Past the budget, the output gets written to the partition in windows as it
+// comes in; the backup of the source in /cache then allows redoing an interrupted patch.
+class TargetWriter {
+ public:
+  explicit TargetWriter(const std::string& partition) : partition_(partition) {}
+
+  size_t Write(const unsigned char* data, size_t len) {
+    if (failed_) {
+      return 0;
+    }
+    buffer_.append(reinterpret_cast<const char*>(data), len);
+    size_ += len;
+    if (!streaming_ && buffer_.size() > PatchMemoryBudget()) {
+      printf("  output exceeds the memory budget of %zu bytes; streaming to %s\n",
+             PatchMemoryBudget(), partition_.c_str());
+      fd_.reset(ota_open(partition_.c_str(), O_RDWR));
+      if (fd_ == -1) {
+        printf("failed to open %s: %s\n", partition_.c_str(), strerror(errno));
+        failed_ = true;
+        return 0;
+      }
+      streaming_ = true;
+    }
+    if (streaming_ && buffer_.size() >= kTargetWriteWindow && !Flush()) {
+      return 0;
+    }
+    return len;
+  }
+
+  // Writes out the rest of the output and syncs the partition, if streaming.
+  bool Finish() {
+    if (!streaming_) {
+      return true;
+    }
+    if (!Flush()) {
+      return false;
+    }
+    if (ota_fsync(fd_) != 0) {
+      printf("failed to sync to %s: %s\n", partition_.c_str(), strerror(errno));
+      return false;
+    }
+    if (ota_close(fd_) != 0) {
+      printf("failed to close %s: %s\n", partition_.c_str(), strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  bool streaming() const {
+    return streaming_;
+  }
+
+  // Returns the total size of the output.
+  size_t size() const {
+    return size_;
+  }
+
+  // Returns the whole output, when not streaming.
+  const std::string& data() const {
+    return buffer_;
+  }
+
+ private:
+  bool Flush() {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(buffer_.data());
+    if (FileSink(data, buffer_.size(), fd_) != buffer_.size()) {
+      printf("failed write writing to %s\n", partition_.c_str());
+      failed_ = true;
+      return false;
+    }
+    buffer_.clear();
+    // Gives back the memory taken before the streaming started.
+    if (buffer_.capacity() > 2 * kTargetWriteWindow) {
+      buffer_.shrink_to_fit();
+    }
+    return true;
+  }
+
+  const std::string partition_;
+  std::string buffer_;
+  size_t size_ = 0;
+  unique_fd fd_;
+  bool streaming_ = false;
+  bool failed_ = false;
+};
+
+// Reads back the first |len| bytes of the partition, and checks them against the expected SHA-1.
+static bool VerifyPartition(const std::string& partition, size_t len,
+                            const uint8_t sha1[SHA_DIGEST_LENGTH]) {
+  DropCaches();
+  unique_fd fd(ota_open(partition.c_str(), O_RDONLY));
+  if (fd == -1) {
+    printf("failed to reopen %s for verify: %s\n", partition.c_str(), strerror(errno));
+    return false;
+  }
+
+  size_t remaining = len;
+  auto reader = [&partition, &fd, &remaining](uint8_t* buffer, size_t capacity) -> ssize_t {
+    size_t to_read = std::min(capacity, remaining);
+    size_t so_far = 0;
+    while (so_far < to_read) {
+      ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, buffer + so_far, to_read - so_far));
+      if (read_count <= 0) {
+        printf("verify read error %s at %zu: %s\n", partition.c_str(), so_far,
+               read_count == 0 ? "unexpected EOF" : strerror(errno));
+        return -1;
+      }
+      so_far += read_count;
+    }
+    remaining -= to_read;
+    return to_read;
+  };
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  if (!ComputeStreamDigest(HashAlgorithm::SHA1, kTargetWriteWindow, reader, digest)) {
+    return false;
+  }
+  if (memcmp(digest, sha1, SHA_DIGEST_LENGTH) != 0) {
+    printf("verification of %s failed: %s\n", partition.c_str(), short_sha1(digest).c_str());
+    return false;
+  }
+  return true;
+}
+
 static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
                           const std::string& target_filename,
                           const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data) {
@@ -625,44 +757,63 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
     return 1;
   }
 
-  // We store the decoded output in memory.
-  std::string memory_sink_str;  // Don't need to reserve space.
-  SinkFn sink = [&memory_sink_str](const unsigned char* data, size_t len) {
-    memory_sink_str.append(reinterpret_cast<const char*>(data), len);
-    return len;
-  };
-
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
+  std::string partition = android::base::Split(target_filename, ":")[1];
+  // A streamed target gets regenerated if it doesn't read back correctly, the same way as
+  // WriteToPartition() retries the write.
+  for (size_t attempt = 0; attempt < 2; ++attempt) {
+    TargetWriter writer(partition);
+    SinkFn sink = [&writer](const unsigned char* data, size_t len) {
+      return writer.Write(data, len);
+    };
+
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+
+    int result;
+    if (use_bsdiff) {
+      result =
+          ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
+    } else {
+      result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink,
+                               &ctx, bonus_data);
+    }
 
-  int result;
-  if (use_bsdiff) {
-    result =
-        ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
-  } else {
-    result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink, &ctx,
-                             bonus_data);
-  }
+    if (result != 0) {
+      printf("applying patch failed\n");
+      return 1;
+    }
 
-  if (result != 0) {
-    printf("applying patch failed\n");
-    return 1;
-  }
+    uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
+    SHA1_Final(current_target_sha1, &ctx);
+    if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
+      printf("patch did not produce expected sha1\n");
+      return 1;
+    } else {
+      printf("now %s\n", short_sha1(target_sha1).c_str());
+    }
 
-  uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
-  SHA1_Final(current_target_sha1, &ctx);
-  if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
-    printf("patch did not produce expected sha1\n");
-    return 1;
-  } else {
-    printf("now %s\n", short_sha1(target_sha1).c_str());
-  }
+    if (!writer.streaming()) {
+      // Write back the output in memory to the partition.
+      if (WriteToPartition(reinterpret_cast<const unsigned char*>(writer.data().c_str()),
+                           writer.size(), target_filename) != 0) {
+        printf("write of patched data to %s failed\n", target_filename.c_str());
+        return 1;
+      }
+      break;
+    }
 
-  // Write back the temp file to the partition.
-  if (WriteToPartition(reinterpret_cast<const unsigned char*>(memory_sink_str.c_str()),
-                       memory_sink_str.size(), target_filename) != 0) {
-    printf("write of patched data to %s failed\n", target_filename.c_str());
-    return 1;
+    if (!writer.Finish()) {
+      printf("write of patched data to %s failed\n", target_filename.c_str());
+      return 1;
+    }
+    if (VerifyPartition(partition, writer.size(), target_sha1)) {
+      printf("verification read succeeded (attempt %zu)\n", attempt + 1);
+      break;
+    }
+    if (attempt == 1) {
+      printf("failed to verify after all attempts\n");
+      return 1;
+    }
   }
 
   // Delete the backup copy of the source.
@@ -83,6 +83,17 @@ static int PatchMode(int argc, const char** argv) {
     FileContents bonusFc;
     Value bonus(VAL_INVALID, "");
 
+    if (argc >= 3 && strcmp(argv[1], "-m") == 0) {
+        size_t budget;
+        if (!android::base::ParseUint(argv[2], &budget)) {
+            printf("can't parse \"%s\" as byte count\n\n", argv[2]);
+            return 1;
+        }
+        SetPatchMemoryBudget(budget);
+        argc -= 2;
+        argv += 2;
+    }
+
     if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
         if (LoadFileContents(argv[2], &bonusFc) != 0) {
             printf("failed to load bonus file %s\n", argv[2]);
@@ -151,6 +162,9 @@ static int PatchMode(int argc, const char** argv) {
 // - otherwise, or if any error is encountered, exits with non-zero
 //   status.
 //
+// -m limits the memory used for the patched output and the inflated
+// source chunks (see SetPatchMemoryBudget()).
+//
 // <src-file> (or <file> in check mode) may refer to an EMMC partition
 // to read the source data.  See the comments for the
 // LoadPartitionContents() function for the format of such a filename.
@@ -159,8 +173,8 @@ int applypatch_modes(int argc, const char** argv) {
     if (argc < 2) {
       usage:
         printf(
-            "usage: %s [-b <bonus-file>] <src-file> <tgt-file> <tgt-sha1> <tgt-size> "
-            "[<src-sha1>:<patch> ...]\n"
+            "usage: %s [-m <memory-budget>] [-b <bonus-file>] <src-file> <tgt-file> <tgt-sha1> "
+            "<tgt-size> [<src-sha1>:<patch> ...]\n"
             "   or  %s -c <file> [<sha1> ...]\n"
             "   or  %s -l\n"
             "\n"
@@ -148,12 +148,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -164,10 +169,15 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <bsdiff/bsdiff.h>
+#include <bsdiff/control_entry.h>
+#include <bsdiff/patch_writer_interface.h>
+#include <bzlib.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
 #include "applypatch/imgdiff_image.h"
+#include "otautil/hash.h"
+#include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
 
 using android::base::get_unaligned;
@@ -179,6 +189,11 @@ static_assert(VERSION <= 9, "VERSION occupies more than one byte");
 
 static constexpr size_t BLOCK_SIZE = 4096;
 static constexpr size_t BUFFER_SIZE = 0x8000;
+// TryReconstruction() compares the deflate output against the chunk in pieces of this size, so
+// that a mismatch stops the deflation early.
+static constexpr size_t RECONSTRUCTION_WINDOW = 4096;
+// The uncompressed size from which ReconstructDeflateChunk() tries the deflate levels concurrently.
+static constexpr size_t CONCURRENT_RECONSTRUCTION_SIZE = 1024 * 1024;
 
 // If we use this function to write the offset and length (type size_t), their values should not
 // exceed 2^63; because the signed bit will be casted away.
@@ -252,35 +267,251 @@ static const struct option OPTIONS[] = {
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
+  { "jobs", required_argument, nullptr, 'j' },
+  { "deflate-cache", required_argument, nullptr, 0 },
   { nullptr, 0, nullptr, 0 },
 };
 
-ImageChunk::ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content,
+// Runs job(0) .. job(count - 1) on up to |num_threads| threads, including the calling one. Jobs
+// are handed out in order; once a job fails, no further ones get started.
+static bool RunJobs(size_t count, size_t num_threads, const std::function<bool(size_t)>& job) {
+  num_threads = std::min(num_threads, count);
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      if (!job(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    size_t i;
+    while (!failed && (i = next++) < count) {
+      if (!job(i)) {
+        failed = true;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return !failed;
+}
+
+// Collects a bsdiff patch in memory, in the legacy "BSDIFF40" format that bspatch reads (and that
+// bsdiff writes to a file): the header, then the bzip2-compressed control, diff and extra streams.
+class MemoryPatchWriter : public bsdiff::PatchWriterInterface {
+ public:
+  explicit MemoryPatchWriter(std::vector<uint8_t>* patch) : patch_(patch) {}
+
+  bool Init(size_t /* new_size */) override {
+    return true;
+  }
+
+  bool WriteDiffStream(const uint8_t* data, size_t size) override {
+    diff_.insert(diff_.end(), data, data + size);
+    return true;
+  }
+
+  bool WriteExtraStream(const uint8_t* data, size_t size) override {
+    extra_.insert(extra_.end(), data, data + size);
+    return true;
+  }
+
+  bool AddControlEntry(const bsdiff::ControlEntry& entry) override {
+    uint8_t buf[24];
+    EncodeInt64(entry.diff_size, buf);
+    EncodeInt64(entry.extra_size, buf + 8);
+    EncodeInt64(entry.offset_increment, buf + 16);
+    ctrl_.insert(ctrl_.end(), buf, buf + sizeof(buf));
+    // The control entries cover the whole target.
+    new_size_ += entry.diff_size + entry.extra_size;
+    return true;
+  }
+
+  bool Close() override {
+    std::vector<uint8_t> ctrl;
+    std::vector<uint8_t> diff;
+    std::vector<uint8_t> extra;
+    if (!Compress(ctrl_, &ctrl) || !Compress(diff_, &diff) || !Compress(extra_, &extra)) {
+      return false;
+    }
+
+    uint8_t header[32];
+    memcpy(header, "BSDIFF40", 8);
+    EncodeInt64(ctrl.size(), header + 8);
+    EncodeInt64(diff.size(), header + 16);
+    EncodeInt64(new_size_, header + 24);
+
+    patch_->clear();
+    patch_->reserve(sizeof(header) + ctrl.size() + diff.size() + extra.size());
+    patch_->insert(patch_->end(), header, header + sizeof(header));
+    patch_->insert(patch_->end(), ctrl.begin(), ctrl.end());
+    patch_->insert(patch_->end(), diff.begin(), diff.end());
+    patch_->insert(patch_->end(), extra.begin(), extra.end());
+    return true;
+  }
+
+ private:
+  // bsdiff's sign-magnitude encoding of the header and control fields.
+  static void EncodeInt64(int64_t x, uint8_t* buf) {
+    uint64_t y = x < 0 ? (static_cast<uint64_t>(-x) | (1ULL << 63)) : static_cast<uint64_t>(x);
+    for (size_t i = 0; i < 8; i++) {
+      buf[i] = static_cast<uint8_t>(y >> (8 * i));
+    }
+  }
+
+  static bool Compress(const std::vector<uint8_t>& data, std::vector<uint8_t>* out) {
+    // Same settings as bsdiff: 900k blocks, default work factor.
+    bz_stream stream = {};
+    int ret = BZ2_bzCompressInit(&stream, 9, 0, 0);
+    if (ret != BZ_OK) {
+      LOG(ERROR) << "Failed to init bzip2 compression: " << ret;
+      return false;
+    }
+    stream.next_in = reinterpret_cast<char*>(const_cast<uint8_t*>(data.data()));
+    stream.avail_in = data.size();
+    out->resize(data.size() + data.size() / 100 + 600);
+    do {
+      if (stream.total_out_lo32 == out->size()) {
+        out->resize(out->size() * 2);
+      }
+      stream.next_out = reinterpret_cast<char*>(out->data() + stream.total_out_lo32);
+      stream.avail_out = out->size() - stream.total_out_lo32;
+      ret = BZ2_bzCompress(&stream, BZ_FINISH);
+    } while (ret == BZ_FINISH_OK);
+    BZ2_bzCompressEnd(&stream);
+    if (ret != BZ_STREAM_END) {
+      LOG(ERROR) << "Failed to bzip2 " << data.size() << " bytes: " << ret;
+      return false;
+    }
+    out->resize(stream.total_out_lo32);
+    return true;
+  }
+
+  std::vector<uint8_t>* patch_;
+  size_t new_size_ = 0;
+  std::vector<uint8_t> ctrl_;
+  std::vector<uint8_t> diff_;
+  std::vector<uint8_t> extra_;
+};
+
+FileContent::FileContent(FileContent&& other) noexcept
+    : mapped_(other.mapped_),
+      memory_(std::move(other.memory_)),
+      data_(other.data_),
+      size_(other.size_) {
+  other.mapped_ = nullptr;
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+FileContent& FileContent::operator=(FileContent&& other) noexcept {
+  if (this != &other) {
+    Reset();
+    mapped_ = other.mapped_;
+    memory_ = std::move(other.memory_);
+    data_ = other.data_;
+    size_ = other.size_;
+    other.mapped_ = nullptr;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+FileContent::~FileContent() {
+  Reset();
+}
+
+void FileContent::Reset() {
+  if (mapped_ != nullptr) {
+    munmap(mapped_, size_);
+    mapped_ = nullptr;
+  }
+  memory_.clear();
+  data_ = nullptr;
+  size_ = 0;
+}
+
+bool FileContent::Map(const std::string& filename) {
+  Reset();
+
+  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    PLOG(ERROR) << "Failed to stat " << filename;
+    return false;
+  }
+
+  size_t sz = static_cast<size_t>(st.st_size);
+  // mmap() doesn't take empty files.
+  if (sz == 0) {
+    return true;
+  }
+  void* mapped = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapped == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map " << filename;
+    return false;
+  }
+  mapped_ = mapped;
+  data_ = static_cast<const uint8_t*>(mapped);
+  size_ = sz;
+  return true;
+}
+
+void FileContent::Assign(std::vector<uint8_t> data) {
+  Reset();
+  memory_ = std::move(data);
+  data_ = memory_.data();
+  size_ = memory_.size();
+}
+
+ImageChunk::ImageChunk(int type, size_t start, const FileContent* file_content,
                        size_t raw_data_len, std::string entry_name)
     : type_(type),
       start_(start),
-      input_file_ptr_(file_content),
+      input_data_(file_content->data()),
+      input_size_(file_content->size()),
       raw_data_len_(raw_data_len),
       compress_level_(6),
-      entry_name_(std::move(entry_name)) {
-  CHECK(file_content != nullptr) << "input file container can't be nullptr";
-}
+      uncompressed_len_(0),
+      has_crc32_(false),
+      crc32_(0),
+      entry_name_(std::move(entry_name)) {}
 
 const uint8_t* ImageChunk::GetRawData() const {
-  CHECK_LE(start_ + raw_data_len_, input_file_ptr_->size());
-  return input_file_ptr_->data() + start_;
+  CHECK_LE(start_ + raw_data_len_, input_size_);
+  return input_data_ + start_;
 }
 
-const uint8_t * ImageChunk::DataForPatch() const {
+bool ImageChunk::DataForPatch(std::vector<uint8_t>* buffer, const uint8_t** data) const {
   if (type_ == CHUNK_DEFLATE) {
-    return uncompressed_data_.data();
+    if (!Inflate(buffer)) {
+      return false;
+    }
+    *data = buffer->data();
+    return true;
   }
-  return GetRawData();
+  *data = GetRawData();
+  return true;
 }
 
 size_t ImageChunk::DataLengthForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
-    return uncompressed_data_.size();
+    return uncompressed_len_;
   }
   return raw_data_len_;
 }
@@ -298,15 +529,61 @@ bool ImageChunk::operator==(const ImageChunk& other) const {
           memcmp(GetRawData(), other.GetRawData(), raw_data_len_) == 0);
 }
 
-void ImageChunk::SetUncompressedData(std::vector<uint8_t> data) {
-  uncompressed_data_ = std::move(data);
+void ImageChunk::SetUncompressedLength(size_t length) {
+  uncompressed_len_ = length;
+}
+
+void ImageChunk::SetCrc32(uint32_t crc) {
+  has_crc32_ = true;
+  crc32_ = crc;
 }
 
 bool ImageChunk::SetBonusData(const std::vector<uint8_t>& bonus_data) {
   if (type_ != CHUNK_DEFLATE) {
     return false;
   }
-  uncompressed_data_.insert(uncompressed_data_.end(), bonus_data.begin(), bonus_data.end());
+  bonus_data_.insert(bonus_data_.end(), bonus_data.begin(), bonus_data.end());
+  uncompressed_len_ += bonus_data.size();
+  return true;
+}
+
+bool ImageChunk::Inflate(std::vector<uint8_t>* data) const {
+  size_t inflated_len = uncompressed_len_ - bonus_data_.size();
+  // inflate() doesn't like strm.next_out being a nullptr, even with avail_out being zero.
+  data->resize(std::max<size_t>(uncompressed_len_, 1));
+
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = raw_data_len_;
+  strm.next_in = GetRawData();
+  strm.avail_out = inflated_len;
+  strm.next_out = data->data();
+  int ret = inflateInit2(&strm, WINDOWBITS);
+  if (ret != Z_OK) {
+    LOG(ERROR) << "Failed to initialize inflate: " << ret;
+    return false;
+  }
+  ret = inflate(&strm, Z_FINISH);
+  size_t remaining = strm.avail_out;
+  inflateEnd(&strm);
+  if (ret != Z_STREAM_END || remaining != 0) {
+    LOG(ERROR) << "Failed to inflate " << raw_data_len_ << " bytes at " << start_ << " ["
+               << entry_name_ << "] into " << inflated_len << " bytes: " << ret;
+    return false;
+  }
+  if (has_crc32_) {
+    uint32_t crc = crc32(0, data->data(), inflated_len);
+    if (crc != crc32_) {
+      LOG(ERROR) << "CRC mismatch of [" << entry_name_ << "]: expected " << std::hex << crc32_
+                 << ", got " << crc << std::dec;
+      return false;
+    }
+  }
+
+  data->resize(uncompressed_len_);
+  std::copy(bonus_data_.begin(), bonus_data_.end(), data->begin() + inflated_len);
   return true;
 }
 
@@ -314,7 +591,9 @@ void ImageChunk::ChangeDeflateChunkToNormal() {
   if (type_ != CHUNK_DEFLATE) return;
   type_ = CHUNK_NORMAL;
   // No need to clear the entry name.
-  uncompressed_data_.clear();
+  uncompressed_len_ = 0;
+  bonus_data_.clear();
+  has_crc32_ = false;
 }
 
 bool ImageChunk::IsAdjacentNormal(const ImageChunk& other) const {
@@ -332,100 +611,136 @@ void ImageChunk::MergeAdjacentNormal(const ImageChunk& other) {
 bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
                            std::vector<uint8_t>* patch_data,
                            bsdiff::SuffixArrayIndexInterface** bsdiff_cache) {
-#if defined(__ANDROID__)
-  char ptemp[] = "/data/local/tmp/imgdiff-patch-XXXXXX";
-#else
-  char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-#endif
-
-  int fd = mkstemp(ptemp);
-  if (fd == -1) {
-    PLOG(ERROR) << "MakePatch failed to create a temporary file";
+  // The inflated data of deflate chunks is only held for this call.
+  std::vector<uint8_t> src_buffer;
+  std::vector<uint8_t> tgt_buffer;
+  const uint8_t* src_data;
+  const uint8_t* tgt_data;
+  if (!src.DataForPatch(&src_buffer, &src_data) || !tgt.DataForPatch(&tgt_buffer, &tgt_data)) {
     return false;
   }
-  close(fd);
 
-  int r = bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
-                         tgt.DataLengthForPatch(), ptemp, bsdiff_cache);
+  MemoryPatchWriter patch_writer(patch_data);
+  int r = bsdiff::bsdiff(src_data, src.DataLengthForPatch(), tgt_data, tgt.DataLengthForPatch(),
+                         &patch_writer, bsdiff_cache);
   if (r != 0) {
     LOG(ERROR) << "bsdiff() failed: " << r;
     return false;
   }
+  return true;
+}
 
-  android::base::unique_fd patch_fd(open(ptemp, O_RDONLY));
-  if (patch_fd == -1) {
-    PLOG(ERROR) << "Failed to open " << ptemp;
-    return false;
-  }
-  struct stat st;
-  if (fstat(patch_fd, &st) != 0) {
-    PLOG(ERROR) << "Failed to stat patch file " << ptemp;
+bool ImageChunk::ReconstructDeflateChunk(bool* reconstructed, DeflateReconstructionCache* cache) {
+  if (type_ != CHUNK_DEFLATE) {
+    LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
     return false;
   }
 
-  size_t sz = static_cast<size_t>(st.st_size);
-
-  patch_data->resize(sz);
-  if (!android::base::ReadFully(patch_fd, patch_data->data(), sz)) {
-    PLOG(ERROR) << "Failed to read " << ptemp;
-    unlink(ptemp);
+  // The uncompressed data is only inflated when the result isn't in the cache, and dropped
+  // afterwards.
+  auto find_compress_level = [this](int* level) {
+    std::vector<uint8_t> uncompressed;
+    if (!Inflate(&uncompressed)) {
+      return false;
+    }
+    *level = FindCompressLevel(uncompressed);
+    return true;
+  };
+
+  std::string key;
+  int level;
+  if (cache != nullptr) {
+    key = DeflateReconstructionCache::Key(GetRawData(), raw_data_len_);
+    if (cache->Find(key, &level)) {
+      LOG(INFO) << "Reusing the cached deflate level " << level << " for " << entry_name_;
+    } else {
+      if (!find_compress_level(&level)) {
+        return false;
+      }
+      cache->Insert(key, level);
+    }
+  } else if (!find_compress_level(&level)) {
     return false;
   }
 
-  unlink(ptemp);
-
+  *reconstructed = (level != 0);
+  if (level != 0) {
+    compress_level_ = level;
+  }
   return true;
 }
 
-bool ImageChunk::ReconstructDeflateChunk() {
-  if (type_ != CHUNK_DEFLATE) {
-    LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
-    return false;
-  }
-
+int ImageChunk::FindCompressLevel(const std::vector<uint8_t>& uncompressed) const {
   // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
   // (the maximum).
-  for (int level = 6; level <= 9; level += 3) {
-    if (TryReconstruction(level)) {
-      compress_level_ = level;
-      return true;
+  if (uncompressed.size() < CONCURRENT_RECONSTRUCTION_SIZE) {
+    for (int level = 6; level <= 9; level += 3) {
+      if (TryReconstruction(uncompressed, level)) {
+        return level;
+      }
     }
+    return 0;
   }
 
-  return false;
+  // For large chunks, try level 9 on another thread meanwhile. Level 6 still takes precedence if
+  // both match, so that the result doesn't depend on the timing.
+  std::atomic<bool> cancel(false);
+  bool level9_matches = false;
+  std::thread level9_thread([this, &uncompressed, &cancel, &level9_matches]() {
+    level9_matches = TryReconstruction(uncompressed, 9, &cancel);
+  });
+  bool level6_matches = TryReconstruction(uncompressed, 6);
+  if (level6_matches) {
+    cancel = true;
+  }
+  level9_thread.join();
+
+  if (level6_matches) {
+    return 6;
+  }
+  return level9_matches ? 9 : 0;
 }
 
 /*
- * Takes the uncompressed data stored in the chunk, compresses it using the zlib parameters stored
- * in the chunk, and checks that it matches exactly the compressed data we started with (also
+ * Takes the uncompressed data of the chunk, compresses it using the zlib parameters stored in the
+ * chunk, and checks that it matches exactly the compressed data we started with (also
  * stored in the chunk).
  */
-bool ImageChunk::TryReconstruction(int level) {
+bool ImageChunk::TryReconstruction(const std::vector<uint8_t>& uncompressed, int level,
+                                   const std::atomic<bool>* cancel) const {
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  strm.avail_in = uncompressed_data_.size();
-  strm.next_in = uncompressed_data_.data();
+  strm.avail_in = uncompressed.size();
+  strm.next_in = uncompressed.data();
   int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
   if (ret < 0) {
     LOG(ERROR) << "Failed to initialize deflate: " << ret;
     return false;
   }
 
-  std::vector<uint8_t> buffer(BUFFER_SIZE);
+  const uint8_t* expected = GetRawData();
+  std::vector<uint8_t> buffer(RECONSTRUCTION_WINDOW);
   size_t offset = 0;
   do {
+    if (cancel != nullptr && *cancel) {
+      deflateEnd(&strm);
+      return false;
+    }
+
     strm.avail_out = buffer.size();
     strm.next_out = buffer.data();
     ret = deflate(&strm, Z_FINISH);
     if (ret < 0) {
       LOG(ERROR) << "Failed to deflate: " << ret;
+      deflateEnd(&strm);
       return false;
     }
 
     size_t compressed_size = buffer.size() - strm.avail_out;
-    if (memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
+    if (compressed_size > raw_data_len_ - offset ||
+        memcmp(buffer.data(), expected + offset, compressed_size) != 0) {
       // mismatch; data isn't the same.
       deflateEnd(&strm);
       return false;
@@ -441,6 +756,66 @@ bool ImageChunk::TryReconstruction(int level) {
   return true;
 }
 
+bool DeflateReconstructionCache::Load() {
+  std::string content;
+  if (!android::base::ReadFileToString(path_, &content)) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    PLOG(ERROR) << "Failed to read the deflate cache " << path_;
+    return false;
+  }
+
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::vector<std::string> fields = android::base::Split(line, " ");
+    int level;
+    // Skip the malformed lines, e.g. a partial one from an interrupted run.
+    if (fields.size() != 2 || fields[0].size() != 2 * SHA256_DIGEST_LENGTH ||
+        !android::base::ParseInt(fields[1], &level, 0, 9)) {
+      continue;
+    }
+    entries_[fields[0]] = level;
+  }
+  LOG(INFO) << "Loaded " << entries_.size() << " entries from the deflate cache " << path_;
+  return true;
+}
+
+std::string DeflateReconstructionCache::Key(const uint8_t* data, size_t length) {
+  // The zlib version goes into the key, as a different deflate implementation may not produce the
+  // same output.
+  std::string version = zlibVersion();
+  HashContext ctx(HashAlgorithm::SHA256);
+  ctx.Update(reinterpret_cast<const uint8_t*>(version.c_str()), version.size() + 1);
+  ctx.Update(data, length);
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  ctx.Final(digest);
+  return print_hex(digest, SHA256_DIGEST_LENGTH);
+}
+
+bool DeflateReconstructionCache::Find(const std::string& key, int* level) const {
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+  *level = it->second;
+  return true;
+}
+
+void DeflateReconstructionCache::Insert(const std::string& key, int level) {
+  entries_[key] = level;
+
+  // A single O_APPEND write per entry keeps the lines intact when several processes share the file.
+  android::base::unique_fd fd(open(path_.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644));
+  if (fd == -1) {
+    PLOG(WARNING) << "Failed to open the deflate cache " << path_;
+    return;
+  }
+  std::string line = key + " " + std::to_string(level) + "\n";
+  if (!android::base::WriteStringToFd(line, fd)) {
+    PLOG(WARNING) << "Failed to write to the deflate cache " << path_;
+  }
+}
+
 PatchChunk::PatchChunk(const ImageChunk& tgt, const ImageChunk& src, std::vector<uint8_t> data)
     : type_(tgt.GetType()),
       source_start_(src.GetStartOffset()),
@@ -462,7 +837,12 @@ PatchChunk::PatchChunk(const ImageChunk& tgt)
       target_len_(tgt.GetRawDataLength()),
       target_uncompressed_len_(tgt.DataLengthForPatch()),
       target_compress_level_(tgt.GetCompressLevel()),
-      data_(tgt.DataForPatch(), tgt.DataForPatch() + tgt.DataLengthForPatch()) {}
+      data_() {
+  std::vector<uint8_t> buffer;
+  const uint8_t* data;
+  CHECK(tgt.DataForPatch(&buffer, &data));
+  data_.assign(data, data + tgt.DataLengthForPatch());
+}
 
 // Return true if raw data is smaller than the patch size.
 bool PatchChunk::RawDataIsSmaller(const ImageChunk& tgt, size_t patch_size) {
@@ -618,29 +998,9 @@ void Image::DumpChunks() const {
   }
 }
 
-bool Image::ReadFile(const std::string& filename, std::vector<uint8_t>* file_content) {
+bool Image::ReadFile(const std::string& filename, FileContent* file_content) {
   CHECK(file_content != nullptr);
-
-  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
-  if (fd == -1) {
-    PLOG(ERROR) << "Failed to open " << filename;
-    return false;
-  }
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    PLOG(ERROR) << "Failed to stat " << filename;
-    return false;
-  }
-
-  size_t sz = static_cast<size_t>(st.st_size);
-  file_content->resize(sz);
-  if (!android::base::ReadFully(fd, file_content->data(), sz)) {
-    PLOG(ERROR) << "Failed to read " << filename;
-    return false;
-  }
-  fd.reset();
-
-  return true;
+  return file_content->Map(filename);
 }
 
 bool ZipModeImage::Initialize(const std::string& filename) {
@@ -704,7 +1064,7 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
   // For source chunks, we don't need to compose chunks for the metadata.
   if (is_source_) {
     for (auto& entry : temp_entries) {
-      if (!AddZipEntryToChunks(handle, entry.first, &entry.second)) {
+      if (!AddZipEntryToChunks(entry.first, &entry.second)) {
         LOG(ERROR) << "Failed to add " << entry.first << " to source chunks";
         return false;
       }
@@ -732,7 +1092,7 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
         static_cast<off64_t>(pos) == temp_entries[nextentry].second.offset) {
       // Add the next zip entry.
       std::string entry_name = temp_entries[nextentry].first;
-      if (!AddZipEntryToChunks(handle, entry_name, &temp_entries[nextentry].second)) {
+      if (!AddZipEntryToChunks(entry_name, &temp_entries[nextentry].second)) {
         LOG(ERROR) << "Failed to add " << entry_name << " to target chunks";
         return false;
       }
@@ -757,8 +1117,7 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
   return true;
 }
 
-bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name,
-                                       ZipEntry* entry) {
+bool ZipModeImage::AddZipEntryToChunks(const std::string& entry_name, ZipEntry* entry) {
   size_t compressed_len = entry->compressed_length;
   if (compressed_len == 0) return true;
 
@@ -775,16 +1134,10 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
       compressed_len -= length;
     }
   } else if (entry->method == kCompressDeflated) {
-    size_t uncompressed_len = entry->uncompressed_length;
-    std::vector<uint8_t> uncompressed_data(uncompressed_len);
-    int ret = ExtractToMemory(handle, entry, uncompressed_data.data(), uncompressed_len);
-    if (ret != 0) {
-      LOG(ERROR) << "Failed to extract " << entry_name << " with size " << uncompressed_len << ": "
-                 << ErrorCodeString(ret);
-      return false;
-    }
+    // The entry gets inflated from the mapped file when it's needed.
     ImageChunk curr(CHUNK_DEFLATE, entry->offset, &file_content_, compressed_len, entry_name);
-    curr.SetUncompressedData(std::move(uncompressed_data));
+    curr.SetUncompressedLength(entry->uncompressed_length);
+    curr.SetCrc32(entry->crc32);
     chunks_.push_back(std::move(curr));
   } else {
     chunks_.emplace_back(CHUNK_NORMAL, entry->offset, &file_content_, compressed_len, entry_name);
@@ -809,11 +1162,11 @@ bool ZipModeImage::GetZipFileSize(size_t* input_file_size) {
   // zip_file size.
   for (int i = file_content_.size() - 22; i >= 0; i--) {
     if (file_content_[i] == 0x50) {
-      if (get_unaligned<uint32_t>(&file_content_[i]) == 0x06054b50) {
+      if (get_unaligned<uint32_t>(file_content_.data() + i) == 0x06054b50) {
         // double-check: this archive consists of a single "disk".
-        CHECK_EQ(get_unaligned<uint16_t>(&file_content_[i + 4]), 0);
+        CHECK_EQ(get_unaligned<uint16_t>(file_content_.data() + i + 4), 0);
 
-        uint16_t comment_length = get_unaligned<uint16_t>(&file_content_[i + 20]);
+        uint16_t comment_length = get_unaligned<uint16_t>(file_content_.data() + i + 20);
         size_t file_size = i + 22 + comment_length;
         CHECK_LE(file_size, file_content_.size());
         *input_file_size = file_size;
@@ -861,12 +1214,15 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
       static_cast<const ZipModeImage*>(this)->FindChunkByName(name, find_normal));
 }
 
-bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
+bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                         DeflateReconstructionCache* cache) {
   for (auto& tgt_chunk : *tgt_image) {
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
     }
 
+    bool reconstructed;
+
     ImageChunk* src_chunk = src_image->FindChunkByName(tgt_chunk.GetEntryName());
     if (src_chunk == nullptr) {
       tgt_chunk.ChangeDeflateChunkToNormal();
@@ -877,7 +1233,10 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
       // trivial patch to the uncompressed data.
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!tgt_chunk.ReconstructDeflateChunk(&reconstructed, cache)) {
+      LOG(ERROR) << "Failed to inflate target deflate chunk [" << tgt_chunk.GetEntryName() << "]";
+      return false;
+    } else if (!reconstructed) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image. Treat the chunk as a normal non-deflated chunk.
       LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk.GetEntryName()
@@ -1043,8 +1402,8 @@ bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
   std::vector<uint8_t> src_content;
   for (const auto& r : split_src_ranges) {
     size_t end = std::min(src_image.file_content_.size(), r.second * BLOCK_SIZE);
-    src_content.insert(src_content.end(), src_image.file_content_.begin() + r.first * BLOCK_SIZE,
-                       src_image.file_content_.begin() + end);
+    src_content.insert(src_content.end(), src_image.file_content_.data() + r.first * BLOCK_SIZE,
+                       src_image.file_content_.data() + end);
   }
 
   // We should not have an empty src in our design; otherwise we will encounter an error in
@@ -1095,57 +1454,115 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
   }
 }
 
-bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
-                                           const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
-  LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
-  patch_chunks->clear();
-
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
-    const auto& tgt_chunk = tgt_image[i];
+bool ZipModeImage::GeneratePatchesInternal(const std::vector<const ZipModeImage*>& tgt_images,
+                                           const std::vector<const ZipModeImage*>& src_images,
+                                           std::vector<std::vector<PatchChunk>>* patch_chunks,
+                                           size_t num_threads) {
+  CHECK_EQ(tgt_images.size(), src_images.size());
+
+  // A tgt chunk to diff; |src_chunk| is nullptr if it's diffed against the whole src image.
+  struct Job {
+    size_t image;
+    size_t chunk;
+    const ImageChunk* src_chunk;
+    std::vector<uint8_t> patch_data;
+  };
+  std::vector<Job> jobs;
+  // The chunks without a matching source entry share the suffix array of their src image. The
+  // first of them in each image builds it; the others only read it, so they run afterwards.
+  std::vector<size_t> first_jobs;
+  std::vector<size_t> other_jobs;
+  for (size_t n = 0; n < tgt_images.size(); n++) {
+    const ZipModeImage& tgt_image = *tgt_images[n];
+    LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
+    bool found_first = false;
+    for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+      const auto& tgt_chunk = tgt_image[i];
+      if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
+        continue;
+      }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
-      continue;
+      const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
+                                        ? nullptr
+                                        : src_images[n]->FindChunkByName(tgt_chunk.GetEntryName());
+      if (src_chunk == nullptr && !found_first) {
+        first_jobs.push_back(jobs.size());
+        found_first = true;
+      } else {
+        other_jobs.push_back(jobs.size());
+      }
+      jobs.push_back({ n, i, src_chunk, {} });
     }
+  }
 
-    const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
-                                      ? nullptr
-                                      : src_image.FindChunkByName(tgt_chunk.GetEntryName());
-
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
+  std::vector<bsdiff::SuffixArrayIndexInterface*> bsdiff_caches(tgt_images.size(), nullptr);
+  auto make_patch = [&](Job* job) {
+    const auto& tgt_chunk = (*tgt_images[job->image])[job->chunk];
+    const auto& src_ref =
+        (job->src_chunk == nullptr) ? src_images[job->image]->PseudoSource() : *job->src_chunk;
     bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
+        (job->src_chunk == nullptr) ? &bsdiff_caches[job->image] : nullptr;
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
+    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &job->patch_data, bsdiff_cache_ptr)) {
       LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
       return false;
     }
+    return true;
+  };
+  bool success =
+      RunJobs(first_jobs.size(), num_threads,
+              [&](size_t i) { return make_patch(&jobs[first_jobs[i]]); }) &&
+      RunJobs(other_jobs.size(), num_threads,
+              [&](size_t i) { return make_patch(&jobs[other_jobs[i]]); });
+  for (auto cache : bsdiff_caches) {
+    delete cache;
+  }
+  if (!success) {
+    return false;
+  }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
-              << tgt_chunk.GetRawDataLength() << ")";
+  // Assemble the patch chunks in order, so the output doesn't depend on the number of threads.
+  patch_chunks->clear();
+  patch_chunks->resize(tgt_images.size());
+  auto job = jobs.begin();
+  for (size_t n = 0; n < tgt_images.size(); n++) {
+    const ZipModeImage& tgt_image = *tgt_images[n];
+    for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+      const auto& tgt_chunk = tgt_image[i];
+
+      if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
+        (*patch_chunks)[n].emplace_back(tgt_chunk);
+        continue;
+      }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
-      patch_chunks->emplace_back(tgt_chunk);
-    } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      CHECK(job != jobs.end() && job->image == n && job->chunk == i);
+      LOG(INFO) << "patch " << i << " is " << job->patch_data.size() << " bytes (of "
+                << tgt_chunk.GetRawDataLength() << ")";
+
+      if (PatchChunk::RawDataIsSmaller(tgt_chunk, job->patch_data.size())) {
+        (*patch_chunks)[n].emplace_back(tgt_chunk);
+      } else {
+        const auto& src_ref =
+            (job->src_chunk == nullptr) ? src_images[n]->PseudoSource() : *job->src_chunk;
+        (*patch_chunks)[n].emplace_back(tgt_chunk, src_ref, std::move(job->patch_data));
+      }
+      ++job;
     }
+    CHECK_EQ((*patch_chunks)[n].size(), tgt_image.NumOfChunks());
   }
-  delete bsdiff_cache;
 
-  CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
-  std::vector<PatchChunk> patch_chunks;
-
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+                                   const std::string& patch_name, size_t num_threads) {
+  std::vector<std::vector<PatchChunk>> patch_chunks;
+  if (!ZipModeImage::GeneratePatchesInternal({ &tgt_image }, { &src_image }, &patch_chunks,
+                                             num_threads)) {
+    return false;
+  }
 
-  CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
+  CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks[0].size());
 
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
@@ -1154,7 +1571,7 @@ bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeI
     return false;
   }
 
-  return PatchChunk::WritePatchDataToFd(patch_chunks, patch_fd);
+  return PatchChunk::WritePatchDataToFd(patch_chunks[0], patch_fd);
 }
 
 bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_images,
@@ -1162,9 +1579,24 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir, size_t num_threads) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
+  // Compute the patches of all the split images together, so that the threads get spread over the
+  // chunks of all of them.
+  std::vector<const ZipModeImage*> tgt_images;
+  std::vector<const ZipModeImage*> src_images;
+  for (size_t i = 0; i < split_tgt_images.size(); i++) {
+    tgt_images.push_back(&split_tgt_images[i]);
+    src_images.push_back(&split_src_images[i]);
+  }
+  std::vector<std::vector<PatchChunk>> split_patch_chunks;
+  if (!ZipModeImage::GeneratePatchesInternal(tgt_images, src_images, &split_patch_chunks,
+                                             num_threads)) {
+    LOG(ERROR) << "Failed to generate split patch";
+    return false;
+  }
+
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
   if (patch_fd == -1) {
@@ -1174,13 +1606,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
 
   std::vector<std::string> split_info_list;
   for (size_t i = 0; i < split_tgt_images.size(); i++) {
-    std::vector<PatchChunk> patch_chunks;
-    if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
-      LOG(ERROR) << "Failed to generate split patch";
-      return false;
-    }
-
+    std::vector<PatchChunk>& patch_chunks = split_patch_chunks[i];
     size_t total_patch_size = 12;
     for (auto& p : patch_chunks) {
       p.UpdateSourceOffset(split_src_ranges[i]);
@@ -1208,8 +1634,11 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
         PLOG(ERROR) << "Failed to open " << src_name;
         return false;
       }
-      if (!android::base::WriteFully(fd, split_src_images[i].PseudoSource().DataForPatch(),
-                                     split_src_images[i].PseudoSource().DataLengthForPatch())) {
+      ImageChunk pseudo_source = split_src_images[i].PseudoSource();
+      std::vector<uint8_t> buffer;
+      const uint8_t* data;
+      if (!pseudo_source.DataForPatch(&buffer, &data) ||
+          !android::base::WriteFully(fd, data, pseudo_source.DataLengthForPatch())) {
         PLOG(ERROR) << "Failed to write split source data into " << src_name;
         return false;
       }
@@ -1268,7 +1697,7 @@ bool ImageModeImage::Initialize(const std::string& filename) {
       pos += GZIP_HEADER_LEN;
 
       // We must decompress this chunk in order to discover where it ends, and so we can update
-      // the uncompressed_data of the image body and its length.
+      // the uncompressed length of the image body. The output is discarded as it goes.
 
       z_stream strm;
       strm.zalloc = Z_NULL;
@@ -1285,23 +1714,18 @@ bool ImageModeImage::Initialize(const std::string& filename) {
         return false;
       }
 
-      size_t allocated = BUFFER_SIZE;
-      std::vector<uint8_t> uncompressed_data(allocated);
+      std::vector<uint8_t> buffer(BUFFER_SIZE);
       size_t uncompressed_len = 0, raw_data_len = 0;
       do {
-        strm.avail_out = allocated - uncompressed_len;
-        strm.next_out = uncompressed_data.data() + uncompressed_len;
+        strm.avail_out = buffer.size();
+        strm.next_out = buffer.data();
         ret = inflate(&strm, Z_NO_FLUSH);
         if (ret < 0) {
           LOG(WARNING) << "Inflate failed [" << strm.msg << "] at offset [" << chunk_offset
                        << "]; treating as a normal chunk";
           break;
         }
-        uncompressed_len = allocated - strm.avail_out;
-        if (strm.avail_out == 0) {
-          allocated *= 2;
-          uncompressed_data.resize(allocated);
-        }
+        uncompressed_len += buffer.size() - strm.avail_out;
       } while (ret != Z_STREAM_END);
 
       raw_data_len = sz - strm.avail_in - pos;
@@ -1325,9 +1749,9 @@ bool ImageModeImage::Initialize(const std::string& filename) {
         continue;
       }
 
+      // Only the length is kept; the data gets inflated again when it's needed.
       ImageChunk body(CHUNK_DEFLATE, pos, &file_content_, raw_data_len);
-      uncompressed_data.resize(uncompressed_len);
-      body.SetUncompressedData(std::move(uncompressed_data));
+      body.SetUncompressedLength(uncompressed_len);
       chunks_.push_back(std::move(body));
 
       pos += raw_data_len;
@@ -1372,7 +1796,8 @@ bool ImageModeImage::SetBonusData(const std::vector<uint8_t>& bonus_data) {
 
 // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
 // same sequence of deflate and normal chunks).
-bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image) {
+bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                           DeflateReconstructionCache* cache) {
   // In image mode, merge the gzip header and footer in with any adjacent normal chunks.
   tgt_image->MergeAdjacentNormalChunks();
   src_image->MergeAdjacentNormalChunks();
@@ -1399,11 +1824,16 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
       continue;
     }
 
+    bool reconstructed;
     // If two deflate chunks are identical treat them as normal chunks.
     if (tgt_chunk == src_chunk) {
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk.ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!tgt_chunk.ReconstructDeflateChunk(&reconstructed, cache)) {
+      LOG(ERROR) << "Failed to inflate target deflate chunk " << i << " ["
+                 << tgt_chunk.GetEntryName() << "]";
+      return false;
+    } else if (!reconstructed) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image, fall back to normal
       LOG(WARNING) << "Failed to reconstruct target deflate chunk " << i << " ["
@@ -1430,8 +1860,23 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name, size_t num_threads) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
+  std::vector<std::vector<uint8_t>> patch_data(tgt_image.NumOfChunks());
+  bool success = RunJobs(tgt_image.NumOfChunks(), num_threads, [&](size_t i) {
+    if (PatchChunk::RawDataIsSmaller(tgt_image[i], 0)) {
+      return true;
+    }
+    if (!ImageChunk::MakePatch(tgt_image[i], src_image[i], &patch_data[i], nullptr)) {
+      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
+      return false;
+    }
+    return true;
+  });
+  if (!success) {
+    return false;
+  }
+
   std::vector<PatchChunk> patch_chunks;
   patch_chunks.reserve(tgt_image.NumOfChunks());
 
@@ -1444,18 +1889,13 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
       continue;
     }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
-      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
-      return false;
-    }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patch_data[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data[i].size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data[i]));
     }
   }
 
@@ -1478,12 +1918,14 @@ int imgdiff(int argc, const char** argv) {
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
+  size_t num_threads = 1;
+  std::string deflate_cache_file;
 
   int opt;
   int option_index;
   optind = 0;  // Reset the getopt state so that we can call it multiple times for test.
 
-  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:v", OPTIONS, &option_index)) !=
+  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:vj:", OPTIONS, &option_index)) !=
          -1) {
     switch (opt) {
       case 'z':
@@ -1512,6 +1954,12 @@ int imgdiff(int argc, const char** argv) {
       case 'v':
         verbose = true;
         break;
+      case 'j':
+        if (!android::base::ParseUint(optarg, &num_threads) || num_threads == 0) {
+          LOG(ERROR) << "Failed to parse the number of jobs: " << optarg;
+          return 1;
+        }
+        break;
       case 0: {
         std::string name = OPTIONS[option_index].name;
         if (name == "block-limit" && !android::base::ParseUint(optarg, &blocks_limit)) {
@@ -1521,6 +1969,8 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "deflate-cache") {
+          deflate_cache_file = optarg;
         }
         break;
       }
@@ -1546,10 +1996,22 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  -j <jobs>,        Compute the chunk patches on <jobs> threads. The patch is the\n"
+           "                    same as with a single thread.\n"
+           "  --deflate-cache,  File to remember which deflate chunks can be reconstructed, and\n"
+           "                    how, across runs.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
 
+  std::unique_ptr<DeflateReconstructionCache> deflate_cache;
+  if (!deflate_cache_file.empty()) {
+    deflate_cache = std::make_unique<DeflateReconstructionCache>(deflate_cache_file);
+    if (!deflate_cache->Load()) {
+      return 1;
+    }
+  }
+
   if (zip_mode) {
     ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE);
     ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE);
@@ -1561,7 +2023,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
+    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image, deflate_cache.get())) {
       return 1;
     }
 
@@ -1580,11 +2042,13 @@ int imgdiff(int argc, const char** argv) {
                                                &split_src_images, &split_src_ranges);
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir,
+                                         num_threads)) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2],
+                                              num_threads)) {
       return 1;
     }
   } else {
@@ -1598,7 +2062,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
+    if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image, deflate_cache.get())) {
       return 1;
     }
 
@@ -1606,7 +2070,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], num_threads)) {
       return 1;
     }
   }
@@ -20,24 +20,35 @@
 #include <applypatch/imgpatch.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/cdefs.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/macros.h>
 #include <android-base/memory.h>
+#include <android-base/unique_fd.h>
 #include <applypatch/applypatch.h>
 #include <applypatch/imgdiff.h>
 #include <openssl/sha.h>
 #include <zlib.h>
 
 #include "edify/expr.h"
+#include "otautil/cache_location.h"
 
 static inline int64_t Read8(const void *address) {
   return android::base::get_unaligned<int64_t>(address);
@@ -47,10 +58,91 @@ static inline int32_t Read4(const void *address) {
   return android::base::get_unaligned<int32_t>(address);
 }
 
+static size_t patch_memory_budget = kDefaultPatchMemoryBudget;
+
+void SetPatchMemoryBudget(size_t bytes) {
+  patch_memory_budget = bytes;
+}
+
+size_t PatchMemoryBudget() {
+  return patch_memory_budget;
+}
+
+static int (*make_spill_space)(size_t) = nullptr;
+
+void SetPatchSpillSpaceHandler(int (*make_free_space)(size_t bytes_needed)) {
+  make_spill_space = make_free_space;
+}
+
+// Holds the inflated source data of a deflate chunk. Anything larger than the memory budget goes
+// into an unlinked file next to the cached source copy, which gets mapped so that the kernel can
+// write back and drop its pages as needed while bspatch reads it.
+class ExpandedSource {
+ public:
+  ExpandedSource() = default;
+
+  ~ExpandedSource() {
+    if (mapped_ != nullptr) {
+      munmap(mapped_, size_);
+    }
+  }
+
+  void Allocate(size_t size) {
+    size_ = size;
+    if (size > PatchMemoryBudget() && AllocateFile()) {
+      return;
+    }
+    memory_.resize(size);
+  }
+
+  unsigned char* data() {
+    return mapped_ != nullptr ? mapped_ : memory_.data();
+  }
+
+ private:
+  bool AllocateFile() {
+    std::string dir = android::base::Dirname(CacheLocation::location().cache_temp_source());
+    if (make_spill_space != nullptr && make_spill_space(size_) < 0) {
+      LOG(WARNING) << "Failed to free " << size_ << " bytes in " << dir << "; inflating in memory";
+      return false;
+    }
+    std::string path = dir + "/imgpatch.XXXXXX";
+    android::base::unique_fd fd(mkstemp(&path[0]));
+    if (fd == -1) {
+      PLOG(WARNING) << "Failed to create the spill file in " << dir << "; inflating " << size_
+                    << " bytes in memory";
+      return false;
+    }
+    unlink(path.c_str());
+    // Reserve the blocks before mapping the file; running out of space while writing through the
+    // mapping would raise SIGBUS instead of an error.
+    int error = posix_fallocate(fd, 0, size_);
+    if (error != 0) {
+      errno = error;
+      PLOG(WARNING) << "Failed to reserve " << size_ << " bytes for the spill file; inflating in "
+                    << "memory";
+      return false;
+    }
+    void* mapped = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+      PLOG(WARNING) << "Failed to map the spill file";
+      return false;
+    }
+    mapped_ = static_cast<unsigned char*>(mapped);
+    return true;
+  }
+
+  std::vector<unsigned char> memory_;
+  unsigned char* mapped_ = nullptr;
+  size_t size_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(ExpandedSource);
+};
+
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
 // patched data and stream the deflated data to output.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
-                                            const Value& patch, size_t patch_offset,
+                                            const PatchSpan& patch, size_t patch_offset,
                                             const char* deflate_header, SinkFn sink, SHA_CTX* ctx) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   int level = Read4(deflate_header + 40);
@@ -134,32 +226,52 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
 
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
                     size_t patch_size, SinkFn sink) {
-  Value patch(VAL_BLOB, std::string(reinterpret_cast<const char*>(patch_data), patch_size));
+  PatchSpan patch = { patch_data, patch_size };
   return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr);
 }
 
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
                     SHA_CTX* ctx, const Value* bonus_data) {
-  if (patch.data.size() < 12) {
+  PatchSpan patch_span = { reinterpret_cast<const unsigned char*>(patch.data.data()),
+                           patch.data.size() };
+  return ApplyImagePatch(old_data, old_size, patch_span, sink, ctx, bonus_data);
+}
+
+// A chunk of an IMGDIFF2 patch, as described by its header record.
+struct PatchChunk {
+  int type;
+  // The normal or deflate chunk header, or the data of a raw chunk.
+  const char* header;
+  // The length of the raw chunk data.
+  size_t raw_len;
+  // The memory taken by applying the chunk away from the output, i.e. the inflated source plus the
+  // buffered output.
+  size_t cost;
+};
+
+// Reads the chunk records of an IMGDIFF2 patch, and checks them against the patch and the source.
+static bool ReadPatchChunks(size_t old_size, const PatchSpan& patch,
+                            std::vector<PatchChunk>* chunks) {
+  if (patch.size < 12) {
     printf("patch too short to contain header\n");
-    return -1;
+    return false;
   }
 
   // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
   // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
-  const char* const patch_header = patch.data.data();
+  const char* const patch_header = reinterpret_cast<const char*>(patch.data);
   if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
     printf("corrupt patch file header (magic number)\n");
-    return -1;
+    return false;
   }
 
   int num_chunks = Read4(patch_header + 8);
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
+    if (pos + 4 > patch.size) {
       printf("failed to read chunk %d record\n", i);
-      return -1;
+      return false;
     }
     int type = Read4(patch_header + pos);
     pos += 4;
@@ -167,125 +279,328 @@ int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value&
     if (type == CHUNK_NORMAL) {
       const char* normal_header = patch_header + pos;
       pos += 24;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size) {
         printf("failed to read chunk %d normal header data\n", i);
-        return -1;
+        return false;
       }
 
       size_t src_start = static_cast<size_t>(Read8(normal_header));
       size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
       size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
-
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
-        return -1;
+        return false;
       }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
+
+      // The target size is in the bsdiff header ("BSDIFF40", control length, diff length, target
+      // size). A bad header gets reported by bspatch; it's only a scheduling hint here.
+      size_t target_len = 0;
+      if (patch_offset <= patch.size && patch.size - patch_offset >= 32) {
+        target_len = static_cast<size_t>(Read8(patch_header + patch_offset + 24));
       }
+      chunks->push_back({ type, normal_header, 0, target_len });
     } else if (type == CHUNK_RAW) {
       const char* raw_header = patch_header + pos;
       pos += 4;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size) {
         printf("failed to read chunk %d raw header data\n", i);
-        return -1;
+        return false;
       }
 
       size_t data_len = static_cast<size_t>(Read4(raw_header));
-
-      if (pos + data_len > patch.data.size()) {
+      if (pos + data_len > patch.size) {
         printf("failed to read chunk %d raw data\n", i);
-        return -1;
-      }
-      if (ctx) {
-        SHA1_Update(ctx, patch_header + pos, data_len);
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
-        return -1;
+        return false;
       }
+      chunks->push_back({ type, patch_header + pos, data_len, 0 });
       pos += data_len;
     } else if (type == CHUNK_DEFLATE) {
       // deflate chunks have an additional 60 bytes in their chunk header.
       const char* deflate_header = patch_header + pos;
       pos += 60;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size) {
         printf("failed to read chunk %d deflate header data\n", i);
-        return -1;
+        return false;
       }
 
       size_t src_start = static_cast<size_t>(Read8(deflate_header));
       size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
       size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
-
+      size_t target_len = static_cast<size_t>(Read8(deflate_header + 32));
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
-        return -1;
+        return false;
       }
+      // The deflated output is bounded by the uncompressed target size, give or take the deflate
+      // overhead.
+      chunks->push_back({ type, deflate_header, 0, expanded_len + target_len });
+    } else {
+      printf("patch chunk %d is unknown type %d\n", i, type);
+      return false;
+    }
+  }
+  return true;
+}
 
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if
-      // the patch was constructed with bonus data.  The
-      // deflation will come up 'bonus_size' bytes short; these
-      // must be appended from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
+// Applies chunk |index| of the patch, writing its output to the given sink.
+static bool ApplyPatchChunk(const unsigned char* old_data, const PatchSpan& patch,
+                            const PatchChunk& chunk, size_t index, const Value* bonus_data,
+                            SinkFn sink, SHA_CTX* ctx) {
+  if (chunk.type == CHUNK_NORMAL) {
+    size_t src_start = static_cast<size_t>(Read8(chunk.header));
+    size_t src_len = static_cast<size_t>(Read8(chunk.header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(chunk.header + 16));
+    if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
+      printf("Failed to apply bsdiff patch.\n");
+      return false;
+    }
+  } else if (chunk.type == CHUNK_RAW) {
+    if (ctx) {
+      SHA1_Update(ctx, chunk.header, chunk.raw_len);
+    }
+    if (sink(reinterpret_cast<const unsigned char*>(chunk.header), chunk.raw_len) !=
+        chunk.raw_len) {
+      printf("failed to write chunk %zu raw data\n", index);
+      return false;
+    }
+  } else {
+    const char* deflate_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(deflate_header));
+    size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+    size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t bonus_size = (index == 1 && bonus_data != NULL) ? bonus_data->data.size() : 0;
+
+    ExpandedSource expanded_source;
+    expanded_source.Allocate(expanded_len);
+
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (expanded_len != 0) {
+      z_stream strm;
+      strm.zalloc = Z_NULL;
+      strm.zfree = Z_NULL;
+      strm.opaque = Z_NULL;
+      strm.avail_in = src_len;
+      strm.next_in = old_data + src_start;
+      strm.avail_out = expanded_len;
+      strm.next_out = expanded_source.data();
+
+      int ret = inflateInit2(&strm, -15);
+      if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        return false;
+      }
 
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
+      // Because we've provided enough room to accommodate the output
+      // data, we expect one call to inflate() to suffice.
+      ret = inflate(&strm, Z_SYNC_FLUSH);
+      if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        inflateEnd(&strm);
+        return false;
+      }
+      // We should have filled the output buffer exactly, except
+      // for the bonus_size.
+      if (strm.avail_out != bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
         inflateEnd(&strm);
+        return false;
+      }
+      inflateEnd(&strm);
+
+      if (bonus_size) {
+        memcpy(expanded_source.data() + (expanded_len - bonus_size), &bonus_data->data[0],
+               bonus_size);
+      }
+    }
+
+    if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
+                                         patch_offset, deflate_header, sink, ctx)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Applies the normal and deflate chunks of a patch on a pool of worker threads, and writes their
+// outputs to the sink in the chunk order. Each worker buffers the output of one chunk at a time;
+// chunks get handed out in order, and only while the in-flight chunks fit into the patch memory
+// budget (at least one is always allowed). Chunks that don't fit into the budget on their own,
+// and raw chunks, are applied by the calling thread when their turn comes, straight to the sink.
+class ParallelChunkPatcher {
+ public:
+  ParallelChunkPatcher(const unsigned char* old_data, const PatchSpan& patch,
+                       const std::vector<PatchChunk>& chunks, const Value* bonus_data)
+      : old_data_(old_data),
+        patch_(patch),
+        chunks_(chunks),
+        bonus_data_(bonus_data),
+        results_(chunks.size()) {
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+      if (chunks_[i].type != CHUNK_RAW && chunks_[i].cost <= PatchMemoryBudget()) {
+        queue_.push_back(i);
+      }
+    }
+  }
+
+  ~ParallelChunkPatcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      abort_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
 
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), &bonus_data->data[0],
-                 bonus_size);
+  // Returns the number of chunks that can be applied off the output thread.
+  size_t NumParallelChunks() const {
+    return queue_.size();
+  }
+
+  bool Run(size_t num_threads, SinkFn sink, SHA_CTX* ctx) {
+    max_in_flight_ = 2 * num_threads;
+    for (size_t i = 0; i < num_threads; ++i) {
+      workers_.emplace_back(&ParallelChunkPatcher::WorkerLoop, this);
+    }
+
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+      const PatchChunk& chunk = chunks_[i];
+      if (chunk.type == CHUNK_RAW || chunk.cost > PatchMemoryBudget()) {
+        if (!ApplyPatchChunk(old_data_, patch_, chunk, i, bonus_data_, sink, ctx)) {
+          return false;
         }
+        continue;
       }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink, ctx)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
-        return -1;
+      std::string output;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this, i] { return results_[i].done; });
+        if (!results_[i].ok) {
+          return false;
+        }
+        output = std::move(results_[i].output);
       }
 
-    } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
-      return -1;
+      if (ctx) {
+        SHA1_Update(ctx, output.data(), output.size());
+      }
+      if (sink(reinterpret_cast<const unsigned char*>(output.data()), output.size()) !=
+          output.size()) {
+        printf("failed to write chunk %zu output\n", i);
+        return false;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_bytes_ -= chunk.cost;
+        in_flight_chunks_--;
+      }
+      work_cv_.notify_all();
     }
+    return true;
   }
 
+ private:
+  struct Result {
+    bool done = false;
+    bool ok = false;
+    std::string output;
+  };
+
+  // Chunks get admitted in the queue order, so an admitted chunk never waits for the memory held
+  // by a later one.
+  bool CanAdmitNext() const {
+    size_t cost = chunks_[queue_[next_]].cost;
+    return in_flight_chunks_ < max_in_flight_ &&
+           (in_flight_chunks_ == 0 || in_flight_bytes_ + cost <= PatchMemoryBudget());
+  }
+
+  void WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_cv_.wait(lock, [this] { return abort_ || next_ == queue_.size() || CanAdmitNext(); });
+      if (abort_ || next_ == queue_.size()) {
+        return;
+      }
+      size_t index = queue_[next_++];
+      in_flight_bytes_ += chunks_[index].cost;
+      in_flight_chunks_++;
+      lock.unlock();
+
+      std::string output;
+      SinkFn buffer_sink = [&output](const unsigned char* data, size_t len) {
+        output.append(reinterpret_cast<const char*>(data), len);
+        return len;
+      };
+      bool ok = ApplyPatchChunk(old_data_, patch_, chunks_[index], index, bonus_data_, buffer_sink,
+                                nullptr);
+
+      lock.lock();
+      results_[index].done = true;
+      results_[index].ok = ok;
+      results_[index].output = std::move(output);
+      done_cv_.notify_all();
+      if (!ok) {
+        abort_ = true;
+        work_cv_.notify_all();
+      }
+    }
+  }
+
+  const unsigned char* old_data_;
+  const PatchSpan& patch_;
+  const std::vector<PatchChunk>& chunks_;
+  const Value* bonus_data_;
+
+  // Indices of the chunks for the workers, in order; next_ is the next one to hand out.
+  std::vector<size_t> queue_;
+  size_t next_ = 0;
+  std::vector<Result> results_;
+  size_t max_in_flight_ = 0;
+  size_t in_flight_chunks_ = 0;
+  size_t in_flight_bytes_ = 0;
+  bool abort_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelChunkPatcher);
+};
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const PatchSpan& patch,
+                    SinkFn sink, SHA_CTX* ctx, const Value* bonus_data, size_t max_threads) {
+  std::vector<PatchChunk> chunks;
+  if (!ReadPatchChunks(old_size, patch, &chunks)) {
+    return -1;
+  }
+
+  size_t num_threads = std::min<size_t>(max_threads, std::thread::hardware_concurrency());
+  if (num_threads > 1) {
+    ParallelChunkPatcher patcher(old_data, patch, chunks, bonus_data);
+    if (patcher.NumParallelChunks() > 1) {
+      return patcher.Run(std::min(num_threads, patcher.NumParallelChunks()), sink, ctx) ? 0 : -1;
+    }
+  }
+
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    if (!ApplyPatchChunk(old_data, patch, chunks[i], i, bonus_data, sink, ctx)) {
+      return -1;
+    }
+  }
   return 0;
 }
@@ -17,6 +17,7 @@
 #ifndef _APPLYPATCH_H
 #define _APPLYPATCH_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <functional>
@@ -36,6 +37,13 @@ struct FileContents {
 
 using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
 
+// A non-owning view of patch data that lives elsewhere (e.g. in the mmap'd update package), which
+// allows applying a patch without copying it into a Value first.
+struct PatchSpan {
+  const unsigned char* data;
+  size_t size;
+};
+
 // applypatch.cpp
 
 int ShowLicenses();
@@ -67,6 +75,8 @@ void ShowBSDiffLicense();
 // updates the SHA-1 context with the output data. Returns 0 on success.
 int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
                      size_t patch_offset, SinkFn sink, SHA_CTX* ctx);
+int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const PatchSpan& patch,
+                     size_t patch_offset, SinkFn sink, SHA_CTX* ctx);
 
 // imgpatch.cpp
 
@@ -75,6 +85,27 @@ int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value
 // SHA-1 context with the output data. Returns 0 on success.
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
                     SHA_CTX* ctx, const Value* bonus_data);
+// The chunks of the patch are applied with up to 'max_threads' threads. Callers that already run
+// several patches at once (e.g. the commands of block_image_update()) should pass 1.
+constexpr size_t kMaxPatchThreads = 4;
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const PatchSpan& patch,
+                    SinkFn sink, SHA_CTX* ctx, const Value* bonus_data,
+                    size_t max_threads = kMaxPatchThreads);
+
+// Bounds the memory that patching takes on top of the source data, i.e. for the inflated source of
+// each deflate chunk, for the chunks of an image patch being applied concurrently, and for the
+// patched output in applypatch(). Larger inflated chunks go into a file next to the cached source
+// copy, larger chunks get applied one at a time, and larger outputs get written to the target
+// partition as they're produced (see GenerateTarget()).
+constexpr size_t kDefaultPatchMemoryBudget = 32 * 1024 * 1024;
+void SetPatchMemoryBudget(size_t bytes);
+size_t PatchMemoryBudget();
+
+// Sets the function that makes room for the files that the inflated chunks spill into (e.g.
+// MakeFreeSpaceOnCache()). It returns a negative value if the space can't be freed, in which case
+// the chunk gets inflated in memory. libimgpatch doesn't include freecache.cpp, so it's unset by
+// default.
+void SetPatchSpillSpaceHandler(int (*make_free_space)(size_t bytes_needed));
 
 // freecache.cpp
 
@@ -21,9 +21,13 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <atomic>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <android-base/macros.h>
 #include <bsdiff/bsdiff.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
@@ -31,6 +35,63 @@
 #include "imgdiff.h"
 #include "otautil/rangeset.h"
 
+// Remembers the outcome of ImageChunk::ReconstructDeflateChunk() across runs. Entries are keyed by
+// the SHA-256 of the zlib version and the compressed chunk data, and stored in a text file, one
+// "<key> <level>" line each; level 0 means the chunk can't be reconstructed. New entries get
+// appended to the file as they're found, so several imgdiff processes may share it.
+class DeflateReconstructionCache {
+ public:
+  explicit DeflateReconstructionCache(std::string path) : path_(std::move(path)) {}
+
+  // Loads the entries from the file. A missing file is an empty cache.
+  bool Load();
+
+  static std::string Key(const uint8_t* data, size_t length);
+
+  // Returns true and sets |level| if the result for |key| is known.
+  bool Find(const std::string& key, int* level) const;
+
+  void Insert(const std::string& key, int level);
+
+ private:
+  std::string path_;
+  std::map<std::string, int> entries_;
+};
+
+// The content of an input file. Input files are mapped read-only, so only the pages in use take up
+// memory; the split source images, which get assembled from pieces of the source file, are held in
+// memory instead.
+class FileContent {
+ public:
+  FileContent() = default;
+  FileContent(FileContent&& other) noexcept;
+  FileContent& operator=(FileContent&& other) noexcept;
+  ~FileContent();
+
+  bool Map(const std::string& filename);
+  void Assign(std::vector<uint8_t> data);
+
+  const uint8_t* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+  uint8_t operator[](size_t i) const {
+    return data_[i];
+  }
+
+ private:
+  void Reset();
+
+  void* mapped_ = nullptr;
+  std::vector<uint8_t> memory_;
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(FileContent);
+};
+
 class ImageChunk {
  public:
   static constexpr auto WINDOWBITS = -15;  // 32kb window; negative to indicate a raw stream.
@@ -38,7 +99,7 @@ class ImageChunk {
   static constexpr auto METHOD = Z_DEFLATED;
   static constexpr auto STRATEGY = Z_DEFAULT_STRATEGY;
 
-  ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content, size_t raw_data_len,
+  ImageChunk(int type, size_t start, const FileContent* file_content, size_t raw_data_len,
              std::string entry_name = {});
 
   int GetType() const {
@@ -58,13 +119,16 @@ class ImageChunk {
   }
 
   // CHUNK_DEFLATE will return the uncompressed data for diff, while other types will simply return
-  // the raw data.
-  const uint8_t* DataForPatch() const;
+  // the raw data. The uncompressed data only gets inflated on demand, into |buffer|; so it takes
+  // up memory while the caller holds on to |buffer| only.
+  bool DataForPatch(std::vector<uint8_t>* buffer, const uint8_t** data) const;
   size_t DataLengthForPatch() const;
 
   void Dump(size_t index) const;
 
-  void SetUncompressedData(std::vector<uint8_t> data);
+  void SetUncompressedLength(size_t length);
+  // Sets the CRC-32 of the inflated data (without the bonus data), to be checked on inflate.
+  void SetCrc32(uint32_t crc);
   bool SetBonusData(const std::vector<uint8_t>& bonus_data);
 
   bool operator==(const ImageChunk& other) const;
@@ -83,9 +147,11 @@ class ImageChunk {
   /*
    * Verify that we can reproduce exactly the same compressed data that we started with.  Sets the
    * level, method, windowBits, memLevel, and strategy fields in the chunk to the encoding
-   * parameters needed to produce the right output.
+   * parameters needed to produce the right output, and sets |reconstructed| accordingly. The
+   * result is looked up in, and saved to, |cache| if given. Returns false if the chunk can't be
+   * inflated (e.g. a CRC mismatch), which isn't cached.
    */
-  bool ReconstructDeflateChunk();
+  bool ReconstructDeflateChunk(bool* reconstructed, DeflateReconstructionCache* cache = nullptr);
   bool IsAdjacentNormal(const ImageChunk& other) const;
   void MergeAdjacentNormal(const ImageChunk& other);
 
@@ -100,19 +166,30 @@ class ImageChunk {
 
  private:
   const uint8_t* GetRawData() const;
-  bool TryReconstruction(int level);
-
-  int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
-  size_t start_;                                // offset of chunk in the original input file
-  const std::vector<uint8_t>* input_file_ptr_;  // ptr to the full content of original input file
+  // Inflates the raw data, and appends the bonus data.
+  bool Inflate(std::vector<uint8_t>* data) const;
+  // Returns the deflate level that reproduces the compressed data from |uncompressed|, or 0 if
+  // none does.
+  int FindCompressLevel(const std::vector<uint8_t>& uncompressed) const;
+  // Stops early, and fails, once |cancel| is set.
+  bool TryReconstruction(const std::vector<uint8_t>& uncompressed, int level,
+                         const std::atomic<bool>* cancel = nullptr) const;
+
+  int type_;                   // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
+  size_t start_;               // offset of chunk in the original input file
+  const uint8_t* input_data_;  // ptr to the full content of original input file
+  size_t input_size_;          // size of the original input file
   size_t raw_data_len_;
 
   // deflate encoder parameters
   int compress_level_;
 
   // --- for CHUNK_DEFLATE chunks only: ---
-  std::vector<uint8_t> uncompressed_data_;
-  std::string entry_name_;  // used for zip entries
+  size_t uncompressed_len_;          // including the bonus data
+  std::vector<uint8_t> bonus_data_;  // appended to the inflated data
+  bool has_crc32_;                   // whether |crc32_| is known, i.e. for zip entries
+  uint32_t crc32_;                   // of the inflated data
+  std::string entry_name_;           // used for zip entries
 };
 
 // PatchChunk stores the patch data between a source chunk and a target chunk. It also keeps track
@@ -163,6 +240,9 @@ class Image {
 
   virtual ~Image() {}
 
+  Image(Image&&) = default;
+  Image& operator=(Image&&) = default;
+
   // Create a list of image chunks from input file.
   virtual bool Initialize(const std::string& filename) = 0;
 
@@ -197,11 +277,11 @@ class Image {
   }
 
  protected:
-  bool ReadFile(const std::string& filename, std::vector<uint8_t>* file_content);
+  bool ReadFile(const std::string& filename, FileContent* file_content);
 
-  bool is_source_;                     // True if it's for source chunks.
-  std::vector<ImageChunk> chunks_;     // Internal storage of ImageChunk.
-  std::vector<uint8_t> file_content_;  // Store the whole input file in memory.
+  bool is_source_;                  // True if it's for source chunks.
+  std::vector<ImageChunk> chunks_;  // Internal storage of ImageChunk.
+  FileContent file_content_;        // The whole input file, mapped.
 };
 
 class ZipModeImage : public Image {
@@ -213,9 +293,9 @@ class ZipModeImage : public Image {
   // Initialize a dummy ZipModeImage from an existing ImageChunk vector. For src img pieces, we
   // reconstruct a new file_content based on the source ranges; but it's not needed for the tgt img
   // pieces; because for each chunk both the data and their offset within the file are unchanged.
-  void Initialize(const std::vector<ImageChunk>& chunks, const std::vector<uint8_t>& file_content) {
+  void Initialize(const std::vector<ImageChunk>& chunks, std::vector<uint8_t> file_content) {
     chunks_ = chunks;
-    file_content_ = file_content;
+    file_content_.Assign(std::move(file_content));
   }
 
   // The pesudo source chunk for bsdiff if there's no match for the given target chunk. It's in
@@ -230,11 +310,13 @@ class ZipModeImage : public Image {
 
   // Verify that we can reconstruct the deflate chunks; also change the type to CHUNK_NORMAL if
   // src and tgt are identical.
-  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
+  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                    DeflateReconstructionCache* cache = nullptr);
 
-  // Compute the patch between tgt & src images, and write the data into |patch_name|.
+  // Compute the patch between tgt & src images, and write the data into |patch_name|. The chunk
+  // patches are computed on up to |num_threads| threads.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t num_threads = 1);
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
@@ -243,7 +325,7 @@ class ZipModeImage : public Image {
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
+                              const std::string& debug_dir, size_t num_threads = 1);
 
   // Split the tgt chunks and src chunks based on the size limit.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
@@ -256,7 +338,7 @@ class ZipModeImage : public Image {
   // Initialize image chunks based on the zip entries.
   bool InitializeChunks(const std::string& filename, ZipArchiveHandle handle);
   // Add the a zip entry to the list.
-  bool AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name, ZipEntry* entry);
+  bool AddZipEntryToChunks(const std::string& entry_name, ZipEntry* entry);
   // Return the real size of the zip file. (omit the trailing zeros that used for alignment)
   bool GetZipFileSize(size_t* input_file_size);
 
@@ -275,9 +357,12 @@ class ZipModeImage : public Image {
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images);
 
-  // Function that actually iterates the tgt_chunks and makes patches.
-  static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+  // Function that actually iterates the tgt_chunks and makes patches, for each pair of tgt & src
+  // images. The bsdiff calls run on up to |num_threads| threads.
+  static bool GeneratePatchesInternal(const std::vector<const ZipModeImage*>& tgt_images,
+                                      const std::vector<const ZipModeImage*>& src_images,
+                                      std::vector<std::vector<PatchChunk>>* patch_chunks,
+                                      size_t num_threads);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
@@ -295,12 +380,13 @@ class ImageModeImage : public Image {
 
   // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
   // same sequence of deflate and normal chunks).
-  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
+  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                    DeflateReconstructionCache* cache = nullptr);
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
-  // result to |patch_name|.
+  // result to |patch_name|. The chunk patches are computed on up to |num_threads| threads.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t num_threads = 1);
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
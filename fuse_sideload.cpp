@@ -46,6 +46,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>  // PATH_MAX
 #include <linux/fuse.h>
 #include <stdint.h>
@@ -55,17 +56,30 @@
 #include <sys/mount.h>
 #include <sys/param.h>  // MIN
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
+#include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 #include <openssl/sha.h>
 
+#include "otautil/hash.h"
+
 static constexpr uint64_t PACKAGE_FILE_ID = FUSE_ROOT_ID + 1;
 
 static constexpr int NO_STATUS = 1;
@@ -74,32 +88,15 @@ using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
 #define INSTALL_REQUIRED_MEMORY (400 * 1024 * 1024)
 
-struct fuse_data {
-  android::base::unique_fd ffd;  // file descriptor for the fuse socket
-
-  provider_vtab vtab;
-
-  uint64_t file_size;  // bytes
-
-  uint32_t block_size;   // block size that the adb host is using to send the file to us
-  uint32_t file_blocks;  // file size in block_size blocks
-
-  uid_t uid;
-  gid_t gid;
-
-  uint32_t curr_block;  // cache the block most recently used
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+// How many blocks to keep reading ahead of sequential reads.
+#define READAHEAD_BLOCKS 8
 
-  std::vector<SHA256Digest>
-      hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+// How many threads serve the FUSE requests.
+#define FUSE_WORKER_THREADS 4
 
-  // Block cache
-  uint32_t block_cache_max_size;  // Max allowed block cache size
-  uint32_t block_cache_size;      // Current block cache size
-  uint8_t** block_cache;          // Block cache data
-};
+// The largest read we ask the kernel to send us (unless the block size is even larger). A read is
+// replied to out of all the cached blocks it covers at once.
+#define FUSE_MAX_READ (1024 * 1024)
 
 static uint64_t free_memory() {
   uint64_t mem = 0;
@@ -128,43 +125,428 @@ static uint64_t free_memory() {
   return mem;
 }
 
-static int block_cache_fetch(struct fuse_data* fd, uint32_t block) {
-  if (fd->block_cache == nullptr) {
-    return -1;
+// The blocks fetched from the provider. They live in one slab of block_size slots, and are evicted
+// in LRU order once the slab is full. Blocks are pinned while a reply is being sent out of them, so
+// that the FUSE workers can reply straight from the cache. A fetcher thread owns the provider: it
+// serves the blocks that the kernel is waiting for first, and while the reads are sequential, it
+// keeps reading ahead of them so that the provider round trip overlaps with the kernel consuming
+// the current block. The fetcher also verifies each block against the hash of its first read before
+// it enters the cache, so everything in the cache can be served as is.
+class BlockCache {
+ public:
+  // |capacity| is the number of slots. It must be greater than |readahead| plus the number of
+  // blocks that can be pinned at the same time.
+  BlockCache(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
+             uint32_t file_blocks, uint32_t capacity, uint32_t readahead);
+  ~BlockCache();
+
+  // Pins |block| in the cache, fetching it first if needed, and points |data| at its contents.
+  // Returns 0 on success, or a negative errno. The block must be released with Release() once
+  // done.
+  int Acquire(uint32_t block, const uint8_t** data);
+  void Release(uint32_t block);
+
+  // Queues the fetch of the blocks in [block, block + count) that aren't cached yet, ahead of any
+  // readahead, without waiting for them. For reads that span several blocks.
+  void Prefetch(uint32_t block, uint32_t count);
+
+  uint64_t hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
   }
-  if (fd->block_cache[block] == nullptr) {
-    return -1;
+  uint64_t fetches() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fetches_;
+  }
+
+ private:
+  static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+  enum class SlotState {
+    FREE,
+    LOADING,
+    READY,
+  };
+
+  struct Slot {
+    SlotState state = SlotState::FREE;
+    uint32_t block = 0;
+    // Number of readers using the block. Pinned slots are out of the LRU list.
+    uint32_t pins = 0;
+    // Neighbours in the LRU list (unpinned READY slots only), or the next free slot.
+    uint32_t prev = kNoSlot;
+    uint32_t next = kNoSlot;
+  };
+
+  uint8_t* SlotData(uint32_t slot) const {
+    return slab_.get() + static_cast<size_t>(slot) * block_size_;
   }
-  memcpy(fd->block_data, fd->block_cache[block], fd->block_size);
+
+  // Whether a read of |block| continues the sequential reads so far.
+  bool IsSequentialLocked(uint32_t block) const;
+  // Picks the next block to fetch: the ones being waited for first, then the readahead window.
+  bool NextBlockLocked(uint32_t* block);
+  // Takes a free slot, or evicts the least recently used block. Returns kNoSlot if all the slots
+  // are being loaded.
+  uint32_t AllocateSlotLocked();
+  void FreeSlotLocked(uint32_t slot);
+  void LinkFrontLocked(uint32_t slot);
+  void UnlinkLocked(uint32_t slot);
+  // Finishes the load of a slot, with the result of FetchBlock().
+  void CompleteLocked(uint32_t slot, int result);
+
+  // Receives (or reads) a block into its slot and verifies it. Runs without holding the lock.
+  int FetchBlock(uint32_t block, uint8_t* data);
+  void FetcherLoop();
+
+  const provider_vtab& vtab_;
+  const uint64_t file_size_;
+  const uint32_t block_size_;
+  const uint32_t readahead_;
+  // Whether the provider can have several requests in flight.
+  const bool pipelined_;
+
+  // SHA-256 hash of each block (all zeros if block hasn't been read yet). Only accessed by the
+  // fetcher thread.
+  std::vector<SHA256Digest> hashes_;
+
+  std::unique_ptr<uint8_t[]> slab_;
+  std::vector<Slot> slots_;
+  // The slot holding each block, or kNoSlot.
+  std::vector<uint32_t> slot_of_block_;
+  uint32_t free_head_ = kNoSlot;
+  uint32_t lru_head_ = kNoSlot;
+  uint32_t lru_tail_ = kNoSlot;
+
+  // Blocks being waited for, that aren't loading yet.
+  std::deque<uint32_t> demand_;
+  // Failed fetches, to be reported to the readers.
+  std::map<uint32_t, int> errors_;
+  // The readahead window [readahead_next_, readahead_end_), and the furthest block of the current
+  // sequential run.
+  uint32_t readahead_next_ = 0;
+  uint32_t readahead_end_ = 0;
+  uint32_t last_block_ = UINT32_MAX;
+
+  uint64_t hits_ = 0;
+  uint64_t fetches_ = 0;
+
+  bool stopped_ = false;
+  mutable std::mutex mutex_;
+  // Signals the fetcher thread that there is work, and the readers that a fetch has finished.
+  std::condition_variable fetcher_cv_;
+  std::condition_variable reader_cv_;
+  std::thread fetcher_;
+};
+
+BlockCache::BlockCache(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
+                       uint32_t file_blocks, uint32_t capacity, uint32_t readahead)
+    : vtab_(vtab),
+      file_size_(file_size),
+      block_size_(block_size),
+      readahead_(readahead),
+      pipelined_(vtab.request_block && vtab.receive_block),
+      hashes_(file_blocks),
+      // Not value-initialized, so that the pages are only touched once they hold a block.
+      slab_(new uint8_t[static_cast<size_t>(capacity) * block_size]),
+      slots_(capacity),
+      slot_of_block_(file_blocks, kNoSlot) {
+  CHECK_GT(capacity, readahead);
+  for (uint32_t slot = capacity; slot-- > 0;) {
+    FreeSlotLocked(slot);
+  }
+  fetcher_ = std::thread(&BlockCache::FetcherLoop, this);
+}
+
+BlockCache::~BlockCache() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  fetcher_cv_.notify_one();
+  fetcher_.join();
+}
+
+void BlockCache::LinkFrontLocked(uint32_t slot) {
+  slots_[slot].prev = kNoSlot;
+  slots_[slot].next = lru_head_;
+  if (lru_head_ != kNoSlot) {
+    slots_[lru_head_].prev = slot;
+  } else {
+    lru_tail_ = slot;
+  }
+  lru_head_ = slot;
+}
+
+void BlockCache::UnlinkLocked(uint32_t slot) {
+  Slot& s = slots_[slot];
+  if (s.prev != kNoSlot) {
+    slots_[s.prev].next = s.next;
+  } else {
+    lru_head_ = s.next;
+  }
+  if (s.next != kNoSlot) {
+    slots_[s.next].prev = s.prev;
+  } else {
+    lru_tail_ = s.prev;
+  }
+  s.prev = s.next = kNoSlot;
+}
+
+void BlockCache::FreeSlotLocked(uint32_t slot) {
+  slots_[slot].state = SlotState::FREE;
+  slots_[slot].next = free_head_;
+  free_head_ = slot;
+}
+
+uint32_t BlockCache::AllocateSlotLocked() {
+  uint32_t slot = free_head_;
+  if (slot != kNoSlot) {
+    free_head_ = slots_[slot].next;
+  } else {
+    slot = lru_tail_;
+    if (slot == kNoSlot) {
+      return kNoSlot;
+    }
+    UnlinkLocked(slot);
+    slot_of_block_[slots_[slot].block] = kNoSlot;
+  }
+  slots_[slot].next = kNoSlot;
+  return slot;
+}
+
+bool BlockCache::NextBlockLocked(uint32_t* block) {
+  while (!demand_.empty()) {
+    uint32_t b = demand_.front();
+    demand_.pop_front();
+    if (slot_of_block_[b] == kNoSlot) {
+      *block = b;
+      return true;
+    }
+  }
+  while (readahead_next_ < readahead_end_) {
+    uint32_t b = readahead_next_++;
+    if (slot_of_block_[b] == kNoSlot) {
+      *block = b;
+      return true;
+    }
+  }
+  return false;
+}
+
+void BlockCache::CompleteLocked(uint32_t slot, int result) {
+  uint32_t block = slots_[slot].block;
+  if (result == 0) {
+    slots_[slot].state = SlotState::READY;
+    LinkFrontLocked(slot);
+  } else {
+    slot_of_block_[block] = kNoSlot;
+    FreeSlotLocked(slot);
+    errors_[block] = result;
+  }
+  fetches_++;
+}
+
+int BlockCache::FetchBlock(uint32_t block, uint8_t* data) {
+  size_t fetch_size = block_size_;
+  if (static_cast<uint64_t>(block) * block_size_ + fetch_size > file_size_) {
+    // If we're reading the last (partial) block of the file, expect a shorter response from the
+    // host, and pad the rest of the block with zeroes.
+    fetch_size = file_size_ - static_cast<uint64_t>(block) * block_size_;
+    memset(data + fetch_size, 0, block_size_ - fetch_size);
+  }
+
+  int result = pipelined_ ? vtab_.receive_block(block, data, fetch_size)
+                          : vtab_.read_block(block, data, fetch_size);
+  if (result < 0) return result;
+
+  // Verify the hash of the block we just got from the host.
+  //
+  // - If the hash of the just-received data matches the stored hash for the block, accept it.
+  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
+  //   time we've read this block).
+  // - Otherwise, return -EIO for the read.
+
+  SHA256Digest hash;
+  ComputeDigest(HashAlgorithm::SHA256, data, block_size_, hash.data());
+
+  SHA256Digest& blockhash = hashes_[block];
+  if (hash == blockhash) {
+    return 0;
+  }
+
+  for (uint8_t i : blockhash) {
+    if (i != 0) {
+      return -EIO;
+    }
+  }
+
+  blockhash = hash;
   return 0;
 }
 
-static void block_cache_enter(struct fuse_data* fd, uint32_t block) {
-  if (!fd->block_cache) return;
-  if (fd->block_cache_size == fd->block_cache_max_size) {
-    // Evict a block from the cache.  Since the file is typically read
-    // sequentially, start looking from the block behind the current
-    // block and proceed backward.
-    int n;
-    for (n = fd->curr_block - 1; n != (int)fd->curr_block; --n) {
-      if (n < 0) {
-        n = fd->file_blocks - 1;
-      }
-      if (fd->block_cache[n]) {
-        free(fd->block_cache[n]);
-        fd->block_cache[n] = nullptr;
-        fd->block_cache_size--;
+void BlockCache::FetcherLoop() {
+  // The slots whose blocks have been requested from the provider, in the order of the requests.
+  std::deque<uint32_t> in_flight;
+  size_t max_in_flight = pipelined_ ? readahead_ + 1 : 1;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // Keep the pipeline full, unless we're shutting down; the requests already sent still need to
+    // be drained though, to keep the stream in sync for the provider's close().
+    while (!stopped_ && in_flight.size() < max_in_flight) {
+      uint32_t block;
+      if (!NextBlockLocked(&block)) break;
+      uint32_t slot = AllocateSlotLocked();
+      if (slot == kNoSlot) {
+        // Every slot is loading. Retry the block once a load finishes.
+        demand_.push_front(block);
         break;
       }
+      slots_[slot].state = SlotState::LOADING;
+      slots_[slot].block = block;
+      slot_of_block_[block] = slot;
+
+      if (pipelined_) {
+        lock.unlock();
+        int result = vtab_.request_block(block);
+        lock.lock();
+        if (result != 0) {
+          CompleteLocked(slot, result);
+          reader_cv_.notify_all();
+          continue;
+        }
+      }
+      in_flight.push_back(slot);
+    }
+
+    if (in_flight.empty()) {
+      if (stopped_) break;
+      fetcher_cv_.wait(lock);
+      continue;
     }
+
+    uint32_t slot = in_flight.front();
+    in_flight.pop_front();
+    uint32_t block = slots_[slot].block;
+    lock.unlock();
+    int result = FetchBlock(block, SlotData(slot));
+    lock.lock();
+    CompleteLocked(slot, result);
+    reader_cv_.notify_all();
+  }
+}
+
+bool BlockCache::IsSequentialLocked(uint32_t block) const {
+  // The kernel's own readahead, and the other workers, make sequential reads reach us slightly out
+  // of order, and possibly anywhere in the window we're reading ahead.
+  static constexpr uint32_t kSlack = 2;
+  if (last_block_ == UINT32_MAX) return false;
+  return block + kSlack >= last_block_ && block <= std::max(last_block_, readahead_end_) + kSlack;
+}
+
+int BlockCache::Acquire(uint32_t block, const uint8_t** data) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  // Sequential reads (which is how the package is verified and mostly installed) grow the readahead
+  // window ahead of the current block; anything else stops reading ahead, since it would only evict
+  // blocks that are likely to be wanted again.
+  if (IsSequentialLocked(block)) {
+    uint32_t file_blocks = slot_of_block_.size();
+    readahead_next_ = std::max(readahead_next_, block + 1);
+    readahead_end_ = std::max(readahead_end_, std::min(file_blocks, block + 1 + readahead_));
+    last_block_ = std::max(last_block_, block);
+  } else {
+    readahead_next_ = readahead_end_ = 0;
+    last_block_ = block;
   }
 
-  fd->block_cache[block] = (uint8_t*)malloc(fd->block_size);
-  memcpy(fd->block_cache[block], fd->block_data, fd->block_size);
+  if (slot_of_block_[block] == kNoSlot) {
+    // Drop any error from an earlier readahead of this block; we'll retry it.
+    errors_.erase(block);
+  } else if (slots_[slot_of_block_[block]].state == SlotState::READY) {
+    hits_++;
+  }
 
-  fd->block_cache_size++;
+  while (true) {
+    uint32_t slot = slot_of_block_[block];
+    if (slot != kNoSlot && slots_[slot].state == SlotState::READY) {
+      if (slots_[slot].pins++ == 0) {
+        UnlinkLocked(slot);
+      }
+      *data = SlotData(slot);
+      break;
+    }
+    auto it = errors_.find(block);
+    if (it != errors_.end()) {
+      int result = it->second;
+      errors_.erase(it);
+      return result;
+    }
+    // (Re)request the block if it's neither loading nor queued, e.g. when it got evicted by the
+    // readahead before we woke up.
+    if (slot == kNoSlot && std::find(demand_.begin(), demand_.end(), block) == demand_.end()) {
+      demand_.push_back(block);
+    }
+    // Also wakes up the fetcher for the new readahead window.
+    fetcher_cv_.notify_one();
+    reader_cv_.wait(lock);
+  }
+
+  // Let the fetcher move on to the readahead window.
+  if (readahead_next_ < readahead_end_) {
+    fetcher_cv_.notify_one();
+  }
+  return 0;
+}
+
+void BlockCache::Prefetch(uint32_t block, uint32_t count) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (uint32_t b = block; b < block + count; b++) {
+    if (slot_of_block_[b] == kNoSlot &&
+        std::find(demand_.begin(), demand_.end(), b) == demand_.end()) {
+      errors_.erase(b);
+      demand_.push_back(b);
+    }
+  }
+  fetcher_cv_.notify_one();
+}
+
+void BlockCache::Release(uint32_t block) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t slot = slot_of_block_[block];
+  CHECK_NE(slot, kNoSlot);
+  CHECK_GT(slots_[slot].pins, 0U);
+  if (--slots_[slot].pins == 0) {
+    LinkFrontLocked(slot);
+    // The fetcher may be waiting for a slot to evict.
+    fetcher_cv_.notify_one();
+  }
 }
 
+struct fuse_data {
+  android::base::unique_fd ffd;  // file descriptor for the fuse socket
+
+  provider_vtab vtab;
+
+  uint64_t file_size;  // bytes
+
+  uint32_t block_size;   // block size that the adb host is using to send the file to us
+  uint32_t file_blocks;  // file size in block_size blocks
+
+  uint32_t max_read;         // the largest read the kernel may send us, in bytes
+  uint32_t max_read_blocks;  // the most blocks a single read can span
+
+  uid_t uid;
+  gid_t gid;
+
+  std::unique_ptr<BlockCache> block_cache;
+  std::vector<uint8_t> zero_block;  // the contents of the blocks past the end of the file
+
+  // Set by the first worker that finds the filesystem gone, to stop the others.
+  std::atomic<bool> unmounted;
+};
+
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
   fuse_out_header hdr;
   hdr.len = len + sizeof(hdr);
@@ -195,7 +577,7 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
     return -1;
   }
 
-  fuse_init_out out;
+  fuse_init_out out = {};
   out.minor = MIN(req->minor, FUSE_KERNEL_MINOR_VERSION);
   size_t fuse_struct_size = sizeof(out);
 #if defined(FUSE_COMPAT_22_INIT_OUT_SIZE)
@@ -214,6 +596,14 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
+#if defined(FUSE_MAX_PAGES)
+  // Without this, the kernel splits reads (including its own readahead) into 32 pages at most,
+  // regardless of max_read. Available since 7.28.
+  if (req->minor >= 28 && (req->flags & FUSE_MAX_PAGES)) {
+    out.flags |= FUSE_MAX_PAGES;
+    out.max_pages = fd->max_read / 4096;
+  }
+#endif
   fuse_reply(fd, hdr->unique, &out, fuse_struct_size);
 
   return NO_STATUS;
@@ -286,62 +676,20 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint32_t block) {
-  if (block == fd->curr_block) {
-    return 0;
-  }
-
+// Gets the contents of a block, which stay valid until release_block(). Returns 0 on success,
+// negative otherwise.
+static int acquire_block(fuse_data* fd, uint32_t block, const uint8_t** data) {
   if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
-    return 0;
-  }
-
-  if (block_cache_fetch(fd, block) == 0) {
-    fd->curr_block = block;
+    *data = fd->zero_block.data();
     return 0;
   }
+  return fd->block_cache->Acquire(block, data);
+}
 
-  size_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
-  }
-
-  int result = fd->vtab.read_block(block, fd->block_data, fetch_size);
-  if (result < 0) return result;
-
-  fd->curr_block = block;
-
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
-
-  SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
-
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
-    return 0;
+static void release_block(fuse_data* fd, uint32_t block) {
+  if (block < fd->file_blocks) {
+    fd->block_cache->Release(block);
   }
-
-  for (uint8_t i : blockhash) {
-    if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
-    }
-  }
-
-  fd->hashes[block] = hash;
-  block_cache_enter(fd, block);
-  return 0;
 }
 
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
@@ -364,54 +712,154 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
+  if (size > fd->max_read) return -EINVAL;
+
+  // The read covers [block, block + block_count). We reply straight out of the cache, with the
+  // blocks pinned until the reply is sent.
+  uint32_t block = offset / fd->block_size;
+  uint32_t block_offset = offset - (static_cast<uint64_t>(block) * fd->block_size);
+  uint32_t block_count = (block_offset + size + fd->block_size - 1) / fd->block_size;
+
+  // Get all the missing blocks on their way before waiting for the first one.
+  if (block < fd->file_blocks && block_count > 1) {
+    fd->block_cache->Prefetch(block, std::min(block_count, fd->file_blocks - block));
+  }
+
+  std::vector<iovec> vec(block_count + 1);
   vec[0].iov_base = &outhdr;
   vec[0].iov_len = sizeof(outhdr);
 
-  uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
+  uint32_t acquired = 0;
+  int result = 0;
+  uint32_t remaining = size;
+  for (; acquired < block_count; acquired++) {
+    const uint8_t* block_data;
+    result = acquire_block(fd, block + acquired, &block_data);
+    if (result != 0) break;
+
+    uint32_t start = (acquired == 0) ? block_offset : 0;
+    uint32_t len = std::min(remaining, fd->block_size - start);
+    vec[acquired + 1].iov_base = const_cast<uint8_t*>(block_data + start);
+    vec[acquired + 1].iov_len = len;
+    remaining -= len;
+  }
 
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
+  if (result == 0 && writev(fd->ffd, vec.data(), vec.size()) == -1) {
+    printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+  }
 
-  uint32_t block_offset = offset - (block * fd->block_size);
+  for (uint32_t i = 0; i < acquired; i++) {
+    release_block(fd, block + i);
+  }
+  return result == 0 ? NO_STATUS : result;
+}
 
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
+// Read by all the workers, hence atomic rather than volatile (it's lock-free, so still safe to set
+// from the signal handler).
+static std::atomic<bool> terminated(false);
+static void sig_term(int) {
+  terminated = true;
+}
 
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
+// Serves FUSE requests until the filesystem goes away or we're asked to exit. Runs on each of the
+// worker threads. Returns -1 if the filesystem went away, 0 otherwise.
+static int serve_fuse(fuse_data* fd) {
+  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
+  while (!terminated && !fd->unmounted) {
+    fd_set fds;
+    struct timeval tv;
+    FD_ZERO(&fds);
+    FD_SET(fd->ffd, &fds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    int rc = select(fd->ffd + 1, &fds, nullptr, nullptr, &tv);
+    if (rc <= 0) {
+      continue;
+    }
+    ssize_t len = TEMP_FAILURE_RETRY(read(fd->ffd, request_buffer, sizeof(request_buffer)));
+    if (len == -1) {
+      if (errno == EAGAIN) {
+        // Another worker took the request.
+        continue;
+      }
+      perror("read request");
+      if (errno == ENODEV) {
+        fd->unmounted = true;
+        return -1;
+      }
+      continue;
+    }
+
+    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
+      fprintf(stderr, "request too short: len=%zd\n", len);
+      continue;
+    }
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
+    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
+    void* data = request_buffer + sizeof(fuse_in_header);
 
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
-  }
+    int result = -ENOSYS;
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
-    printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
+    switch (hdr->opcode) {
+      case FUSE_INIT:
+        result = handle_init(data, fd, hdr);
+        break;
+
+      case FUSE_LOOKUP:
+        result = handle_lookup(data, fd, hdr);
+        break;
+
+      case FUSE_GETATTR:
+        result = handle_getattr(data, fd, hdr);
+        break;
+
+      case FUSE_OPEN:
+        result = handle_open(data, fd, hdr);
+        break;
+
+      case FUSE_READ:
+        result = handle_read(data, fd, hdr);
+        break;
+
+      case FUSE_FLUSH:
+        result = handle_flush(data, fd, hdr);
+        break;
+
+      case FUSE_RELEASE:
+        result = handle_release(data, fd, hdr);
+        break;
+
+      default:
+        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
+        break;
+    }
+
+    if (result != NO_STATUS) {
+      fuse_out_header outhdr;
+      outhdr.len = sizeof(outhdr);
+      outhdr.error = result;
+      outhdr.unique = hdr->unique;
+      TEMP_FAILURE_RETRY(write(fd->ffd, &outhdr, sizeof(outhdr)));
+    }
   }
-  return NO_STATUS;
+  return 0;
 }
 
-static volatile int terminated = 0;
-static void sig_term(int) {
-  terminated = 1;
+// Reads through the page cache (including mmap faults, which is how the package is verified) are
+// sent to us in readahead-sized pieces, 128 KiB by default, regardless of max_read. Raise the
+// readahead of the FUSE mount to max_read, so that a sequential read takes one round trip per
+// max_read. Needs the filesystem to be up, since it stats the mount point.
+static void set_readahead(const char* mount_point, uint32_t max_read) {
+  struct stat sb;
+  if (stat(mount_point, &sb) == -1) {
+    fprintf(stderr, "failed to stat %s: %s\n", mount_point, strerror(errno));
+    return;
+  }
+  std::string path = android::base::StringPrintf("/sys/class/bdi/%u:%u/read_ahead_kb",
+                                                 major(sb.st_dev), minor(sb.st_dev));
+  if (!android::base::WriteStringToFile(std::to_string(max_read / 1024), path)) {
+    fprintf(stderr, "failed to set readahead via %s: %s\n", path.c_str(), strerror(errno));
+  }
 }
 
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
@@ -435,9 +883,12 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   fd.file_size = file_size;
   fd.block_size = block_size;
   fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
+  fd.max_read = std::max<uint32_t>(block_size, FUSE_MAX_READ);
+  // A read that doesn't start at a block boundary spans one more block.
+  fd.max_read_blocks = fd.max_read / block_size + 1;
 
   uint64_t mem = free_memory();
-  uint64_t avail = mem - (INSTALL_REQUIRED_MEMORY + fd.file_blocks * sizeof(uint8_t*));
+  uint64_t avail = mem - (INSTALL_REQUIRED_MEMORY + fd.file_blocks * sizeof(uint32_t));
 
   int result;
   if (fd.file_blocks > (1 << 18)) {
@@ -446,44 +897,34 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
     goto done;
   }
 
-  // All hashes will be zero-initialized.
-  fd.hashes.resize(fd.file_blocks);
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
-  }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
-  }
+  fd.zero_block.resize(block_size);
 
-  fd.block_cache_max_size = 0;
-  fd.block_cache_size = 0;
-  fd.block_cache = nullptr;
-  if (mem > avail) {
-    uint32_t max_size = avail / fd.block_size;
-    if (max_size > fd.file_blocks) {
-      max_size = fd.file_blocks;
-    }
-    // The cache must be at least 1% of the file size or two blocks,
-    // whichever is larger.
-    if (max_size >= fd.file_blocks / 100 && max_size >= 2) {
-      fd.block_cache_max_size = max_size;
-      fd.block_cache = (uint8_t**)calloc(fd.file_blocks, sizeof(uint8_t*));
+  {
+    // Without enough memory to cache a meaningful part of the file, we still keep the blocks that
+    // are being read ahead, and the ones being replied from.
+    uint32_t cache_size = READAHEAD_BLOCKS + fd.max_read_blocks * FUSE_WORKER_THREADS + 2;
+    if (mem > avail) {
+      uint32_t max_size = avail / fd.block_size;
+      if (max_size > fd.file_blocks) {
+        max_size = fd.file_blocks;
+      }
+      // The cache must be at least 1% of the file size or two blocks,
+      // whichever is larger.
+      if (max_size >= fd.file_blocks / 100 && max_size >= 2) {
+        cache_size = std::max(cache_size, max_size);
+      }
     }
+    fd.block_cache = std::make_unique<BlockCache>(fd.vtab, fd.file_size, fd.block_size,
+                                                  fd.file_blocks, cache_size, READAHEAD_BLOCKS);
   }
 
   signal(SIGTERM, sig_term);
 
-  fd.ffd.reset(open("/dev/fuse", O_RDWR));
+  // Non-blocking, since all the workers get woken up for a request that only one of them will read.
+  fd.ffd.reset(open("/dev/fuse", O_RDWR | O_NONBLOCK));
   if (!fd.ffd) {
     perror("open /dev/fuse");
     result = -1;
@@ -493,7 +934,7 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   {
     std::string opts = android::base::StringPrintf(
         "fd=%d,user_id=%d,group_id=%d,max_read=%u,allow_other,rootmode=040000", fd.ffd.get(),
-        fd.uid, fd.gid, block_size);
+        fd.uid, fd.gid, fd.max_read);
 
     result = mount("/dev/fuse", mount_point, "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC,
                    opts.c_str());
@@ -503,98 +944,36 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
     }
   }
 
-  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
-  while (!terminated) {
-    fd_set fds;
-    struct timeval tv;
-    FD_ZERO(&fds);
-    FD_SET(fd.ffd, &fds);
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    int rc = select(fd.ffd + 1, &fds, nullptr, nullptr, &tv);
-    if (rc <= 0) {
-      continue;
+  {
+    // The kernel hands each request to one of the readers of the FUSE fd, so the workers can serve
+    // independent reads in parallel (e.g. a cache hit doesn't wait behind a fetch).
+    std::vector<std::thread> workers;
+    std::vector<int> worker_results(FUSE_WORKER_THREADS - 1);
+    for (size_t i = 0; i < worker_results.size(); i++) {
+      workers.emplace_back([&fd, &worker_results, i]() { worker_results[i] = serve_fuse(&fd); });
     }
-    ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
-    if (len == -1) {
-      perror("read request");
-      if (errno == ENODEV) {
+    set_readahead(mount_point, fd.max_read);
+    result = serve_fuse(&fd);
+    for (size_t i = 0; i < workers.size(); i++) {
+      workers[i].join();
+      if (worker_results[i] == -1) {
         result = -1;
-        break;
       }
-      continue;
-    }
-
-    if (static_cast<size_t>(len) < sizeof(fuse_in_header)) {
-      fprintf(stderr, "request too short: len=%zd\n", len);
-      continue;
-    }
-
-    fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
-    void* data = request_buffer + sizeof(fuse_in_header);
-
-    result = -ENOSYS;
-
-    switch (hdr->opcode) {
-      case FUSE_INIT:
-        result = handle_init(data, &fd, hdr);
-        break;
-
-      case FUSE_LOOKUP:
-        result = handle_lookup(data, &fd, hdr);
-        break;
-
-      case FUSE_GETATTR:
-        result = handle_getattr(data, &fd, hdr);
-        break;
-
-      case FUSE_OPEN:
-        result = handle_open(data, &fd, hdr);
-        break;
-
-      case FUSE_READ:
-        result = handle_read(data, &fd, hdr);
-        break;
-
-      case FUSE_FLUSH:
-        result = handle_flush(data, &fd, hdr);
-        break;
-
-      case FUSE_RELEASE:
-        result = handle_release(data, &fd, hdr);
-        break;
-
-      default:
-        fprintf(stderr, "unknown fuse request opcode %d\n", hdr->opcode);
-        break;
-    }
-
-    if (result != NO_STATUS) {
-      fuse_out_header outhdr;
-      outhdr.len = sizeof(outhdr);
-      outhdr.error = result;
-      outhdr.unique = hdr->unique;
-      TEMP_FAILURE_RETRY(write(fd.ffd, &outhdr, sizeof(outhdr)));
     }
   }
 
 done:
+  // Stop the fetcher thread before closing the provider.
+  if (fd.block_cache) {
+    printf("fuse_sideload: %" PRIu64 " block(s) fetched, %" PRIu64 " cache hit(s)\n",
+           fd.block_cache->fetches(), fd.block_cache->hits());
+    fd.block_cache.reset();
+  }
   fd.vtab.close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  if (fd.block_cache) {
-    uint32_t n;
-    for (n = 0; n < fd.file_blocks; ++n) {
-      free(fd.block_cache[n]);
-    }
-    free(fd.block_cache);
-  }
-
-  free(fd.block_data);
-  free(fd.extra_block);
-
   return result;
 }
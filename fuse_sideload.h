@@ -29,6 +29,12 @@ struct provider_vtab {
   // read a block
   std::function<int(uint32_t block, uint8_t* buffer, uint32_t fetch_size)> read_block;
 
+  // Optional, for providers with a long round trip (e.g. adb). request_block() sends the request
+  // for a block without waiting for the data, which is later collected by receive_block(). Blocks
+  // are received in the order they were requested, so that several requests can be in flight.
+  std::function<int(uint32_t block)> request_block;
+  std::function<int(uint32_t block, uint8_t* buffer, uint32_t fetch_size)> receive_block;
+
   // close down
   std::function<void(void)> close;
 };
@@ -23,6 +23,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -33,6 +34,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <functional>
+#include <future>
 #include <limits>
 #include <map>
 #include <mutex>
@@ -53,6 +55,7 @@
 #include <cutils/properties.h>
 
 #include "common.h"
+#include "fuse_sideload.h"
 #include "otautil/SysUtil.h"
 #include "otautil/ThermalUtil.h"
 #include "otautil/error_code.h"
@@ -319,9 +322,17 @@ static void log_max_temperature(int* max_temperature, const std::atomic<bool>& l
   }
 }
 
-static jmp_buf jb;
+// Because we mmap() the update file which is backed by FUSE, we get SIGBUS when the host aborts
+// the transfer. We handle this by using setjmp/longjmp. Each thread that reads the mapping points
+// this at its own jmp_buf, since the signal is delivered to the faulting thread.
+static thread_local jmp_buf* sig_bus_jb = nullptr;
 static void sig_bus(int) {
-  longjmp(jb, 1);
+  if (sig_bus_jb == nullptr) {
+    // Not expected by this thread; let the default action take place once we return.
+    signal(SIGBUS, SIG_DFL);
+    return;
+  }
+  longjmp(*sig_bus_jb, 1);
 }
 
 // If the package contains an update binary, extract it and run it.
@@ -589,6 +600,27 @@ bool verify_package_compatibility(ZipArchiveHandle package_zip) {
   return false;
 }
 
+struct PackageArchive {
+  ZipArchiveHandle zip = nullptr;
+  int32_t err = 0;
+  // Whether reading the package hit SIGBUS. |zip| is unusable (and not safe to close) then.
+  bool aborted = false;
+};
+
+// Opens the mapped package, i.e. parses its central directory.
+static PackageArchive OpenPackageArchive(const MemMapping& map, const std::string& path) {
+  PackageArchive archive;
+  jmp_buf thread_jb;
+  sig_bus_jb = &thread_jb;
+  if (setjmp(thread_jb) == 0) {
+    archive.err = OpenArchiveFromMemory(map.addr, map.length, path.c_str(), &archive.zip);
+  } else {
+    archive.aborted = true;
+  }
+  sig_bus_jb = nullptr;
+  return archive;
+}
+
 static int really_install_package(std::string path, bool* wipe_cache, bool needs_mount,
                                   std::vector<std::string>* log_buffer, int retry_count,
                                   bool verify, int* max_temperature) {
@@ -633,22 +665,49 @@ static int really_install_package(std::string path, bool* wipe_cache, bool needs
     return INSTALL_CORRUPT;
   }
 
-  // Verify package.
+  // Verify the package, while parsing its central directory on the side. The central directory is
+  // at the end of the package and the whole-file hashing takes a while to get there, so the two
+  // mostly touch different pages. The parsed archive is not used unless the package is verified.
+  // A sideloaded package is parsed afterwards instead, as reading its end would reset the
+  // readahead of the sequential hashing pass over FUSE.
   set_perf_mode(true);
-  if (verify && !verify_package(map.addr, map.length)) {
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kZipVerificationFailure));
-    set_perf_mode(false);
-    return INSTALL_UNVERIFIED;
+  signal(SIGBUS, sig_bus);
+  PackageArchive archive;
+  if (verify) {
+    bool sideload = (path == FUSE_SIDELOAD_HOST_PATHNAME);
+    std::future<PackageArchive> opening;
+    if (!sideload) {
+      opening = std::async(std::launch::async, OpenPackageArchive, std::cref(map), std::cref(path));
+    }
+    bool verified = verify_package(map.addr, map.length);
+    if (!sideload) {
+      archive = opening.get();
+    } else if (verified) {
+      archive = OpenPackageArchive(map, path);
+    }
+    if (!verified) {
+      signal(SIGBUS, SIG_DFL);
+      if (!archive.aborted && archive.zip != nullptr) {
+        CloseArchive(archive.zip);
+      }
+      log_buffer->push_back(android::base::StringPrintf("error: %d", kZipVerificationFailure));
+      set_perf_mode(false);
+      return INSTALL_UNVERIFIED;
+    }
+  } else {
+    archive = OpenPackageArchive(map, path);
   }
+  signal(SIGBUS, SIG_DFL);
 
-  // Try to open the package.
-  ZipArchiveHandle zip;
-  int err = OpenArchiveFromMemory(map.addr, map.length, path.c_str(), &zip);
-  if (err != 0) {
-    LOG(ERROR) << "Can't open " << path << " : " << ErrorCodeString(err);
+  ZipArchiveHandle zip = archive.zip;
+  if (archive.aborted || archive.err != 0) {
+    if (archive.aborted) {
+      LOG(ERROR) << "Can't open " << path << " : transfer aborted";
+    } else {
+      LOG(ERROR) << "Can't open " << path << " : " << ErrorCodeString(archive.err);
+      CloseArchive(zip);
+    }
     log_buffer->push_back(android::base::StringPrintf("error: %d", kZipOpenFailure));
-
-    CloseArchive(zip);
     set_perf_mode(false);
     return INSTALL_CORRUPT;
   }
@@ -764,11 +823,12 @@ bool verify_package(const unsigned char* package_data, size_t package_size) {
   ui->Print("Verifying update package...\n");
   auto t0 = std::chrono::system_clock::now();
   int err;
-  // Because we mmap() the update file which is backed by FUSE, we get
-  // SIGBUS when the host aborts the transfer.  We handle this by using
-  // setjmp/longjmp.
-  signal(SIGBUS, sig_bus);
-  if (setjmp(jb) == 0) {
+  // Install the SIGBUS handler, unless the caller already did (and keep it in that case, since
+  // another thread may still be reading the package).
+  sighandler_t old_handler = signal(SIGBUS, sig_bus);
+  jmp_buf thread_jb;
+  sig_bus_jb = &thread_jb;
+  if (setjmp(thread_jb) == 0) {
     err = verify_file(package_data, package_size, loadedKeys,
                       std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1));
     std::chrono::duration<double> duration = std::chrono::system_clock::now() - t0;
@@ -776,7 +836,8 @@ bool verify_package(const unsigned char* package_data, size_t package_size) {
   } else {
     err = VERIFY_FAILURE;
   }
-  signal(SIGBUS, SIG_DFL);
+  sig_bus_jb = nullptr;
+  signal(SIGBUS, old_handler);
 
   if (err != VERIFY_SUCCESS) {
     LOG(ERROR) << "Signature verification failed";
@@ -27,20 +27,28 @@
 #include "adb_io.h"
 #include "fuse_sideload.h"
 
-int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+int request_block_adb(const adb_data& ad, uint32_t block) {
   if (!WriteFdFmt(ad.sfd, "%08u", block)) {
     fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
     return -EIO;
   }
+  return 0;
+}
 
+int receive_block_adb(const adb_data& ad, uint8_t* buffer, uint32_t fetch_size) {
   if (!ReadFdExactly(ad.sfd, buffer, fetch_size)) {
     fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
     return -EIO;
   }
-
   return 0;
 }
 
+int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+  int result = request_block_adb(ad, block);
+  if (result != 0) return result;
+  return receive_block_adb(ad, buffer, fetch_size);
+}
+
 int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size) {
   adb_data ad;
   ad.sfd = sfd;
@@ -50,6 +58,12 @@ int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size) {
   provider_vtab vtab;
   vtab.read_block = std::bind(read_block_adb, ad, std::placeholders::_1, std::placeholders::_2,
                               std::placeholders::_3);
+  // The host serves the requests in order off the socket, so we can keep several of them in flight
+  // to hide the USB round trip.
+  vtab.request_block = std::bind(request_block_adb, ad, std::placeholders::_1);
+  vtab.receive_block = [ad](uint32_t /* block */, uint8_t* buffer, uint32_t fetch_size) {
+    return receive_block_adb(ad, buffer, fetch_size);
+  };
   vtab.close = [&ad]() { WriteFdExactly(ad.sfd, "DONEDONE"); };
 
   return run_fuse_sideload(vtab, file_size, block_size);
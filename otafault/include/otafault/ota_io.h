@@ -26,6 +26,8 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <sys/stat.h>  // mode_t
+#include <sys/types.h>  // off64_t
+#include <sys/uio.h>  // iovec
 
 #include <memory>
 
@@ -45,10 +47,18 @@ size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream);
 
 ssize_t ota_read(int fd, void* buf, size_t nbyte);
 
+ssize_t ota_pread(int fd, void* buf, size_t nbyte, off64_t offset);
+
+ssize_t ota_preadv(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+
 size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream);
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte);
 
+ssize_t ota_pwrite(int fd, const void* buf, size_t nbyte, off64_t offset);
+
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+
 int ota_fsync(int fd);
 
 struct OtaCloser {
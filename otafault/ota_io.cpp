@@ -22,8 +22,10 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <map>
 #include <mutex>
 #include <string>
@@ -56,7 +58,7 @@ void ota_set_fault_files() {
     }
 }
 
-bool have_eio_error = false;
+std::atomic<bool> have_eio_error(false);
 
 int ota_open(const char* path, int oflags) {
     // Let the caller handle errors; we do not care if open succeeds or fails
@@ -113,9 +115,8 @@ size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
     if (should_fault_inject(OTAIO_READ)) {
         std::lock_guard<std::mutex> lock(filename_mutex);
         auto cached = filename_cache.find((intptr_t)stream);
-        const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, read_fault_file_name)) {
+                get_hit_file(cached->second, read_fault_file_name)) {
             read_fault_file_name = "";
             errno = EIO;
             have_eio_error = true;
@@ -134,9 +135,8 @@ ssize_t ota_read(int fd, void* buf, size_t nbyte) {
     if (should_fault_inject(OTAIO_READ)) {
         std::lock_guard<std::mutex> lock(filename_mutex);
         auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
         if (cached != filename_cache.end()
-                && get_hit_file(cached_path, read_fault_file_name)) {
+                && get_hit_file(cached->second, read_fault_file_name)) {
             read_fault_file_name = "";
             errno = EIO;
             have_eio_error = true;
@@ -150,13 +150,50 @@ ssize_t ota_read(int fd, void* buf, size_t nbyte) {
     return status;
 }
 
+ssize_t ota_pread(int fd, void* buf, size_t nbyte, off64_t offset) {
+    if (should_fault_inject(OTAIO_READ)) {
+        std::lock_guard<std::mutex> lock(filename_mutex);
+        auto cached = filename_cache.find(fd);
+        if (cached != filename_cache.end()
+                && get_hit_file(cached->second, read_fault_file_name)) {
+            read_fault_file_name = "";
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pread64(fd, buf, nbyte, offset);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+ssize_t ota_preadv(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    if (should_fault_inject(OTAIO_READ)) {
+        std::lock_guard<std::mutex> lock(filename_mutex);
+        auto cached = filename_cache.find(fd);
+        if (cached != filename_cache.end()
+                && get_hit_file(cached->second, read_fault_file_name)) {
+            read_fault_file_name = "";
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = preadv64(fd, iov, iovcnt, offset);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
 size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
     if (should_fault_inject(OTAIO_WRITE)) {
         std::lock_guard<std::mutex> lock(filename_mutex);
         auto cached = filename_cache.find((intptr_t)stream);
-        const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, write_fault_file_name)) {
+                get_hit_file(cached->second, write_fault_file_name)) {
             write_fault_file_name = "";
             errno = EIO;
             have_eio_error = true;
@@ -174,9 +211,8 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
     if (should_fault_inject(OTAIO_WRITE)) {
         std::lock_guard<std::mutex> lock(filename_mutex);
         auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, write_fault_file_name)) {
+                get_hit_file(cached->second, write_fault_file_name)) {
             write_fault_file_name = "";
             errno = EIO;
             have_eio_error = true;
@@ -190,13 +226,50 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
     return status;
 }
 
+ssize_t ota_pwrite(int fd, const void* buf, size_t nbyte, off64_t offset) {
+    if (should_fault_inject(OTAIO_WRITE)) {
+        std::lock_guard<std::mutex> lock(filename_mutex);
+        auto cached = filename_cache.find(fd);
+        if (cached != filename_cache.end() &&
+                get_hit_file(cached->second, write_fault_file_name)) {
+            write_fault_file_name = "";
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pwrite64(fd, buf, nbyte, offset);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    if (should_fault_inject(OTAIO_WRITE)) {
+        std::lock_guard<std::mutex> lock(filename_mutex);
+        auto cached = filename_cache.find(fd);
+        if (cached != filename_cache.end()
+                && get_hit_file(cached->second, write_fault_file_name)) {
+            write_fault_file_name = "";
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pwritev64(fd, iov, iovcnt, offset);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
 int ota_fsync(int fd) {
     if (should_fault_inject(OTAIO_FSYNC)) {
         std::lock_guard<std::mutex> lock(filename_mutex);
         auto cached = filename_cache.find(fd);
-        const char* cached_path = cached->second;
         if (cached != filename_cache.end() &&
-                get_hit_file(cached_path, fsync_fault_file_name)) {
+                get_hit_file(cached->second, fsync_fault_file_name)) {
             fsync_fault_file_name = "";
             errno = EIO;
             have_eio_error = true;
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/hash.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <openssl/sha.h>
+
+// Batches with fewer bytes are hashed on the calling thread.
+static constexpr size_t kMinParallelBytes = 1024 * 1024;
+// The maximum number of threads that hash a batch.
+static constexpr size_t kMaxHashThreads = 4;
+
+size_t DigestLength(HashAlgorithm algorithm) {
+  return algorithm == HashAlgorithm::SHA1 ? SHA_DIGEST_LENGTH : SHA256_DIGEST_LENGTH;
+}
+
+void ComputeDigest(HashAlgorithm algorithm, const uint8_t* data, size_t size, uint8_t* digest) {
+  if (algorithm == HashAlgorithm::SHA1) {
+    SHA1(data, size, digest);
+  } else {
+    SHA256(data, size, digest);
+  }
+}
+
+void ComputeDigests(HashAlgorithm algorithm, const std::vector<HashRequest>& requests) {
+  size_t total = 0;
+  for (const auto& request : requests) {
+    total += request.size;
+  }
+
+  size_t num_threads = std::min<size_t>(
+      { kMaxHashThreads, std::thread::hardware_concurrency(), requests.size() });
+  if (num_threads <= 1 || total < kMinParallelBytes) {
+    for (const auto& request : requests) {
+      ComputeDigest(algorithm, request.data, request.size, request.digest);
+    }
+    return;
+  }
+
+  // Split the requests into groups of about the same number of bytes.
+  size_t bytes_per_group = (total + num_threads - 1) / num_threads;
+  std::vector<std::future<void>> threads;
+  size_t begin = 0;
+  while (begin < requests.size()) {
+    size_t end = begin;
+    size_t bytes = 0;
+    while (end < requests.size() && (bytes < bytes_per_group || end == begin)) {
+      bytes += requests[end].size;
+      end++;
+    }
+    threads.emplace_back(std::async(std::launch::async, [algorithm, &requests, begin, end]() {
+      for (size_t i = begin; i < end; i++) {
+        ComputeDigest(algorithm, requests[i].data, requests[i].size, requests[i].digest);
+      }
+    }));
+    begin = end;
+  }
+  for (auto& thread : threads) {
+    thread.wait();
+  }
+}
+
+std::vector<uint8_t> ComputeBlockDigests(HashAlgorithm algorithm, const uint8_t* data,
+                                         size_t block_size, size_t count) {
+  size_t digest_length = DigestLength(algorithm);
+  std::vector<uint8_t> digests(count * digest_length);
+  std::vector<HashRequest> requests;
+  for (size_t i = 0; i < count; i++) {
+    requests.push_back({ data + i * block_size, block_size, digests.data() + i * digest_length });
+  }
+  ComputeDigests(algorithm, requests);
+  return digests;
+}
+
+HashContext::HashContext(HashAlgorithm algorithm) : algorithm_(algorithm) {
+  if (algorithm_ == HashAlgorithm::SHA1) {
+    SHA1_Init(&ctx_.sha1);
+  } else {
+    SHA256_Init(&ctx_.sha256);
+  }
+}
+
+void HashContext::Update(const uint8_t* data, size_t size) {
+  if (algorithm_ == HashAlgorithm::SHA1) {
+    SHA1_Update(&ctx_.sha1, data, size);
+  } else {
+    SHA256_Update(&ctx_.sha256, data, size);
+  }
+}
+
+void HashContext::Peek(uint8_t* digest) const {
+  HashContext copy = *this;
+  copy.Final(digest);
+}
+
+void HashContext::Final(uint8_t* digest) {
+  if (algorithm_ == HashAlgorithm::SHA1) {
+    SHA1_Final(digest, &ctx_.sha1);
+  } else {
+    SHA256_Final(digest, &ctx_.sha256);
+  }
+}
+
+bool ComputeStreamDigest(HashAlgorithm algorithm, size_t chunk_size,
+                         const std::function<ssize_t(uint8_t*, size_t)>& reader, uint8_t* digest) {
+  CHECK_GT(chunk_size, static_cast<size_t>(0));
+
+  HashContext ctx(algorithm);
+  std::vector<uint8_t> buffers[2] = { std::vector<uint8_t>(chunk_size),
+                                      std::vector<uint8_t>(chunk_size) };
+  // The chunks are handed over to a single hashing thread, alternating between the two buffers.
+  // A buffer is owned by the hashing thread while its size is set.
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t sizes[2] = { 0, 0 };
+  bool finished = false;
+  std::thread hasher([&]() {
+    for (size_t current = 0;; current ^= 1) {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return sizes[current] > 0 || finished; });
+      if (sizes[current] == 0) {
+        return;
+      }
+      size_t size = sizes[current];
+      lock.unlock();
+      ctx.Update(buffers[current].data(), size);
+      lock.lock();
+      sizes[current] = 0;
+      cv.notify_all();
+    }
+  });
+
+  // Read the next chunk into the other buffer, while the current one is being hashed. The reader
+  // runs on the calling thread, so its errno is preserved for the caller.
+  ssize_t size;
+  for (size_t current = 0;; current ^= 1) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return sizes[current] == 0; });
+    }
+    size = reader(buffers[current].data(), chunk_size);
+    if (size <= 0) {
+      break;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    sizes[current] = size;
+    cv.notify_all();
+  }
+  int saved_errno = errno;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    cv.notify_all();
+  }
+  hasher.join();
+
+  if (size == -1) {
+    errno = saved_errno;
+    return false;
+  }
+  ctx.Final(digest);
+  return true;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_HASH_H_
+#define _OTAUTIL_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <vector>
+
+#include <openssl/sha.h>
+
+// Shared SHA-1 / SHA-256 helpers for the verification paths. The block transforms come from
+// BoringSSL, which picks the SHA-NI / ARMv8 crypto extension implementations at runtime when the
+// CPU supports them. On top of that, independent buffers are hashed in batches that get spread over
+// a few threads, and long streams overlap reading with hashing.
+
+enum class HashAlgorithm {
+  SHA1,
+  SHA256,
+};
+
+// Returns the digest length of the given algorithm, in bytes.
+size_t DigestLength(HashAlgorithm algorithm);
+
+// Computes the digest of a single buffer.
+void ComputeDigest(HashAlgorithm algorithm, const uint8_t* data, size_t size, uint8_t* digest);
+
+// A buffer to be hashed, and where to save its digest (DigestLength() bytes).
+struct HashRequest {
+  const uint8_t* data;
+  size_t size;
+  uint8_t* digest;
+};
+
+// Computes the digests of all the given buffers. Large batches are hashed on a pool of threads.
+void ComputeDigests(HashAlgorithm algorithm, const std::vector<HashRequest>& requests);
+
+// Computes the digest of each |block_size| block in |data|, which holds |count| blocks. Returns
+// the concatenated digests.
+std::vector<uint8_t> ComputeBlockDigests(HashAlgorithm algorithm, const uint8_t* data,
+                                         size_t block_size, size_t count);
+
+// An incremental hash, whose intermediate digests can be taken at any point.
+class HashContext {
+ public:
+  explicit HashContext(HashAlgorithm algorithm);
+
+  void Update(const uint8_t* data, size_t size);
+
+  // Saves the digest of all the data so far, and the context remains usable.
+  void Peek(uint8_t* digest) const;
+
+  // Saves the final digest. The context must not be updated afterwards.
+  void Final(uint8_t* digest);
+
+ private:
+  HashAlgorithm algorithm_;
+  union {
+    SHA_CTX sha1;
+    SHA256_CTX sha256;
+  } ctx_;
+};
+
+// Reads a stream through |reader| in chunks of up to |chunk_size| bytes, and computes its digest.
+// The chunks are hashed on a separate thread while the next one is being read. |reader| is called
+// on the calling thread with a buffer and its capacity, and returns the number of bytes read; 0
+// marks the end of the stream, and -1 an error. Returns false if |reader| fails, with errno left
+// as the reader set it.
+bool ComputeStreamDigest(HashAlgorithm algorithm, size_t chunk_size,
+                         const std::function<ssize_t(uint8_t*, size_t)>& reader, uint8_t* digest);
+
+#endif  // _OTAUTIL_HASH_H_
@@ -17,24 +17,193 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <algorithm>
+#include <iterator>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 using Range = std::pair<size_t, size_t>;
 
+// A RangeSet keeps the start and the end blocks of its ranges in separate 32-bit arrays, together
+// with the running total of blocks up to each range. Up to kInlineRanges ranges (which covers most
+// of the transfer list commands) are stored within the object itself, without any allocation.
 class RangeSet {
  public:
-  RangeSet() : blocks_(0) {}
+  // The number of ranges that fit into a RangeSet without allocating.
+  static constexpr size_t kInlineRanges = 4;
+
+ private:
+  // A vector of trivially copyable values, with the first kInlineRanges of them stored inline.
+  template <typename T>
+  class InlineVector {
+   public:
+    InlineVector() = default;
+
+    InlineVector(const InlineVector& other) {
+      *this = other;
+    }
+
+    InlineVector(InlineVector&& other) noexcept {
+      *this = std::move(other);
+    }
+
+    InlineVector& operator=(const InlineVector& other) {
+      if (this != &other) {
+        size_ = 0;
+        reserve(other.size_);
+        std::copy(other.data(), other.data() + other.size_, data());
+        size_ = other.size_;
+      }
+      return *this;
+    }
+
+    InlineVector& operator=(InlineVector&& other) noexcept {
+      if (this != &other) {
+        if (other.heap_) {
+          heap_ = std::move(other.heap_);
+          capacity_ = other.capacity_;
+        } else {
+          heap_.reset();
+          capacity_ = kInlineRanges;
+          std::copy(other.inline_, other.inline_ + other.size_, inline_);
+        }
+        size_ = other.size_;
+        other.capacity_ = kInlineRanges;
+        other.size_ = 0;
+      }
+      return *this;
+    }
+
+    const T* data() const {
+      return heap_ ? heap_.get() : inline_;
+    }
+
+    T* data() {
+      return heap_ ? heap_.get() : inline_;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    const T& operator[](size_t i) const {
+      return data()[i];
+    }
+
+    T& operator[](size_t i) {
+      return data()[i];
+    }
+
+    void reserve(size_t capacity) {
+      if (capacity <= capacity_) {
+        return;
+      }
+      std::unique_ptr<T[]> heap(new T[capacity]);
+      std::copy(data(), data() + size_, heap.get());
+      heap_ = std::move(heap);
+      capacity_ = capacity;
+    }
+
+    void push_back(T value) {
+      if (size_ == capacity_) {
+        reserve(capacity_ * 2);
+      }
+      data()[size_++] = value;
+    }
+
+    // Keeps the storage for reuse.
+    void clear() {
+      size_ = 0;
+    }
+
+   private:
+    T inline_[kInlineRanges];
+    std::unique_ptr<T[]> heap_;
+    size_t size_ = 0;
+    size_t capacity_ = kInlineRanges;
+  };
+
+  // Iterates over the ranges, forwards or backwards. The ranges are returned by value, as their
+  // bounds aren't stored together.
+  template <bool kReverse>
+  class RangeIterator {
+   public:
+    // Holds the Range to be accessed through operator->().
+    class ArrowProxy {
+     public:
+      explicit ArrowProxy(Range range) : range_(range) {}
+
+      const Range* operator->() const {
+        return &range_;
+      }
+
+     private:
+      Range range_;
+    };
+
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Range;
+    using difference_type = ptrdiff_t;
+    using pointer = ArrowProxy;
+    using reference = Range;
+
+    RangeIterator(const RangeSet* rs, size_t index) : rs_(rs), index_(index) {}
+
+    Range operator*() const {
+      return (*rs_)[kReverse ? index_ - 1 : index_];
+    }
+
+    ArrowProxy operator->() const {
+      return ArrowProxy(**this);
+    }
+
+    RangeIterator& operator++() {
+      if (kReverse) {
+        index_--;
+      } else {
+        index_++;
+      }
+      return *this;
+    }
+
+    RangeIterator operator++(int) {
+      RangeIterator it = *this;
+      ++*this;
+      return it;
+    }
+
+    bool operator==(const RangeIterator& other) const {
+      return rs_ == other.rs_ && index_ == other.index_;
+    }
+
+    bool operator!=(const RangeIterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    const RangeSet* rs_;
+    // For the reverse iterator, one past the index of the current range.
+    size_t index_;
+  };
+
+ public:
+  using const_iterator = RangeIterator<false>;
+  using const_reverse_iterator = RangeIterator<true>;
+
+  RangeSet() {}
 
   explicit RangeSet(std::vector<Range>&& pairs);
 
   // Parses the given string into a RangeSet. Returns the parsed RangeSet, or an empty RangeSet on
-  // errors.
-  static RangeSet Parse(const std::string& range_text);
+  // errors. The text is parsed in place, without being split into separate strings.
+  static RangeSet Parse(std::string_view range_text);
 
-  // Appends the given Range to the current RangeSet.
+  // Appends the given Range to the current RangeSet. Block numbers must fit into 32 bits.
   bool PushBack(Range range);
 
   // Clears all the ranges from the RangeSet.
@@ -42,11 +211,13 @@ class RangeSet {
 
   std::string ToString() const;
 
-  // Gets the block number for the i-th (starting from 0) block in the RangeSet.
+  // Gets the block number for the i-th (starting from 0) block in the RangeSet, by a binary search
+  // over the running block counts.
   size_t GetBlockNumber(size_t idx) const;
 
   // Returns whether the current RangeSet overlaps with other. RangeSet has half-closed half-open
   // bounds. For example, "3,5" contains blocks 3 and 4. So "3,5" and "5,7" are not overlapped.
+  // Takes O(n + m) if both sets have their ranges in ascending order.
   bool Overlaps(const RangeSet& other) const;
 
   // Returns a vector of RangeSets that contain the same set of blocks represented by the current
@@ -59,69 +230,75 @@ class RangeSet {
 
   // Returns the number of Range's in this RangeSet.
   size_t size() const {
-    return ranges_.size();
+    return starts_.size();
   }
 
   // Returns the total number of blocks in this RangeSet.
   size_t blocks() const {
-    return blocks_;
-  }
-
-  std::vector<Range>::const_iterator cbegin() const {
-    return ranges_.cbegin();
+    return size() == 0 ? 0 : totals_[size() - 1];
   }
 
-  std::vector<Range>::const_iterator cend() const {
-    return ranges_.cend();
+  // Returns whether the ranges are in ascending order, without overlapping each other.
+  bool sorted() const {
+    return sorted_;
   }
 
-  std::vector<Range>::iterator begin() {
-    return ranges_.begin();
+  const_iterator cbegin() const {
+    return const_iterator(this, 0);
   }
 
-  std::vector<Range>::iterator end() {
-    return ranges_.end();
+  const_iterator cend() const {
+    return const_iterator(this, size());
   }
 
-  std::vector<Range>::const_iterator begin() const {
-    return ranges_.begin();
+  const_iterator begin() const {
+    return cbegin();
   }
 
-  std::vector<Range>::const_iterator end() const {
-    return ranges_.end();
+  const_iterator end() const {
+    return cend();
   }
 
   // Reverse const iterators for MoveRange().
-  std::vector<Range>::const_reverse_iterator crbegin() const {
-    return ranges_.crbegin();
+  const_reverse_iterator crbegin() const {
+    return const_reverse_iterator(this, size());
   }
 
-  std::vector<Range>::const_reverse_iterator crend() const {
-    return ranges_.crend();
+  const_reverse_iterator crend() const {
+    return const_reverse_iterator(this, 0);
   }
 
   // Returns whether the RangeSet is valid (i.e. non-empty).
   explicit operator bool() const {
-    return !ranges_.empty();
+    return size() != 0;
   }
 
-  const Range& operator[](size_t i) const {
-    return ranges_[i];
+  Range operator[](size_t i) const {
+    return Range{ starts_[i], ends_[i] };
   }
 
   bool operator==(const RangeSet& other) const {
     // The orders of Range's matter. "4,1,5,8,10" != "4,8,10,1,5".
-    return (ranges_ == other.ranges_);
+    return size() == other.size() &&
+           std::equal(starts_.data(), starts_.data() + size(), other.starts_.data()) &&
+           std::equal(ends_.data(), ends_.data() + size(), other.ends_.data());
   }
 
   bool operator!=(const RangeSet& other) const {
-    return ranges_ != other.ranges_;
+    return !(*this == other);
   }
 
  protected:
-  // Actual limit for each value and the total number are both INT_MAX.
-  std::vector<Range> ranges_;
-  size_t blocks_;
+  // Appends a non-empty range that's known to be valid.
+  void Append(uint32_t start, uint32_t end);
+
+  // Actual limit for each value is UINT32_MAX (INT_MAX when parsed from text), and the total
+  // number of blocks is limited to SIZE_MAX.
+  InlineVector<uint32_t> starts_;
+  InlineVector<uint32_t> ends_;
+  // The number of blocks in the ranges up to (and including) each range.
+  InlineVector<size_t> totals_;
+  bool sorted_ = true;
 };
 
 // The class is a sorted version of a RangeSet; and it's useful in imgdiff to split the input
@@ -141,9 +318,12 @@ class SortedRangeSet : public RangeSet {
 
   SortedRangeSet() {}
 
-  // Ranges in the the set should be mutually exclusive; and they're sorted by the start block.
+  // Sorts the ranges by the start block, and merges the overlapping or adjacent ones.
   explicit SortedRangeSet(std::vector<Range>&& pairs);
 
+  // Sorts and merges the ranges of the given RangeSet.
+  explicit SortedRangeSet(const RangeSet& rs);
+
   void Insert(const Range& to_insert);
 
   // Insert the input SortedRangeSet; keep the ranges sorted and merge the overlap ranges.
@@ -152,6 +332,12 @@ class SortedRangeSet : public RangeSet {
   // Compute the block range the file occupies, and insert that range.
   void Insert(size_t start, size_t len);
 
+  // Set operations in a single pass over both sets, i.e. O(n + m).
+  SortedRangeSet Union(const SortedRangeSet& other) const;
+  SortedRangeSet Intersect(const SortedRangeSet& other) const;
+  // Returns the blocks that are in the current set, but not in other.
+  SortedRangeSet Subtract(const SortedRangeSet& other) const;
+
   using RangeSet::Overlaps;
 
   bool Overlaps(size_t start, size_t len) const;
@@ -167,4 +353,12 @@ class SortedRangeSet : public RangeSet {
   // item in SortedRangeSet("1-9 15-19"). So its data can be found at offset 40970 (i.e. 4096 * 10
   // + 10) in a range represented by this SortedRangeSet.
   size_t GetOffsetInRangeSet(size_t old_offset) const;
+
+ private:
+  // Returns the index of the first range that ends after the given block, or size() if none.
+  size_t FindRange(size_t block) const;
+
+  // Appends a range that starts no earlier than the last one, merging the two if they overlap or
+  // are adjacent.
+  void AppendMerged(uint32_t start, uint32_t end);
 };
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_ZERO_FILLER_H_
+#define _OTAUTIL_ZERO_FILLER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+#include <android-base/macros.h>
+
+// ZeroFiller zeroes out byte ranges of a block device (or a regular file), letting the kernel do
+// the work whenever it can. The methods are tried in the order below on the first request, and the
+// first one that works is kept for the lifetime of the object, i.e. the strategy is picked once per
+// device:
+//   1. BLKZEROOUT, which turns into WRITE ZEROES / WRITE SAME on devices that support them;
+//   2. fallocate(FALLOC_FL_ZERO_RANGE);
+//   3. fallocate(FALLOC_FL_PUNCH_HOLE);
+//   4. BLKDISCARD, only if the device reports that discarded blocks read back as zeroes;
+//   5. writing a shared zero buffer with large vectored writes.
+// It's safe to be used by multiple threads. Writes go through the libotafault wrappers, and an EIO
+// from any of the methods sets have_eio_error. It's only available on the device.
+class ZeroFiller {
+ public:
+  enum class Method {
+    kUnknown,
+    kZeroOut,
+    kZeroRange,
+    kPunchHole,
+    kDiscardZeroes,
+    kWrite,
+  };
+
+  explicit ZeroFiller(int fd) : fd_(fd) {}
+
+  // Zeroes out |length| bytes starting at |offset|. A regular file gets extended as needed.
+  bool Zero(uint64_t offset, uint64_t length);
+
+  Method method() const {
+    return method_;
+  }
+
+  // The total number of bytes zeroed, and the total time spent on it.
+  uint64_t bytes() const {
+    return bytes_;
+  }
+  uint64_t elapsed_ms() const {
+    return elapsed_ns_ / 1000000;
+  }
+
+  static const char* MethodName(Method method);
+
+ private:
+  // Tries the methods in order on the given range, and saves the first one that works.
+  bool Probe(uint64_t offset, uint64_t length);
+  bool ZeroWith(Method method, uint64_t offset, uint64_t length);
+  // Zeroes the range with one of the ioctl() or fallocate() methods.
+  bool ZeroInKernel(Method method, uint64_t offset, uint64_t length);
+  bool WriteZeroes(uint64_t offset, uint64_t length);
+
+  int fd_;
+  bool is_block_device_ = false;  // Set by Probe().
+  std::atomic<Method> method_{ Method::kUnknown };
+  std::mutex probe_lock_;
+
+  std::atomic<uint64_t> bytes_{ 0 };
+  std::atomic<uint64_t> elapsed_ns_{ 0 };
+
+  DISALLOW_COPY_AND_ASSIGN(ZeroFiller);
+};
+
+#endif  // _OTAUTIL_ZERO_FILLER_H_
@@ -16,21 +16,20 @@
 
 #include "otautil/rangeset.h"
 
+#include <ctype.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <algorithm>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
-#include <android-base/parseint.h>
-#include <android-base/stringprintf.h>
-#include <android-base/strings.h>
 
 RangeSet::RangeSet(std::vector<Range>&& pairs) {
-  blocks_ = 0;
   if (pairs.empty()) {
     LOG(ERROR) << "Invalid number of tokens";
     return;
@@ -44,15 +43,38 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
   }
 }
 
-RangeSet RangeSet::Parse(const std::string& range_text) {
-  std::vector<std::string> pieces = android::base::Split(range_text, ",");
-  if (pieces.size() < 3) {
-    LOG(ERROR) << "Invalid range text: " << range_text;
-    return {};
+// Parses the next comma separated field of |*text| as a decimal number no larger than INT_MAX,
+// and removes it (and the comma) from |*text|. Leading whitespace is allowed, the same as
+// android::base::ParseUint().
+static bool ParseNextNumber(std::string_view* text, size_t* value) {
+  size_t end = std::min(text->find(','), text->size());
+  size_t begin = 0;
+  while (begin < end && isspace(static_cast<unsigned char>((*text)[begin]))) {
+    begin++;
+  }
+  if (begin == end) {
+    return false;
   }
+  size_t result = 0;
+  for (size_t i = begin; i < end; i++) {
+    char c = (*text)[i];
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    result = result * 10 + (c - '0');
+    if (result > static_cast<size_t>(INT_MAX)) {
+      return false;
+    }
+  }
+  text->remove_prefix(std::min(end + 1, text->size()));
+  *value = result;
+  return true;
+}
 
+RangeSet RangeSet::Parse(std::string_view range_text) {
+  std::string_view text = range_text;
   size_t num;
-  if (!android::base::ParseUint(pieces[0], &num, static_cast<size_t>(INT_MAX))) {
+  if (!ParseNextNumber(&text, &num)) {
     LOG(ERROR) << "Failed to parse the number of tokens: " << range_text;
     return {};
   }
@@ -64,22 +86,24 @@ RangeSet RangeSet::Parse(const std::string& range_text) {
     LOG(ERROR) << "Number of tokens must be even: " << range_text;
     return {};
   }
-  if (num != pieces.size() - 1) {
+  if (num != static_cast<size_t>(std::count(text.begin(), text.end(), ',')) + 1) {
     LOG(ERROR) << "Mismatching number of tokens: " << range_text;
     return {};
   }
 
-  std::vector<Range> pairs;
+  RangeSet result;
+  result.starts_.reserve(num / 2);
+  result.ends_.reserve(num / 2);
+  result.totals_.reserve(num / 2);
   for (size_t i = 0; i < num; i += 2) {
     size_t first;
     size_t second;
-    if (!android::base::ParseUint(pieces[i + 1], &first, static_cast<size_t>(INT_MAX)) ||
-        !android::base::ParseUint(pieces[i + 2], &second, static_cast<size_t>(INT_MAX))) {
+    if (!ParseNextNumber(&text, &first) || !ParseNextNumber(&text, &second) ||
+        !result.PushBack({ first, second })) {
       return {};
     }
-    pairs.emplace_back(first, second);
   }
-  return RangeSet(std::move(pairs));
+  return result;
 }
 
 bool RangeSet::PushBack(Range range) {
@@ -87,54 +111,69 @@ bool RangeSet::PushBack(Range range) {
     LOG(ERROR) << "Empty or negative range: " << range.first << ", " << range.second;
     return false;
   }
+  if (range.second > UINT32_MAX) {
+    LOG(ERROR) << "Block number out of range: " << range.second;
+    return false;
+  }
   size_t sz = range.second - range.first;
-  if (blocks_ >= SIZE_MAX - sz) {
+  if (blocks() >= SIZE_MAX - sz) {
     LOG(ERROR) << "RangeSet size overflow";
     return false;
   }
 
-  ranges_.push_back(std::move(range));
-  blocks_ += sz;
+  Append(range.first, range.second);
   return true;
 }
 
+void RangeSet::Append(uint32_t start, uint32_t end) {
+  size_t n = size();
+  if (n != 0 && start < ends_[n - 1]) {
+    sorted_ = false;
+  }
+  totals_.push_back(blocks() + (end - start));
+  starts_.push_back(start);
+  ends_.push_back(end);
+}
+
 void RangeSet::Clear() {
-  ranges_.clear();
-  blocks_ = 0;
+  starts_.clear();
+  ends_.clear();
+  totals_.clear();
+  sorted_ = true;
 }
 
 std::vector<RangeSet> RangeSet::Split(size_t groups) const {
-  if (ranges_.empty() || groups == 0) return {};
+  size_t total = blocks();
+  if (total == 0 || groups == 0) return {};
 
-  if (blocks_ < groups) {
-    groups = blocks_;
+  if (total < groups) {
+    groups = total;
   }
 
   // Evenly distribute blocks, with the first few groups possibly containing one more.
-  size_t mean = blocks_ / groups;
+  size_t mean = total / groups;
   std::vector<size_t> blocks_per_group(groups, mean);
-  std::fill_n(blocks_per_group.begin(), blocks_ % groups, mean + 1);
+  std::fill_n(blocks_per_group.begin(), total % groups, mean + 1);
 
   std::vector<RangeSet> result;
 
   // Forward iterate Ranges and fill up each group with the desired number of blocks.
-  auto it = ranges_.cbegin();
-  Range range = *it;
+  size_t index = 0;
+  uint32_t start = starts_[0];
   for (const auto& blocks : blocks_per_group) {
     RangeSet buffer;
     size_t needed = blocks;
     while (needed > 0) {
-      size_t range_blocks = range.second - range.first;
+      size_t range_blocks = ends_[index] - start;
       if (range_blocks > needed) {
-        // Split the current range and don't advance the iterator.
-        buffer.PushBack({ range.first, range.first + needed });
-        range.first = range.first + needed;
+        // Split the current range and don't advance the index.
+        buffer.Append(start, start + needed);
+        start += needed;
         break;
       }
-      buffer.PushBack(range);
-      it++;
-      if (it != ranges_.cend()) {
-        range = *it;
+      buffer.Append(start, ends_[index]);
+      if (++index < size()) {
+        start = starts_[index];
       }
       needed -= range_blocks;
     }
@@ -144,12 +183,15 @@ std::vector<RangeSet> RangeSet::Split(size_t groups) const {
 }
 
 std::string RangeSet::ToString() const {
-  if (ranges_.empty()) {
+  if (size() == 0) {
     return "";
   }
-  std::string result = std::to_string(ranges_.size() * 2);
-  for (const auto& r : ranges_) {
-    result += android::base::StringPrintf(",%zu,%zu", r.first, r.second);
+  std::string result = std::to_string(size() * 2);
+  for (size_t i = 0; i < size(); i++) {
+    result += ',';
+    result += std::to_string(starts_[i]);
+    result += ',';
+    result += std::to_string(ends_[i]);
   }
 
   return result;
@@ -157,40 +199,95 @@ std::string RangeSet::ToString() const {
 
 // Get the block number for the i-th (starting from 0) block in the RangeSet.
 size_t RangeSet::GetBlockNumber(size_t idx) const {
-  CHECK_LT(idx, blocks_) << "Out of bound index " << idx << " (total blocks: " << blocks_ << ")";
-
-  for (const auto& range : ranges_) {
-    if (idx < range.second - range.first) {
-      return range.first + idx;
-    }
-    idx -= (range.second - range.first);
-  }
+  CHECK_LT(idx, blocks()) << "Out of bound index " << idx << " (total blocks: " << blocks() << ")";
 
-  CHECK(false) << "Failed to find block number for index " << idx;
-  return 0;  // Unreachable, but to make compiler happy.
+  // The first range whose running total goes past idx holds the block.
+  const size_t* totals = totals_.data();
+  size_t i = std::upper_bound(totals, totals + size(), idx) - totals;
+  size_t before = (i == 0) ? 0 : totals[i - 1];
+  return starts_[i] + (idx - before);
 }
 
+// Up to this many pairs of ranges from unsorted sets are compared exhaustively, which beats sorting
+// them for the short sets of most commands.
+static constexpr size_t kMaxExhaustiveOverlapPairs = 256;
+
 // RangeSet has half-closed half-open bounds. For example, "3,5" contains blocks 3 and 4. So "3,5"
 // and "5,7" are not overlapped.
 bool RangeSet::Overlaps(const RangeSet& other) const {
-  for (const auto& range : ranges_) {
-    size_t start = range.first;
-    size_t end = range.second;
-    for (const auto& other_range : other.ranges_) {
-      size_t other_start = other_range.first;
-      size_t other_end = other_range.second;
-      // [start, end) vs [other_start, other_end)
-      if (!(other_start >= end || start >= other_end)) {
+  size_t n = size();
+  size_t m = other.size();
+  if (n == 0 || m == 0) {
+    return false;
+  }
+
+  if (sorted_ && other.sorted_) {
+    const uint32_t* starts = starts_.data();
+    const uint32_t* ends = ends_.data();
+    const uint32_t* other_starts = other.starts_.data();
+    const uint32_t* other_ends = other.ends_.data();
+    size_t i = 0;
+    size_t j = 0;
+    while (i < n && j < m) {
+      if (ends[i] <= other_starts[j]) {
+        i++;
+      } else if (other_ends[j] <= starts[i]) {
+        j++;
+      } else {
         return true;
       }
     }
+    return false;
+  }
+
+  if (n * m > kMaxExhaustiveOverlapPairs) {
+    return SortedRangeSet(*this).Overlaps(SortedRangeSet(other));
+  }
+
+  // Without branches in the inner loop, so that it can be vectorized.
+  const uint32_t* other_starts = other.starts_.data();
+  const uint32_t* other_ends = other.ends_.data();
+  for (size_t i = 0; i < n; i++) {
+    uint32_t start = starts_[i];
+    uint32_t end = ends_[i];
+    unsigned overlapped = 0;
+    for (size_t j = 0; j < m; j++) {
+      // [start, end) vs [other_start, other_end)
+      overlapped |= (other_starts[j] < end) & (start < other_ends[j]);
+    }
+    if (overlapped) {
+      return true;
+    }
   }
   return false;
 }
 
-// Ranges in the the set should be mutually exclusive; and they're sorted by the start block.
-SortedRangeSet::SortedRangeSet(std::vector<Range>&& pairs) : RangeSet(std::move(pairs)) {
-  std::sort(ranges_.begin(), ranges_.end());
+SortedRangeSet::SortedRangeSet(std::vector<Range>&& pairs)
+    : SortedRangeSet(RangeSet(std::move(pairs))) {}
+
+SortedRangeSet::SortedRangeSet(const RangeSet& rs) {
+  std::vector<Range> pairs(rs.cbegin(), rs.cend());
+  if (!rs.sorted()) {
+    std::sort(pairs.begin(), pairs.end());
+  }
+  starts_.reserve(pairs.size());
+  ends_.reserve(pairs.size());
+  totals_.reserve(pairs.size());
+  for (const auto& range : pairs) {
+    AppendMerged(range.first, range.second);
+  }
+}
+
+void SortedRangeSet::AppendMerged(uint32_t start, uint32_t end) {
+  size_t n = size();
+  if (n != 0 && start <= ends_[n - 1]) {
+    if (end > ends_[n - 1]) {
+      totals_[n - 1] += end - ends_[n - 1];
+      ends_[n - 1] = end;
+    }
+    return;
+  }
+  Append(start, end);
 }
 
 void SortedRangeSet::Insert(const Range& to_insert) {
@@ -203,25 +300,7 @@ void SortedRangeSet::Insert(const SortedRangeSet& rs) {
   if (rs.size() == 0) {
     return;
   }
-  // Merge and sort the two RangeSets.
-  std::vector<Range> temp = std::move(ranges_);
-  std::copy(rs.begin(), rs.end(), std::back_inserter(temp));
-  std::sort(temp.begin(), temp.end());
-
-  Clear();
-  // Trim overlaps and insert the result back to ranges_.
-  Range to_insert = temp.front();
-  for (auto it = temp.cbegin() + 1; it != temp.cend(); it++) {
-    if (it->first <= to_insert.second) {
-      to_insert.second = std::max(to_insert.second, it->second);
-    } else {
-      ranges_.push_back(to_insert);
-      blocks_ += (to_insert.second - to_insert.first);
-      to_insert = *it;
-    }
-  }
-  ranges_.push_back(to_insert);
-  blocks_ += (to_insert.second - to_insert.first);
+  *this = Union(rs);
 }
 
 // Compute the block range the file occupies, and insert that range.
@@ -230,9 +309,79 @@ void SortedRangeSet::Insert(size_t start, size_t len) {
   Insert(to_insert);
 }
 
+SortedRangeSet SortedRangeSet::Union(const SortedRangeSet& other) const {
+  SortedRangeSet result;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < size() || j < other.size()) {
+    if (j == other.size() || (i < size() && starts_[i] <= other.starts_[j])) {
+      result.AppendMerged(starts_[i], ends_[i]);
+      i++;
+    } else {
+      result.AppendMerged(other.starts_[j], other.ends_[j]);
+      j++;
+    }
+  }
+  return result;
+}
+
+SortedRangeSet SortedRangeSet::Intersect(const SortedRangeSet& other) const {
+  SortedRangeSet result;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < size() && j < other.size()) {
+    uint32_t start = std::max(starts_[i], other.starts_[j]);
+    uint32_t end = std::min(ends_[i], other.ends_[j]);
+    if (start < end) {
+      result.Append(start, end);
+    }
+    // Moves past whichever range ends first; the other one may still overlap the next range.
+    if (ends_[i] < other.ends_[j]) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  return result;
+}
+
+SortedRangeSet SortedRangeSet::Subtract(const SortedRangeSet& other) const {
+  SortedRangeSet result;
+  size_t j = 0;
+  for (size_t i = 0; i < size(); i++) {
+    uint32_t start = starts_[i];
+    uint32_t end = ends_[i];
+    // Skips the ranges of other that end before the current one.
+    while (j < other.size() && other.ends_[j] <= start) {
+      j++;
+    }
+    // Cuts out the ranges of other that overlap the current one. The last of them may also
+    // overlap the next range, so it stays.
+    size_t k = j;
+    while (start < end && k < other.size() && other.starts_[k] < end) {
+      if (other.starts_[k] > start) {
+        result.Append(start, other.starts_[k]);
+      }
+      start = std::max(start, other.ends_[k]);
+      k++;
+    }
+    if (start < end) {
+      result.Append(start, end);
+    }
+  }
+  return result;
+}
+
+size_t SortedRangeSet::FindRange(size_t block) const {
+  const uint32_t* ends = ends_.data();
+  return std::upper_bound(ends, ends + size(), block) - ends;
+}
+
 bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
-  RangeSet rs({ { start / kBlockSize, (start + len - 1) / kBlockSize + 1 } });
-  return Overlaps(rs);
+  size_t start_block = start / kBlockSize;
+  size_t end_block = (start + len - 1) / kBlockSize + 1;
+  size_t i = FindRange(start_block);
+  return i < size() && starts_[i] < end_block;
 }
 
 // Given an offset of the file, checks if the corresponding block (by considering the file as
@@ -247,21 +396,17 @@ bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
 // + 10) in a range represented by this SortedRangeSet.
 size_t SortedRangeSet::GetOffsetInRangeSet(size_t old_offset) const {
   size_t old_block_start = old_offset / kBlockSize;
-  size_t new_block_start = 0;
-  for (const auto& range : ranges_) {
-    // Find the index of old_block_start.
-    if (old_block_start >= range.second) {
-      new_block_start += (range.second - range.first);
-    } else if (old_block_start >= range.first) {
-      new_block_start += (old_block_start - range.first);
-      return (new_block_start * kBlockSize + old_offset % kBlockSize);
-    } else {
-      CHECK(false) << "block_start " << old_block_start
-                   << " is missing between two ranges: " << this->ToString();
-      return 0;
-    }
+  size_t i = FindRange(old_block_start);
+  if (i == size()) {
+    CHECK(false) << "block_start " << old_block_start
+                 << " exceeds the limit of current RangeSet: " << this->ToString();
+    return 0;
+  }
+  if (old_block_start < starts_[i]) {
+    CHECK(false) << "block_start " << old_block_start
+                 << " is missing between two ranges: " << this->ToString();
+    return 0;
   }
-  CHECK(false) << "block_start " << old_block_start
-               << " exceeds the limit of current RangeSet: " << this->ToString();
-  return 0;
+  size_t new_block_start = (i == 0 ? 0 : totals_[i - 1]) + (old_block_start - starts_[i]);
+  return (new_block_start * kBlockSize + old_offset % kBlockSize);
 }
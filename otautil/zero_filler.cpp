@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/zero_filler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include <android-base/logging.h>
+
+#include "otafault/config.h"
+#include "otafault/ota_io.h"
+
+extern std::atomic<bool> have_eio_error;
+
+// The zero buffer shared by all the iovecs of a write, and the number of iovecs per write.
+static constexpr size_t kZeroBufferSize = 1024 * 1024;
+static constexpr size_t kMaxZeroIovecs = 16;
+static const uint8_t kZeroBuffer[kZeroBufferSize] = {};
+
+const char* ZeroFiller::MethodName(Method method) {
+  switch (method) {
+    case Method::kZeroOut:
+      return "BLKZEROOUT";
+    case Method::kZeroRange:
+      return "FALLOC_FL_ZERO_RANGE";
+    case Method::kPunchHole:
+      return "FALLOC_FL_PUNCH_HOLE";
+    case Method::kDiscardZeroes:
+      return "BLKDISCARD";
+    case Method::kWrite:
+      return "write";
+    default:
+      return "unknown";
+  }
+}
+
+bool ZeroFiller::Zero(uint64_t offset, uint64_t length) {
+  if (length == 0) {
+    return true;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  bool done = false;
+  Method method = method_;
+  // Fault injection only applies to the libotafault wrappers.
+  if (should_fault_inject(OTAIO_WRITE)) {
+    if (!WriteZeroes(offset, length)) {
+      return false;
+    }
+    done = true;
+  } else if (method == Method::kUnknown) {
+    std::lock_guard<std::mutex> lock(probe_lock_);
+    method = method_;
+    if (method == Method::kUnknown) {
+      if (!Probe(offset, length)) {
+        return false;
+      }
+      done = true;
+    }
+  }
+  if (!done && !ZeroWith(method, offset, length)) {
+    if (method == Method::kWrite) {
+      return false;
+    }
+    // The method has worked before, so don't give up on the device yet.
+    PLOG(WARNING) << MethodName(method) << " failed at offset " << offset << "; writing zeroes";
+    if (!WriteZeroes(offset, length)) {
+      return false;
+    }
+  }
+
+  bytes_ += length;
+  elapsed_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  return true;
+}
+
+bool ZeroFiller::Probe(uint64_t offset, uint64_t length) {
+  struct stat sb;
+  if (fstat(fd_, &sb) == -1) {
+    PLOG(ERROR) << "Failed to stat fd " << fd_;
+    return false;
+  }
+  is_block_device_ = S_ISBLK(sb.st_mode);
+
+  std::vector<Method> methods;
+  if (is_block_device_) {
+    methods.push_back(Method::kZeroOut);
+  }
+  methods.push_back(Method::kZeroRange);
+  methods.push_back(Method::kPunchHole);
+  if (is_block_device_) {
+    unsigned int zeroes = 0;
+    if (ioctl(fd_, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0) {
+      methods.push_back(Method::kDiscardZeroes);
+    }
+  }
+
+  for (const auto& method : methods) {
+    if (ZeroWith(method, offset, length)) {
+      LOG(INFO) << "Zeroing fd " << fd_ << " with " << MethodName(method);
+      method_ = method;
+      return true;
+    }
+    PLOG(INFO) << MethodName(method) << " unavailable on fd " << fd_;
+  }
+
+  if (!WriteZeroes(offset, length)) {
+    return false;
+  }
+  LOG(INFO) << "Zeroing fd " << fd_ << " with " << MethodName(Method::kWrite);
+  method_ = Method::kWrite;
+  return true;
+}
+
+bool ZeroFiller::ZeroWith(Method method, uint64_t offset, uint64_t length) {
+  if (method == Method::kWrite) {
+    return WriteZeroes(offset, length);
+  }
+  if (ZeroInKernel(method, offset, length)) {
+    return true;
+  }
+  // Same as the libotafault wrappers, so that the update gets retried.
+  if (errno == EIO) {
+    have_eio_error = true;
+  }
+  return false;
+}
+
+bool ZeroFiller::ZeroInKernel(Method method, uint64_t offset, uint64_t length) {
+  // Block devices only take fallocate() with FALLOC_FL_KEEP_SIZE, while a regular file needs to
+  // grow if the range goes past its end.
+  int keep_size = is_block_device_ ? FALLOC_FL_KEEP_SIZE : 0;
+  uint64_t range[2] = { offset, length };
+  switch (method) {
+    case Method::kZeroOut:
+      return ioctl(fd_, BLKZEROOUT, &range) == 0;
+    case Method::kZeroRange:
+      return fallocate(fd_, FALLOC_FL_ZERO_RANGE | keep_size, offset, length) == 0;
+    case Method::kPunchHole:
+      if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) != 0) {
+        return false;
+      }
+      if (!is_block_device_) {
+        struct stat sb;
+        if (fstat(fd_, &sb) != 0) {
+          return false;
+        }
+        if (static_cast<uint64_t>(sb.st_size) < offset + length &&
+            ftruncate(fd_, offset + length) != 0) {
+          return false;
+        }
+      }
+      return true;
+    case Method::kDiscardZeroes:
+      return ioctl(fd_, BLKDISCARD, &range) == 0;
+    default:
+      LOG(FATAL) << "Unknown zeroing method";
+      return false;
+  }
+}
+
+bool ZeroFiller::WriteZeroes(uint64_t offset, uint64_t length) {
+  while (length > 0) {
+    struct iovec iov[kMaxZeroIovecs];
+    int iovcnt = 0;
+    uint64_t batch = 0;
+    while (iovcnt < static_cast<int>(kMaxZeroIovecs) && batch < length) {
+      size_t len = static_cast<size_t>(std::min<uint64_t>(kZeroBufferSize, length - batch));
+      iov[iovcnt++] = { const_cast<uint8_t*>(kZeroBuffer), len };
+      batch += len;
+    }
+    ssize_t written = TEMP_FAILURE_RETRY(ota_pwritev(fd_, iov, iovcnt, offset));
+    if (written <= 0) {
+      PLOG(ERROR) << "Failed to write zeroes at offset " << offset;
+      return false;
+    }
+    offset += written;
+    length -= written;
+  }
+  return true;
+}
@@ -69,6 +69,7 @@
 #include "minui/minui.h"
 #include "otautil/DirUtil.h"
 #include "otautil/error_code.h"
+#include "otautil/zero_filler.h"
 #include "roots.h"
 #include "rotate_logs.h"
 #include "screen_ui.h"
@@ -1021,8 +1022,9 @@ static bool wipe_system() {
   return success;
 }
 
-// Secure-wipe a given partition. It uses BLKSECDISCARD, if supported. Otherwise, it goes with
-// BLKDISCARD (if device supports BLKDISCARDZEROES) or BLKZEROOUT.
+// Secure-wipe a given partition. It uses BLKSECDISCARD, if supported. Otherwise, it zeroes out the
+// partition with ZeroFiller (BLKZEROOUT, fallocate(), BLKDISCARD if the device supports
+// BLKDISCARDZEROES, or plain writes, whichever works first).
 static bool secure_wipe_partition(const std::string& partition) {
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(partition.c_str(), O_WRONLY)));
   if (fd == -1) {
@@ -1041,21 +1043,16 @@ static bool secure_wipe_partition(const std::string& partition) {
   if (ioctl(fd, BLKSECDISCARD, &range) == -1) {
     PLOG(WARNING) << "  Failed";
 
-    // Use BLKDISCARD if it zeroes out blocks, otherwise use BLKZEROOUT.
-    unsigned int zeroes;
-    if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes != 0) {
-      LOG(INFO) << "  Trying BLKDISCARD...";
-      if (ioctl(fd, BLKDISCARD, &range) == -1) {
-        PLOG(ERROR) << "  Failed";
-        return false;
-      }
-    } else {
-      LOG(INFO) << "  Trying BLKZEROOUT...";
-      if (ioctl(fd, BLKZEROOUT, &range) == -1) {
-        PLOG(ERROR) << "  Failed";
-        return false;
-      }
+    LOG(INFO) << "  Zeroing...";
+    ZeroFiller zero_filler(fd);
+    if (!zero_filler.Zero(range[0], range[1])) {
+      LOG(ERROR) << "  Failed";
+      return false;
     }
+    uint64_t elapsed_ms = std::max<uint64_t>(zero_filler.elapsed_ms(), 1);
+    LOG(INFO) << "  Zeroed with " << ZeroFiller::MethodName(zero_filler.method()) << " in "
+              << elapsed_ms << " ms (" << range[1] * 1000 / elapsed_ms / (1024 * 1024)
+              << " MiB/s)";
   }
 
   LOG(INFO) << "  Done";
@@ -19,6 +19,7 @@ LOCAL_PATH := $(call my-dir)
 # Unit tests
 include $(CLEAR_VARS)
 LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CPP_STD := c++17
 LOCAL_MODULE := recovery_unit_test
 LOCAL_COMPATIBILITY_SUITE := device-tests
 LOCAL_STATIC_LIBRARIES := \
@@ -26,20 +27,26 @@ LOCAL_STATIC_LIBRARIES := \
     libminui \
     libotautil \
     libupdater \
+    libotafault \
     libziparchive \
     libutils \
     libz \
     libselinux \
+    libcrypto \
     libbase \
     libBionicGtestMain
 
 LOCAL_SRC_FILES := \
     unit/asn1_decoder_test.cpp \
+    unit/block_io_test.cpp \
     unit/dirutil_test.cpp \
+    unit/hash_test.cpp \
     unit/locale_test.cpp \
     unit/rangeset_test.cpp \
     unit/sysutil_test.cpp \
+    unit/transfer_list_test.cpp \
     unit/zip_test.cpp \
+    unit/zero_filler_test.cpp \
     unit/ziputil_test.cpp
 
 LOCAL_C_INCLUDES := bootable/recovery
@@ -100,6 +107,7 @@ ifeq ($(BOARD_AVB_ENABLE),true)
 LOCAL_CFLAGS += -DBOARD_AVB_ENABLE=1
 endif
 
+LOCAL_CPP_STD := c++17
 LOCAL_MODULE := recovery_component_test
 LOCAL_COMPATIBILITY_SUITE := device-tests
 LOCAL_C_INCLUDES := bootable/recovery
@@ -198,6 +206,7 @@ include $(BUILD_NATIVE_TEST)
 # Host tests
 include $(CLEAR_VARS)
 LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CPP_STD := c++17
 LOCAL_MODULE := recovery_host_test
 LOCAL_MODULE_HOST_OS := linux
 LOCAL_C_INCLUDES := bootable/recovery
@@ -222,3 +231,22 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_SHARED_LIBRARIES := \
     liblog
 include $(BUILD_HOST_NATIVE_TEST)
+
+# Benchmarks
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := -Wall -Werror
+LOCAL_CPP_STD := c++17
+LOCAL_MODULE := recovery_benchmark
+LOCAL_C_INCLUDES := bootable/recovery
+LOCAL_SRC_FILES := \
+    benchmark/rangeset_benchmark.cpp \
+    benchmark/sideload_benchmark.cpp
+
+LOCAL_STATIC_LIBRARIES := \
+    libfusesideload \
+    libotautil \
+    libcrypto \
+    libbase
+
+LOCAL_SHARED_LIBRARIES := liblog
+include $(BUILD_NATIVE_BENCHMARK)
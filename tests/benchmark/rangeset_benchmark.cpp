@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Micro-benchmarks of the RangeSet operations that run for every transfer list command (parsing,
+// overlap checks, block lookups), and of the set operations over large sorted sets.
+
+#include <stddef.h>
+
+#include <random>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include "otautil/rangeset.h"
+
+// Returns the ranges of |rs| in the reverse order, which is what the unsorted source ranges of a
+// move typically look like.
+static RangeSet Reversed(const RangeSet& rs) {
+  RangeSet reversed;
+  for (auto it = rs.crbegin(); it != rs.crend(); it++) {
+    reversed.PushBack(*it);
+  }
+  return reversed;
+}
+
+// Returns a RangeSet of |count| ranges spread over a partition, in ascending order.
+static RangeSet MakeRangeSet(size_t count, unsigned seed) {
+  std::mt19937 gen(seed);
+  RangeSet rs;
+  size_t block = 0;
+  for (size_t i = 0; i < count; i++) {
+    block += gen() % 64 + 1;
+    size_t length = gen() % 32 + 1;
+    rs.PushBack({ block, block + length });
+    block += length;
+  }
+  return rs;
+}
+
+static void BM_Parse(benchmark::State& state) {
+  std::string text = MakeRangeSet(state.range(0), 1).ToString();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(RangeSet::Parse(text));
+  }
+}
+BENCHMARK(BM_Parse)->Arg(1)->Arg(4)->Arg(64)->Arg(1024);
+
+// Checks a RangeSet against its own gaps, which is the worst case for Overlaps() as all the ranges
+// of both sets need to be looked at.
+static void BM_Overlaps(benchmark::State& state) {
+  bool sorted = state.range(1) != 0;
+  RangeSet rs = MakeRangeSet(state.range(0), 1);
+  SortedRangeSet span({ { 0, rs[rs.size() - 1].second + 1 } });
+  RangeSet gaps = span.Subtract(SortedRangeSet(rs));
+  if (!sorted) {
+    rs = Reversed(rs);
+    gaps = Reversed(gaps);
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(rs.Overlaps(gaps));
+  }
+}
+BENCHMARK(BM_Overlaps)
+    ->Args({ 1, 0 })
+    ->Args({ 4, 0 })
+    ->Args({ 16, 0 })
+    ->Args({ 64, 0 })
+    ->Args({ 1024, 0 })
+    ->Args({ 1, 1 })
+    ->Args({ 4, 1 })
+    ->Args({ 16, 1 })
+    ->Args({ 1024, 1 });
+
+static void BM_GetBlockNumber(benchmark::State& state) {
+  RangeSet rs = MakeRangeSet(state.range(0), 1);
+  for (auto _ : state) {
+    size_t sum = 0;
+    for (size_t i = 0; i < rs.blocks(); i++) {
+      sum += rs.GetBlockNumber(i);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * rs.blocks());
+}
+BENCHMARK(BM_GetBlockNumber)->Arg(4)->Arg(64)->Arg(1024);
+
+static void BM_SetOperations(benchmark::State& state) {
+  SortedRangeSet rs1(MakeRangeSet(state.range(0), 1));
+  SortedRangeSet rs2(MakeRangeSet(state.range(0), 2));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(rs1.Union(rs2));
+    benchmark::DoNotOptimize(rs1.Intersect(rs2));
+    benchmark::DoNotOptimize(rs1.Subtract(rs2));
+  }
+}
+BENCHMARK(BM_SetOperations)->Arg(4)->Arg(256)->Arg(4096);
+
+static void BM_CopyRangeSet(benchmark::State& state) {
+  RangeSet rs = MakeRangeSet(state.range(0), 1);
+  for (auto _ : state) {
+    RangeSet copy = rs;
+    benchmark::DoNotOptimize(copy);
+  }
+}
+BENCHMARK(BM_CopyRangeSet)->Arg(1)->Arg(RangeSet::kInlineRanges)->Arg(64);
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the read throughput and latency of the sideload FUSE filesystem, served from a local
+// file. An artificial per-request delay stands in for the round trip of a USB (adb) host, which
+// can optionally serve several requests in flight like the adb provider does. Needs to run as root,
+// with /dev/fuse available.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "fuse_sideload.h"
+
+static constexpr uint32_t kBlockSize = 65536;
+static constexpr size_t kPackageSize = 64 * 1024 * 1024;
+static constexpr size_t kReadSize = 65536;
+
+// The package to be served, and the FUSE filesystem in a child process.
+class SideloadMount {
+ public:
+  SideloadMount(int provider_delay_us, bool pipelined) {
+    std::string content(kPackageSize, '\0');
+    std::mt19937 gen(0);
+    for (size_t i = 0; i < content.size(); i += sizeof(uint32_t)) {
+      uint32_t value = gen();
+      memcpy(&content[i], &value, sizeof(value));
+    }
+    CHECK(android::base::WriteStringToFile(content, package_.path));
+
+    pid_ = fork();
+    if (pid_ == 0) {
+      android::base::unique_fd fd(open(package_.path, O_RDONLY));
+      provider_vtab vtab;
+      vtab.read_block = [&fd, provider_delay_us](uint32_t block, uint8_t* buffer,
+                                                 uint32_t fetch_size) {
+        if (provider_delay_us > 0) {
+          usleep(provider_delay_us);
+        }
+        off64_t offset = static_cast<off64_t>(block) * kBlockSize;
+        return android::base::ReadFullyAtOffset(fd, buffer, fetch_size, offset) ? 0 : -EIO;
+      };
+      // Each request completes |provider_delay_us| after it was sent, regardless of the requests
+      // in flight before it.
+      std::deque<std::pair<uint32_t, std::chrono::steady_clock::time_point>> requests;
+      if (pipelined) {
+        vtab.request_block = [&requests, provider_delay_us](uint32_t block) {
+          requests.emplace_back(block, std::chrono::steady_clock::now() +
+                                           std::chrono::microseconds(provider_delay_us));
+          return 0;
+        };
+        vtab.receive_block = [&fd, &requests](uint32_t block, uint8_t* buffer,
+                                              uint32_t fetch_size) {
+          if (requests.empty() || requests.front().first != block) return -EIO;
+          std::this_thread::sleep_until(requests.front().second);
+          requests.pop_front();
+          off64_t offset = static_cast<off64_t>(block) * kBlockSize;
+          return android::base::ReadFullyAtOffset(fd, buffer, fetch_size, offset) ? 0 : -EIO;
+        };
+      }
+      vtab.close = []() {};
+      _exit(run_fuse_sideload(vtab, kPackageSize, kBlockSize, mount_point_.path) == 0
+                ? EXIT_SUCCESS
+                : EXIT_FAILURE);
+    }
+
+    path_ = std::string(mount_point_.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+    for (int i = 0; i < 100; i++) {
+      struct stat sb;
+      if (stat(path_.c_str(), &sb) == 0) break;
+      usleep(100000);
+    }
+  }
+
+  ~SideloadMount() {
+    kill(pid_, SIGTERM);
+    waitpid(pid_, nullptr, 0);
+  }
+
+  const std::string& path() const {
+    return path_;
+  }
+
+ private:
+  TemporaryFile package_;
+  TemporaryDir mount_point_;
+  pid_t pid_;
+  std::string path_;
+};
+
+// Reads the package through FUSE with |threads| readers, each taking every |threads|-th chunk of
+// kReadSize (sequential) or random chunks. Reports the throughput, and the p99 read latency.
+// Arguments: the number of reader threads, the provider delay in microseconds, and whether the
+// provider takes several requests in flight.
+static void ReadPackage(benchmark::State& state, bool sequential) {
+  size_t threads = state.range(0);
+  int provider_delay_us = state.range(1);
+  bool pipelined = state.range(2) != 0;
+  std::vector<double> latencies;
+  size_t bytes = 0;
+
+  for (auto _ : state) {
+    // A fresh mount for each iteration, so that nothing comes from the page cache or the sideload
+    // cache.
+    state.PauseTiming();
+    std::unique_ptr<SideloadMount> mount =
+        std::make_unique<SideloadMount>(provider_delay_us, pipelined);
+    android::base::unique_fd fd(open(mount->path().c_str(), O_RDONLY));
+    if (fd == -1) {
+      state.SkipWithError("failed to open the sideload package");
+      return;
+    }
+    std::vector<std::vector<double>> thread_latencies(threads);
+    state.ResumeTiming();
+
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < threads; t++) {
+      readers.emplace_back([&fd, &thread_latencies, sequential, t, threads]() {
+        std::vector<uint8_t> buffer(kReadSize);
+        std::mt19937 gen(t);
+        size_t chunks = kPackageSize / kReadSize;
+        for (size_t i = t; i < chunks; i += threads) {
+          size_t chunk = sequential ? i : gen() % chunks;
+          auto start = std::chrono::steady_clock::now();
+          android::base::ReadFullyAtOffset(fd, buffer.data(), kReadSize, chunk * kReadSize);
+          std::chrono::duration<double, std::micro> elapsed =
+              std::chrono::steady_clock::now() - start;
+          thread_latencies[t].push_back(elapsed.count());
+        }
+      });
+    }
+    for (auto& reader : readers) {
+      reader.join();
+    }
+
+    state.PauseTiming();
+    for (const auto& l : thread_latencies) {
+      latencies.insert(latencies.end(), l.begin(), l.end());
+    }
+    bytes += kPackageSize;
+    fd.reset();
+    mount.reset();
+    state.ResumeTiming();
+  }
+
+  state.SetBytesProcessed(bytes);
+  if (!latencies.empty()) {
+    size_t p99 = latencies.size() * 99 / 100;
+    std::nth_element(latencies.begin(), latencies.begin() + p99, latencies.end());
+    state.counters["p99_us"] = latencies[p99];
+  }
+}
+
+static void BM_SideloadSequentialRead(benchmark::State& state) {
+  ReadPackage(state, true);
+}
+BENCHMARK(BM_SideloadSequentialRead)
+    ->Args({ 1, 0, 0 })
+    ->Args({ 4, 0, 0 })
+    ->Args({ 1, 500, 0 })
+    ->Args({ 1, 500, 1 })
+    ->Args({ 4, 500, 1 })
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_SideloadRandomRead(benchmark::State& state) {
+  ReadPackage(state, false);
+}
+BENCHMARK(BM_SideloadRandomRead)
+    ->Args({ 1, 0, 0 })
+    ->Args({ 4, 0, 0 })
+    ->Args({ 4, 500, 1 })
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
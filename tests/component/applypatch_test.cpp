@@ -18,11 +18,13 @@
 #include <gtest/gtest.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -32,15 +34,20 @@
 #include <android-base/test_utils.h>
 #include <bsdiff/bsdiff.h>
 #include <openssl/sha.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
 
 #include "applypatch/applypatch.h"
 #include "applypatch/applypatch_modes.h"
 #include "common/test_constants.h"
+#include "otafault/config.h"
 #include "otautil/cache_location.h"
 #include "otautil/print_sha1.h"
 
 using namespace std::string_literals;
 
+extern std::atomic<bool> have_eio_error;
+
 static void sha1sum(const std::string& fname, std::string* sha1, size_t* fsize = nullptr) {
   ASSERT_NE(nullptr, sha1);
 
@@ -316,6 +323,67 @@ TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetWithBsdiffPatch) {
   ASSERT_EQ(recovery_img_sha1, tgt_file_sha1);
 }
 
+// Ensures that the output over the patch memory budget gets written straight to the partition,
+// and gets regenerated if it fails to read back.
+TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetStreamed) {
+  std::string boot_img = from_testdata_base("boot.img");
+  size_t boot_img_size;
+  std::string boot_img_sha1;
+  sha1sum(boot_img, &boot_img_sha1, &boot_img_size);
+
+  std::string recovery_img = from_testdata_base("recovery.img");
+  size_t recovery_img_size;
+  std::string recovery_img_sha1;
+  sha1sum(recovery_img, &recovery_img_sha1, &recovery_img_size);
+
+  // Fail the first read of the target, i.e. the verification read after the first attempt.
+  TemporaryFile tgt_file;
+  TemporaryFile fault_zip;
+  FILE* fault_zip_ptr = fdopen(fault_zip.release(), "wb");
+  ZipWriter writer(fault_zip_ptr);
+  ASSERT_EQ(0, writer.StartEntry(OTAIO_BASE_DIR "/" OTAIO_READ, 0));
+  ASSERT_EQ(0, writer.WriteBytes(tgt_file.path, strlen(tgt_file.path)));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(fault_zip_ptr));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(fault_zip.path, &handle));
+  ota_io_init(handle, false);
+  have_eio_error = false;
+
+  // applypatch <src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch>
+  std::string src_file_arg =
+      "EMMC:" + boot_img + ":" + std::to_string(boot_img_size) + ":" + boot_img_sha1;
+  std::string tgt_file_arg = "EMMC:"s + tgt_file.path;
+  std::string recovery_img_size_arg = std::to_string(recovery_img_size);
+  std::string patch_arg =
+      boot_img_sha1 + ":" + from_testdata_base("recovery-from-boot-with-bonus.p");
+  std::vector<const char*> args = { "applypatch",
+                                    src_file_arg.c_str(),
+                                    tgt_file_arg.c_str(),
+                                    recovery_img_sha1.c_str(),
+                                    recovery_img_size_arg.c_str(),
+                                    patch_arg.c_str() };
+  SetPatchMemoryBudget(0);
+  int status = applypatch_modes(args.size(), args.data());
+  SetPatchMemoryBudget(kDefaultPatchMemoryBudget);
+  bool injected = have_eio_error;
+  ota_io_init(nullptr, false);
+  have_eio_error = false;
+  CloseArchive(handle);
+
+  ASSERT_EQ(0, status);
+  ASSERT_TRUE(injected);
+
+  // Double check the patched recovery image.
+  std::string tgt_file_sha1;
+  size_t tgt_file_size;
+  sha1sum(tgt_file.path, &tgt_file_sha1, &tgt_file_size);
+  ASSERT_EQ(recovery_img_size, tgt_file_size);
+  ASSERT_EQ(recovery_img_sha1, tgt_file_sha1);
+}
+
 TEST_F(ApplyPatchModesTest, PatchModeInvalidArgs) {
   // Invalid bonus file.
   ASSERT_NE(0, applypatch_modes(3, (const char* []){ "applypatch", "-b", "/doesntexist" }));
@@ -14,9 +14,11 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <stdio.h>
 
 #include <algorithm>
+#include <memory>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -26,6 +28,7 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
+#include <applypatch/applypatch.h>
 #include <applypatch/imgdiff.h>
 #include <applypatch/imgdiff_image.h>
 #include <applypatch/imgpatch.h>
@@ -33,6 +36,7 @@
 #include <ziparchive/zip_writer.h>
 
 #include "common/test_constants.h"
+#include "otautil/cache_location.h"
 
 using android::base::get_unaligned;
 
@@ -245,6 +249,60 @@ TEST(ImgdiffTest, zip_mode_smoke_compressed) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_corrupted_entry) {
+  // Construct src and tgt zip files.
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  ASSERT_EQ(0, src_writer.StartEntry("file1.txt", ZipWriter::kCompress));
+  const std::string src_content("abcdefg");
+  ASSERT_EQ(0, src_writer.WriteBytes(src_content.data(), src_content.size()));
+  ASSERT_EQ(0, src_writer.FinishEntry());
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  ASSERT_EQ(0, tgt_writer.StartEntry("file1.txt", ZipWriter::kCompress));
+  const std::string tgt_content("abcdefgxyz");
+  ASSERT_EQ(0, tgt_writer.WriteBytes(tgt_content.data(), tgt_content.size()));
+  ASSERT_EQ(0, tgt_writer.FinishEntry());
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  // Corrupts the CRC-32 of the entry, consistently in the local file header (unless it's deferred
+  // to a data descriptor) and in the central directory.
+  auto corrupt_crc = [](const std::string& path) {
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(path, &content));
+    ASSERT_EQ(0x04034b50U, get_unaligned<uint32_t>(content.data()));
+    if ((get_unaligned<uint16_t>(content.data() + 6) & 0x8) == 0) {
+      content[14] ^= 0xff;
+    }
+    size_t cd_offset = content.find("PK\x01\x02");
+    ASSERT_NE(std::string::npos, cd_offset);
+    content[cd_offset + 16] ^= 0xff;
+    ASSERT_TRUE(android::base::WriteStringToFile(content, path));
+  };
+
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  // The source entry no longer inflates to the expected data.
+  corrupt_crc(src_file.path);
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_NE(0, imgdiff(args.size(), args.data()));
+
+  // Neither does the target entry, which fails the reconstruction instead of becoming a normal
+  // chunk.
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  corrupt_crc(tgt_file.path);
+  ASSERT_NE(0, imgdiff(args.size(), args.data()));
+}
+
 TEST(ImgdiffTest, zip_mode_smoke_trailer_zeros) {
   // Construct src and tgt zip files.
   TemporaryFile src_file;
@@ -636,6 +694,106 @@ TEST(ImgpatchTest, image_mode_patch_corruption) {
                                 [](const unsigned char* /*data*/, size_t len) { return len; }));
 }
 
+TEST(ImgpatchTest, image_mode_patch_spill_expanded_source) {
+  // src: "abcdefgh" + gzipped "xyz" (echo -n "xyz" | gzip -f | hd).
+  const std::vector<char> src_data = { 'a',    'b',    'c',    'd',    'e',    'f',    'g',
+                                       'h',    '\x1f', '\x8b', '\x08', '\x00', '\xc4', '\x1e',
+                                       '\x53', '\x58', '\x00', '\x03', '\xab', '\xa8', '\xac',
+                                       '\x02', '\x00', '\x67', '\xba', '\x8e', '\xeb', '\x03',
+                                       '\x00', '\x00', '\x00' };
+  const std::string src(src_data.cbegin(), src_data.cend());
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+
+  // tgt: "abcdefgxyz" + gzipped "xxyyzz".
+  const std::vector<char> tgt_data = {
+    'a',    'b',    'c',    'd',    'e',    'f',    'g',    'x',    'y',    'z',    '\x1f', '\x8b',
+    '\x08', '\x00', '\x62', '\x1f', '\x53', '\x58', '\x00', '\x03', '\xab', '\xa8', '\xa8', '\xac',
+    '\xac', '\xaa', '\x02', '\x00', '\x96', '\x30', '\x06', '\xb7', '\x06', '\x00', '\x00', '\x00'
+  };
+  const std::string tgt(tgt_data.cbegin(), tgt_data.cend());
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  // With a zero memory budget, the inflated source of the deflate chunk goes into a spill file next
+  // to the cached source copy.
+  TemporaryDir cache_dir;
+  std::string old_cache_temp_source = CacheLocation::location().cache_temp_source();
+  CacheLocation::location().set_cache_temp_source(std::string(cache_dir.path) + "/saved.file");
+  SetPatchMemoryBudget(0);
+  verify_patched_image(src, patch, tgt);
+  SetPatchMemoryBudget(kDefaultPatchMemoryBudget);
+  CacheLocation::location().set_cache_temp_source(old_cache_temp_source);
+
+  // The spill file is unlinked as soon as it's created.
+  std::vector<std::string> leftovers;
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(cache_dir.path), closedir);
+  ASSERT_NE(nullptr, dir);
+  while (dirent* de = readdir(dir.get())) {
+    if (de->d_name[0] != '.') leftovers.push_back(de->d_name);
+  }
+  ASSERT_TRUE(leftovers.empty());
+}
+
+TEST(ImgpatchTest, zip_mode_patch_many_deflate_entries) {
+  // Construct src and tgt zip files with enough deflate entries to keep all the patch threads busy.
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  for (size_t i = 0; i < 32; i++) {
+    std::string name = android::base::StringPrintf("file%zu.txt", i);
+    std::string src_content(4096 * (i % 4 + 1), static_cast<char>('a' + i % 26));
+    ASSERT_EQ(0, src_writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+    ASSERT_EQ(0, src_writer.WriteBytes(src_content.data(), src_content.size()));
+    ASSERT_EQ(0, src_writer.FinishEntry());
+
+    std::string tgt_content = src_content + name;
+    ASSERT_EQ(0, tgt_writer.StartEntry(name.c_str(), ZipWriter::kCompress));
+    ASSERT_EQ(0, tgt_writer.WriteBytes(tgt_content.data(), tgt_content.size()));
+    ASSERT_EQ(0, tgt_writer.FinishEntry());
+  }
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  size_t num_deflate;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate);
+  ASSERT_EQ(32U, num_deflate);
+
+  // The chunk outputs must come out in order, whether the chunks get applied concurrently or, with
+  // a budget that no chunk fits into, one by one on the calling thread.
+  verify_patched_image(src, patch, tgt);
+  SetPatchMemoryBudget(4096);
+  verify_patched_image(src, patch, tgt);
+  SetPatchMemoryBudget(kDefaultPatchMemoryBudget);
+}
+
 static void construct_store_entry(const std::vector<std::tuple<std::string, size_t, char>>& info,
                                   ZipWriter* writer) {
   for (auto& t : info) {
@@ -685,7 +843,7 @@ static void GenerateAndCheckSplitTarget(const std::string& debug_dir, size_t cou
 }
 
 std::vector<ImageChunk> ConstructImageChunks(
-    const std::vector<uint8_t>& content, const std::vector<std::tuple<std::string, size_t>>& info) {
+    const FileContent& content, const std::vector<std::tuple<std::string, size_t>>& info) {
   std::vector<ImageChunk> chunks;
   size_t start = 0;
   for (const auto& t : info) {
@@ -702,28 +860,30 @@ TEST(ImgdiffTest, zip_mode_split_image_smoke) {
   content.reserve(4096 * 50);
   uint8_t n = 0;
   generate_n(back_inserter(content), 4096 * 50, [&n]() { return n++ / 4096; });
+  FileContent file_content;
+  file_content.Assign(content);
 
   ZipModeImage tgt_image(false, 4096 * 10);
-  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(content, { { "a", 100 },
-                                                                       { "b", 4096 * 2 },
-                                                                       { "c", 4096 * 3 },
-                                                                       { "d", 300 },
-                                                                       { "e-0", 4096 * 10 },
-                                                                       { "e-1", 4096 * 5 },
-                                                                       { "CD", 200 } });
+  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(file_content, { { "a", 100 },
+                                                                            { "b", 4096 * 2 },
+                                                                            { "c", 4096 * 3 },
+                                                                            { "d", 300 },
+                                                                            { "e-0", 4096 * 10 },
+                                                                            { "e-1", 4096 * 5 },
+                                                                            { "CD", 200 } });
   tgt_image.Initialize(std::move(tgt_chunks),
                        std::vector<uint8_t>(content.begin(), content.begin() + 82520));
 
   tgt_image.DumpChunks();
 
   ZipModeImage src_image(true, 4096 * 10);
-  std::vector<ImageChunk> src_chunks = ConstructImageChunks(content, { { "b", 4096 * 3 },
-                                                                       { "c-0", 4096 * 10 },
-                                                                       { "c-1", 4096 * 2 },
-                                                                       { "a", 4096 * 5 },
-                                                                       { "e-0", 4096 * 10 },
-                                                                       { "e-1", 10000 },
-                                                                       { "CD", 5000 } });
+  std::vector<ImageChunk> src_chunks = ConstructImageChunks(file_content, { { "b", 4096 * 3 },
+                                                                            { "c-0", 4096 * 10 },
+                                                                            { "c-1", 4096 * 2 },
+                                                                            { "a", 4096 * 5 },
+                                                                            { "e-0", 4096 * 10 },
+                                                                            { "e-1", 10000 },
+                                                                            { "CD", 5000 } });
   src_image.Initialize(std::move(src_chunks),
                        std::vector<uint8_t>(content.begin(), content.begin() + 137880));
 
@@ -1070,3 +1230,110 @@ TEST(ImgdiffTest, zip_mode_large_apk_skipped_small_target_chunk) {
   // src_piece 1: a-0 1 block, CD
   GenerateAndCheckSplitTarget(debug_dir.path, 2, tgt);
 }
+
+TEST(ImgdiffTest, zip_mode_jobs_deterministic) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  // Compute the patch on one thread and on four; the patches must be identical.
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_path.c_str(), tgt_path.c_str(), patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  TemporaryFile parallel_patch_file;
+  std::vector<const char*> parallel_args = {
+    "imgdiff", "-z", "-j", "4", src_path.c_str(), tgt_path.c_str(), parallel_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(parallel_args.size(), parallel_args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string parallel_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(parallel_patch_file.path, &parallel_patch));
+  ASSERT_EQ(patch, parallel_patch);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  verify_patched_image(src, parallel_patch, tgt);
+
+  // Same with split images.
+  TemporaryFile split_info_file;
+  std::string split_info_arg = android::base::StringPrintf("--split-info=%s", split_info_file.path);
+  std::vector<const char*> split_args = {
+    "imgdiff",        "-z",           "--block-limit=10", split_info_arg.c_str(),
+    src_path.c_str(), tgt_path.c_str(), patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(split_args.size(), split_args.data()));
+
+  TemporaryFile parallel_split_info_file;
+  std::string parallel_split_info_arg =
+      android::base::StringPrintf("--split-info=%s", parallel_split_info_file.path);
+  std::vector<const char*> parallel_split_args = {
+    "imgdiff",
+    "-z",
+    "-j",
+    "4",
+    "--block-limit=10",
+    parallel_split_info_arg.c_str(),
+    src_path.c_str(),
+    tgt_path.c_str(),
+    parallel_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(parallel_split_args.size(), parallel_split_args.data()));
+
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  ASSERT_TRUE(android::base::ReadFileToString(parallel_patch_file.path, &parallel_patch));
+  ASSERT_EQ(patch, parallel_patch);
+
+  std::string split_info;
+  ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_info));
+  std::string parallel_split_info;
+  ASSERT_TRUE(android::base::ReadFileToString(parallel_split_info_file.path, &parallel_split_info));
+  ASSERT_EQ(split_info, parallel_split_info);
+}
+
+TEST(ImgdiffTest, zip_mode_deflate_cache) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  TemporaryDir cache_dir;
+  std::string cache_path = std::string(cache_dir.path) + "/deflate.cache";
+  std::string cache_arg = "--deflate-cache=" + cache_path;
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", cache_arg.c_str(), src_path.c_str(), tgt_path.c_str(), patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  // Expect one entry per reconstructed target chunk.
+  std::string cache;
+  ASSERT_TRUE(android::base::ReadFileToString(cache_path, &cache));
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(cache), "\n");
+  ASSERT_FALSE(lines.empty());
+  for (const auto& line : lines) {
+    ASSERT_EQ(2U * SHA256_DIGEST_LENGTH + 2, line.size()) << line;
+  }
+
+  // The second run finds all the chunks in the cache, and generates the same patch.
+  TemporaryFile cached_patch_file;
+  std::vector<const char*> cached_args = {
+    "imgdiff",        "-z",           cache_arg.c_str(), src_path.c_str(),
+    tgt_path.c_str(), cached_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(cached_args.size(), cached_args.data()));
+
+  std::string cache_after;
+  ASSERT_TRUE(android::base::ReadFileToString(cache_path, &cache_after));
+  ASSERT_EQ(cache, cache_after);
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string cached_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(cached_patch_file.path, &cached_patch));
+  ASSERT_EQ(patch, cached_patch);
+}
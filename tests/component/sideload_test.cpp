@@ -16,6 +16,7 @@
 
 #include <unistd.h>
 
+#include <deque>
 #include <string>
 #include <vector>
 
@@ -41,28 +42,12 @@ TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   ASSERT_EQ(-1, run_fuse_sideload(vtab, ((1 << 18) + 1) * 4096, 4096));
 }
 
-TEST(SideloadTest, run_fuse_sideload) {
-  const std::vector<std::string> blocks = {
-    std::string(2048, 'a') + std::string(2048, 'b'),
-    std::string(2048, 'c') + std::string(2048, 'd'),
-    std::string(2048, 'e') + std::string(2048, 'f'),
-    std::string(2048, 'g') + std::string(2048, 'h'),
-  };
-  const std::string content = android::base::Join(blocks, "");
-  ASSERT_EQ(16384U, content.size());
-
-  provider_vtab vtab;
-  vtab.close = [](void) {};
-  vtab.read_block = [&blocks](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
-    if (block >= 4) return -1;
-    blocks[block].copy(reinterpret_cast<char*>(buffer), fetch_size);
-    return 0;
-  };
-
+static void RunFuseSideload(const provider_vtab& vtab, const std::string& content,
+                            uint32_t block_size) {
   TemporaryDir mount_point;
   pid_t pid = fork();
   if (pid == 0) {
-    ASSERT_EQ(0, run_fuse_sideload(vtab, 16384, 4096, mount_point.path));
+    ASSERT_EQ(0, run_fuse_sideload(vtab, content.size(), block_size, mount_point.path));
     _exit(EXIT_SUCCESS);
   }
 
@@ -96,3 +81,50 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload) {
+  const std::vector<std::string> blocks = {
+    std::string(2048, 'a') + std::string(2048, 'b'),
+    std::string(2048, 'c') + std::string(2048, 'd'),
+    std::string(2048, 'e') + std::string(2048, 'f'),
+    std::string(2048, 'g') + std::string(2048, 'h'),
+  };
+  const std::string content = android::base::Join(blocks, "");
+  ASSERT_EQ(16384U, content.size());
+
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&blocks](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (block >= 4) return -1;
+    blocks[block].copy(reinterpret_cast<char*>(buffer), fetch_size);
+    return 0;
+  };
+
+  RunFuseSideload(vtab, content, 4096);
+}
+
+TEST(SideloadTest, run_fuse_sideload_pipelined) {
+  // Enough blocks to go through the readahead window and evictions, with a partial last block.
+  std::string content;
+  for (size_t i = 0; i < 100 * 4096 + 1000; i++) {
+    content += static_cast<char>(i * 7 / 4096 + i);
+  }
+
+  // The requests are only served on receive_block(), in order, like the adb host does.
+  std::deque<uint32_t> requests;
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [](uint32_t, uint8_t*, uint32_t) { return -1; };
+  vtab.request_block = [&requests](uint32_t block) {
+    requests.push_back(block);
+    return 0;
+  };
+  vtab.receive_block = [&content, &requests](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (requests.empty() || requests.front() != block) return -1;
+    requests.pop_front();
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    return 0;
+  };
+
+  RunFuseSideload(vtab, content, 4096);
+}
@@ -22,11 +22,13 @@
 
 #include <algorithm>
 #include <memory>
+#include <numeric>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -37,6 +39,7 @@
 #include <gtest/gtest.h>
 #include <ziparchive/zip_archive.h>
 #include <ziparchive/zip_writer.h>
+#include <zlib.h>
 
 #include "common/test_constants.h"
 #include "edify/expr.h"
@@ -865,6 +868,93 @@ TEST_F(UpdaterTest, new_data_short_write) {
   CloseArchive(handle);
 }
 
+TEST_F(UpdaterTest, binary_transfer_list) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+
+  // The version 5 equivalent of:
+  //   new 2,0,2
+  //   zero 2,2,3
+  //   move <sha1(block1)> 2,3,4 1 2,0,1
+  auto append_varint = [](std::string* out, uint64_t value) {
+    while (value >= 0x80) {
+      out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+  };
+  // Ranges with increasing values only, whose zigzag deltas are twice the deltas.
+  auto append_ranges = [&append_varint](std::string* out, const std::vector<uint64_t>& values) {
+    append_varint(out, values.size());
+    uint64_t previous = 0;
+    for (uint64_t value : values) {
+      append_varint(out, (value - previous) * 2);
+      previous = value;
+    }
+  };
+
+  std::string transfer_list = "5\n";
+  append_varint(&transfer_list, 4);  // total blocks
+  append_varint(&transfer_list, 0);
+  append_varint(&transfer_list, 0);
+  append_varint(&transfer_list, 3);  // commands
+  transfer_list.push_back(5);        // new
+  append_ranges(&transfer_list, { 0, 2 });
+  transfer_list.push_back(7);  // zero
+  append_ranges(&transfer_list, { 2, 3 });
+  transfer_list.push_back(4);  // move
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(block1.data()), block1.size(), digest);
+  transfer_list.append(reinterpret_cast<const char*>(digest), SHA_DIGEST_LENGTH);
+  append_ranges(&transfer_list, { 3, 4 });
+  append_varint(&transfer_list, 1);
+  transfer_list.push_back(1);  // source ranges only
+  append_ranges(&transfer_list, { 0, 1 });
+  append_varint(&transfer_list, 0);  // no stashes
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", block1 + block2 },
+    { "patch_data", "" },
+    { "transfer_list", transfer_list },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  // The transfer list can be given as a blob, or by the name of an uncompressed entry.
+  std::vector<std::string> transfer_list_args = {
+    R"(package_extract_file("transfer_list"))",
+    R"("transfer_list")",
+  };
+  for (const auto& transfer_list_arg : transfer_list_args) {
+    TemporaryFile update_file;
+    // 'move' reads the target blocks first to check if the command has been executed already.
+    ASSERT_TRUE(android::base::WriteStringToFile(std::string(4096 * 4, '\0'), update_file.path));
+    std::string script = "block_image_update(\"" + std::string(update_file.path) + "\", " +
+                         transfer_list_arg + R"(, "new_data", "patch_data"))";
+    expect("t", script.c_str(), kNoCause, &updater_info);
+
+    std::string updated_content;
+    ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+    ASSERT_EQ(block1 + block2 + std::string(4096, '\0') + block1, updated_content);
+  }
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
 TEST_F(UpdaterTest, brotli_new_data) {
   auto generator = []() { return rand() % 128; };
   // Generate 100 blocks of random data.
@@ -932,6 +1022,107 @@ TEST_F(UpdaterTest, brotli_new_data) {
   CloseArchive(handle);
 }
 
+// Compresses |data| as a single frame of framed new data, in brotli or raw deflate.
+static std::string CompressFrame(const std::string& data, bool brotli) {
+  if (brotli) {
+    size_t encoded_size = BrotliEncoderMaxCompressedSize(data.size()) + 16;
+    std::string encoded_data(encoded_size, 0);
+    EXPECT_TRUE(BrotliEncoderCompress(
+        BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, data.size(),
+        reinterpret_cast<const uint8_t*>(data.data()), &encoded_size,
+        reinterpret_cast<uint8_t*>(&encoded_data[0])));
+    encoded_data.resize(encoded_size);
+    return encoded_data;
+  }
+
+  z_stream strm = {};
+  EXPECT_EQ(Z_OK, deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                               Z_DEFAULT_STRATEGY));
+  std::string encoded_data(deflateBound(&strm, data.size()), 0);
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  strm.avail_in = data.size();
+  strm.next_out = reinterpret_cast<Bytef*>(&encoded_data[0]);
+  strm.avail_out = encoded_data.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+  encoded_data.resize(strm.total_out);
+  deflateEnd(&strm);
+  return encoded_data;
+}
+
+TEST_F(UpdaterTest, framed_new_data) {
+  auto generator = []() { return rand() % 128; };
+  // Generate 100 blocks of random data.
+  std::string new_data;
+  new_data.reserve(4096 * 100);
+  generate_n(back_inserter(new_data), 4096 * 100, generator);
+
+  // Frame boundaries don't need to line up with the blocks or the 'new' commands.
+  std::vector<size_t> frame_sizes = { 5000, 4096 * 7, 1, 0, 100000 };
+  frame_sizes.push_back(new_data.size() -
+                        std::accumulate(frame_sizes.begin(), frame_sizes.end(), size_t{ 0 }));
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "100",
+    "0",
+    "0",
+    "new 2,0,1",
+    "new 2,1,2",
+    "new 4,2,50,50,97",
+    "new 2,97,98",
+    "new 2,98,99",
+    "new 2,99,100",
+  };
+
+  for (bool brotli : { true, false }) {
+    std::string frames;
+    std::vector<std::string> index = { "1", brotli ? "brotli" : "deflate",
+                                       std::to_string(frame_sizes.size()) };
+    size_t offset = 0;
+    for (size_t size : frame_sizes) {
+      std::string frame = CompressFrame(new_data.substr(offset, size), brotli);
+      offset += size;
+      index.push_back(std::to_string(frame.size()) + " " + std::to_string(size));
+      frames += frame;
+    }
+
+    std::unordered_map<std::string, std::string> entries = {
+      { "new.dat", frames },
+      { "new.dat.frames", android::base::Join(index, '\n') },
+      { "patch_data", "" },
+      { "transfer_list", android::base::Join(transfer_list, '\n') },
+    };
+
+    TemporaryFile zip_file;
+    BuildUpdatePackage(entries, zip_file.release());
+
+    MemMapping map;
+    ASSERT_TRUE(map.MapFile(zip_file.path));
+    ZipArchiveHandle handle;
+    ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+    UpdaterInfo updater_info;
+    updater_info.package_zip = handle;
+    TemporaryFile temp_pipe;
+    updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wb");
+    updater_info.package_zip_addr = map.addr;
+    updater_info.package_zip_len = map.length;
+
+    TemporaryFile update_file;
+    std::string script_new_data =
+        "block_image_update(\"" + std::string(update_file.path) +
+        R"(", package_extract_file("transfer_list"), "new.dat", "patch_data"))";
+    expect("t", script_new_data.c_str(), kNoCause, &updater_info);
+
+    std::string updated_content;
+    ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+    ASSERT_EQ(new_data, updated_content);
+
+    ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+    CloseArchive(handle);
+  }
+}
+
 TEST_F(UpdaterTest, last_command_update) {
   std::string last_command_file = CacheLocation::location().last_command_file();
 
@@ -1145,3 +1336,403 @@ TEST_F(UpdaterTest, last_command_verify) {
   ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
   CloseArchive(handle);
 }
+
+TEST_F(UpdaterTest, block_image_update_independent_commands) {
+  // Move 64 blocks with independent commands, followed by a chain of dependent moves that must be
+  // executed in order.
+  std::string src_content;
+  for (size_t i = 0; i < 64; i++) {
+    src_content += std::string(4096, static_cast<char>('a' + i % 26));
+  }
+  src_content += std::string(4096 * 8, 'z');
+
+  std::vector<std::string> transfer_list = { "4", "72", "0", "0" };
+  std::string tgt_content = src_content;
+  for (size_t i = 0; i < 32; i++) {
+    std::string block = src_content.substr(i * 4096, 4096);
+    transfer_list.push_back(android::base::StringPrintf(
+        "move %s 2,%zu,%zu 1 2,%zu,%zu", get_sha1(block).c_str(), 32 + i, 33 + i, i, i + 1));
+    tgt_content.replace((32 + i) * 4096, 4096, block);
+  }
+  // Each move reads the block written by the previous one.
+  std::string block0 = src_content.substr(0, 4096);
+  for (size_t i = 64; i < 72; i++) {
+    size_t src_block = (i == 64) ? 0 : i - 1;
+    transfer_list.push_back(android::base::StringPrintf("move %s 2,%zu,%zu 1 2,%zu,%zu",
+                                                        get_sha1(block0).c_str(), i, i + 1,
+                                                        src_block, src_block + 1));
+    tgt_content.replace(i * 4096, 4096, block0);
+  }
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(get_sha1(tgt_content), get_sha1(updated_content));
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_grouped_flushes) {
+  // Move 8 blocks, then overwrite the source of the first move (which needs a flush first) and
+  // restore it from a stash.
+  std::string src_content;
+  for (size_t i = 0; i < 8; i++) {
+    src_content += std::string(4096, static_cast<char>('a' + i));
+  }
+  src_content += std::string(4096 * 9, '\0');
+
+  std::string block0 = src_content.substr(0, 4096);
+  std::vector<std::string> transfer_list = { "4", "10", "1", "1" };
+  for (size_t i = 0; i < 8; i++) {
+    transfer_list.push_back(android::base::StringPrintf(
+        "move %s 2,%zu,%zu 1 2,%zu,%zu", get_sha1(src_content.substr(i * 4096, 4096)).c_str(),
+        8 + i, 9 + i, i, i + 1));
+  }
+  transfer_list.push_back("stash " + get_sha1(block0) + " 2,0,1");
+  transfer_list.push_back("zero 2,0,1");
+  transfer_list.push_back("move " + get_sha1(block0) + " 2,16,17 1 - " + get_sha1(block0) +
+                          ":2,0,1");
+  transfer_list.push_back("free " + get_sha1(block0));
+
+  std::string tgt_content = std::string(4096, '\0') + src_content.substr(4096, 4096 * 7) +
+                            src_content.substr(0, 4096 * 8) + block0;
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(get_sha1(tgt_content), get_sha1(updated_content));
+  std::string last_command_file = CacheLocation::location().last_command_file();
+  ASSERT_EQ(-1, access(last_command_file.c_str(), R_OK));
+
+  // Not every command should have been followed by a flush.
+  std::string pipe_content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_pipe.path, &pipe_content));
+  std::string key = "log fsyncs_skipped_" + android::base::Basename(update_file.path) + ": ";
+  size_t pos = pipe_content.find(key);
+  ASSERT_NE(std::string::npos, pos);
+  size_t skipped;
+  ASSERT_TRUE(android::base::ParseUint(
+      pipe_content.substr(pos + key.size(), pipe_content.find('\n', pos) - pos - key.size()),
+      &skipped));
+  ASSERT_LT(0U, skipped);
+
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_memory_stash) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block1_hash = get_sha1(block1);
+
+  // The stash is freed right after use, so it never needs to be written to /cache.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "1",
+    "1",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(block1 + block1, updated_content);
+
+  std::string pipe_content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_pipe.path, &pipe_content));
+  std::string partition = android::base::Basename(update_file.path);
+  ASSERT_NE(std::string::npos, pipe_content.find("log stash_hits_" + partition + ": 1\n"));
+  ASSERT_NE(std::string::npos, pipe_content.find("log stash_spills_" + partition + ": 0\n"));
+
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_split_move) {
+  // Move 6 blocks between ranges that are split differently, which pairs up the pieces of the
+  // source and the target.
+  std::string src_content;
+  for (size_t i = 0; i < 20; i++) {
+    src_content += std::string(4096, static_cast<char>('a' + i));
+  }
+  std::string moved = src_content.substr(0, 4096 * 3) + src_content.substr(4096 * 5, 4096 * 3);
+  std::string tgt_content = src_content;
+  tgt_content.replace(4096 * 10, 4096 * 2, moved.substr(0, 4096 * 2));
+  tgt_content.replace(4096 * 13, 4096 * 4, moved.substr(4096 * 2));
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "6",
+    "0",
+    "0",
+    "move " + get_sha1(moved) + " 4,10,12,13,17 6 4,0,3,5,8",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(tgt_content, updated_content);
+
+  // The target blocks are verified already on a second run.
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(tgt_content, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_resume_journal) {
+  std::string last_command_file = CacheLocation::location().last_command_file();
+  std::string journal_file = last_command_file + ".blocks";
+
+  std::string new_data;
+  for (size_t i = 0; i < 4; i++) {
+    new_data += std::string(4096, static_cast<char>('a' + i));
+  }
+
+  std::vector<std::string> transfer_list = {
+    "4", "6", "0", "0", "zero 2,0,2", "new 2,2,6",
+  };
+  std::string transfer_list_content = android::base::Join(transfer_list, '\n');
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", new_data },
+    { "patch_data", "" },
+    { "transfer_list", transfer_list_content },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  std::string src_content(4096 * 6, 'x');
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+
+  // Mimic an interrupted run that has completed the "zero", and written the first two blocks of
+  // the "new". The journal is keyed by the transfer list and the partition.
+  std::string journal_key = get_sha1(transfer_list_content) + " " + get_sha1(update_file.path);
+  ASSERT_TRUE(android::base::WriteStringToFile(journal_key + "\n0 2\n1 2\n", journal_file));
+
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  // The blocks in the journal aren't written again, while the new data is still consumed in order.
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(std::string(4096 * 4, 'x') + new_data.substr(4096 * 2), updated_content);
+  ASSERT_EQ(-1, access(journal_file.c_str(), R_OK));
+
+  // The skipped "zero" still counts towards the progress.
+  fflush(updater_info.cmd_pipe);
+  std::string pipe_content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_pipe.path, &pipe_content));
+  std::vector<std::string> progress_lines;
+  for (const auto& pipe_line : android::base::Split(pipe_content, "\n")) {
+    if (android::base::StartsWith(pipe_line, "set_progress ")) {
+      progress_lines.push_back(pipe_line);
+    }
+  }
+  ASSERT_FALSE(progress_lines.empty());
+  ASSERT_EQ("set_progress 1.0000", progress_lines.back());
+
+  // A journal of a different update is ignored.
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  ASSERT_TRUE(android::base::WriteStringToFile("0123 abcd\n0 2\n1 2\n", journal_file));
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(std::string(4096 * 2, '\0') + new_data, updated_content);
+  ASSERT_EQ(-1, access(journal_file.c_str(), R_OK));
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_verify_hashed_ranges) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block1_hash = get_sha1(block1);
+
+  // The ranges of the stash and the first move get hashed ahead of the commands, while the second
+  // move loads its source from the stash.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3",
+    "0",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + get_sha1(block2 + block3) + " 2,4,6 2 2,1,3",
+    "move " + block1_hash + " 2,6,7 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  std::string src_content = block1 + block2 + block3 + std::string(4096 * 5, 'x');
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  std::string script = "block_image_verify(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  // The verification fails on the source blocks with unexpected contents.
+  src_content = block1 + block2 + block2 + std::string(4096 * 5, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "updater/block_io.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+TEST(BlockIoTest, write_then_read) {
+  TemporaryFile temp_file;
+  std::string zeros(256 * kBlockSize, '\0');
+  ASSERT_TRUE(android::base::WriteStringToFile(zeros, temp_file.path));
+
+  // Write every other block, with some adjacent requests that should be merged.
+  std::vector<uint8_t> data(128 * kBlockSize);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i / kBlockSize + 1);
+  }
+  std::vector<BlockIoRequest> requests;
+  for (size_t i = 0; i < 128; i++) {
+    off64_t offset = static_cast<off64_t>(i * 2) * kBlockSize;
+    requests.push_back({ offset, data.data() + i * kBlockSize, kBlockSize });
+  }
+  requests.push_back({ 255 * kBlockSize, data.data(), kBlockSize / 2 });
+  requests.push_back({ 255 * kBlockSize + kBlockSize / 2, data.data(), kBlockSize / 2 });
+  ASSERT_TRUE(BlockIo::Get().Write(temp_file.fd, requests)) << BlockIo::Get().name();
+
+  std::string content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  ASSERT_EQ(zeros.size(), content.size());
+  for (size_t i = 0; i < 128; i++) {
+    ASSERT_EQ(std::string(kBlockSize, static_cast<char>(i + 1)),
+              content.substr(i * 2 * kBlockSize, kBlockSize));
+    if (i != 127) {
+      ASSERT_EQ(std::string(kBlockSize, '\0'), content.substr((i * 2 + 1) * kBlockSize, kBlockSize));
+    }
+  }
+  ASSERT_EQ(std::string(kBlockSize, '\1'), content.substr(255 * kBlockSize));
+
+  // Read the blocks back in reverse order.
+  android::base::unique_fd fd(open(temp_file.path, O_RDONLY));
+  ASSERT_NE(-1, fd);
+  std::vector<uint8_t> buffer(128 * kBlockSize);
+  requests.clear();
+  for (size_t i = 0; i < 128; i++) {
+    off64_t offset = static_cast<off64_t>(i * 2) * kBlockSize;
+    requests.push_back({ offset, buffer.data() + (127 - i) * kBlockSize, kBlockSize });
+  }
+  ASSERT_TRUE(BlockIo::Get().Read(fd, requests));
+  for (size_t i = 0; i < 128; i++) {
+    ASSERT_EQ(static_cast<uint8_t>(128 - i), buffer[i * kBlockSize]);
+  }
+}
+
+TEST(BlockIoTest, read_past_eof) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(kBlockSize, 'a'), temp_file.path));
+
+  std::vector<uint8_t> buffer(2 * kBlockSize);
+  ASSERT_FALSE(BlockIo::Get().Read(temp_file.fd, { { 0, buffer.data(), buffer.size() } }));
+  ASSERT_TRUE(BlockIo::Get().Read(temp_file.fd, { { 0, buffer.data(), kBlockSize } }));
+  ASSERT_EQ(std::string(kBlockSize, 'a'),
+            std::string(buffer.begin(), buffer.begin() + kBlockSize));
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "otautil/hash.h"
+#include "otautil/print_sha1.h"
+
+static std::vector<uint8_t> GenerateData(size_t size) {
+  std::vector<uint8_t> data(size);
+  uint32_t seed = 12345;
+  for (auto& byte : data) {
+    seed = seed * 1103515245 + 12345;
+    byte = static_cast<uint8_t>(seed >> 16);
+  }
+  return data;
+}
+
+TEST(HashTest, ComputeDigest) {
+  std::vector<uint8_t> data = GenerateData(10000);
+
+  uint8_t expected[SHA256_DIGEST_LENGTH];
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA1(data.data(), data.size(), expected);
+  ComputeDigest(HashAlgorithm::SHA1, data.data(), data.size(), digest);
+  ASSERT_EQ(print_sha1(expected, SHA_DIGEST_LENGTH), print_sha1(digest, SHA_DIGEST_LENGTH));
+
+  SHA256(data.data(), data.size(), expected);
+  ComputeDigest(HashAlgorithm::SHA256, data.data(), data.size(), digest);
+  ASSERT_EQ(print_sha1(expected, SHA256_DIGEST_LENGTH), print_sha1(digest, SHA256_DIGEST_LENGTH));
+}
+
+TEST(HashTest, ComputeBlockDigests) {
+  // Large enough to be hashed on multiple threads.
+  constexpr size_t kBlocks = 1024;
+  std::vector<uint8_t> data = GenerateData(kBlocks * 4096);
+
+  for (auto algorithm : { HashAlgorithm::SHA1, HashAlgorithm::SHA256 }) {
+    size_t length = DigestLength(algorithm);
+    std::vector<uint8_t> digests = ComputeBlockDigests(algorithm, data.data(), 4096, kBlocks);
+    ASSERT_EQ(kBlocks * length, digests.size());
+    for (size_t i = 0; i < kBlocks; i++) {
+      uint8_t expected[SHA256_DIGEST_LENGTH];
+      ComputeDigest(algorithm, data.data() + i * 4096, 4096, expected);
+      ASSERT_EQ(0, memcmp(expected, digests.data() + i * length, length)) << "block " << i;
+    }
+  }
+}
+
+TEST(HashTest, HashContext_Peek) {
+  std::vector<uint8_t> data = GenerateData(8192);
+
+  HashContext ctx(HashAlgorithm::SHA1);
+  ctx.Update(data.data(), 4096);
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  uint8_t expected[SHA_DIGEST_LENGTH];
+  ctx.Peek(digest);
+  SHA1(data.data(), 4096, expected);
+  ASSERT_EQ(print_sha1(expected), print_sha1(digest));
+
+  ctx.Update(data.data() + 4096, 4096);
+  ctx.Final(digest);
+  SHA1(data.data(), data.size(), expected);
+  ASSERT_EQ(print_sha1(expected), print_sha1(digest));
+}
+
+TEST(HashTest, ComputeStreamDigest) {
+  std::vector<uint8_t> data = GenerateData(100000);
+  size_t pos = 0;
+  auto reader = [&data, &pos](uint8_t* buffer, size_t capacity) -> ssize_t {
+    size_t size = std::min(capacity, data.size() - pos);
+    memcpy(buffer, data.data() + pos, size);
+    pos += size;
+    return size;
+  };
+
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  uint8_t expected[SHA256_DIGEST_LENGTH];
+  ASSERT_TRUE(ComputeStreamDigest(HashAlgorithm::SHA256, 4096, reader, digest));
+  SHA256(data.data(), data.size(), expected);
+  ASSERT_EQ(print_sha1(expected, SHA256_DIGEST_LENGTH), print_sha1(digest, SHA256_DIGEST_LENGTH));
+
+  // Reader failures are propagated, along with the errno set by the reader.
+  pos = 0;
+  auto failing_reader = [&reader, &pos](uint8_t* buffer, size_t capacity) -> ssize_t {
+    if (pos >= 8192) {
+      errno = EIO;
+      return -1;
+    }
+    return reader(buffer, capacity);
+  };
+  errno = 0;
+  ASSERT_FALSE(ComputeStreamDigest(HashAlgorithm::SHA256, 4096, failing_reader, digest));
+  ASSERT_EQ(EIO, errno);
+}
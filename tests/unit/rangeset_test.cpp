@@ -123,6 +123,26 @@ TEST(RangeSetTest, Overlaps) {
   ASSERT_FALSE(RangeSet::Parse("2,5,7").Overlaps(RangeSet::Parse("2,3,5")));
 }
 
+TEST(RangeSetTest, Overlaps_unsorted) {
+  // Unsorted sets large enough to be sorted before the comparison.
+  RangeSet r1;
+  RangeSet r2;
+  for (size_t i = 0; i < 20; i++) {
+    ASSERT_TRUE(r1.PushBack({ 200 - i * 10, 205 - i * 10 }));
+    ASSERT_TRUE(r2.PushBack({ 305 - i * 10, 310 - i * 10 }));
+  }
+  ASSERT_FALSE(r1.sorted());
+  ASSERT_FALSE(r1.Overlaps(r2));
+  ASSERT_FALSE(r2.Overlaps(r1));
+
+  ASSERT_TRUE(r2.PushBack({ 0, 11 }));
+  ASSERT_TRUE(r1.Overlaps(r2));
+  ASSERT_TRUE(r2.Overlaps(r1));
+
+  ASSERT_TRUE(RangeSet::Parse("4,10,20,1,3").Overlaps(RangeSet::Parse("2,2,5")));
+  ASSERT_FALSE(RangeSet::Parse("4,10,20,1,3").Overlaps(RangeSet::Parse("4,3,10,20,21")));
+}
+
 TEST(RangeSetTest, Split) {
   RangeSet rs1 = RangeSet::Parse("2,1,2");
   ASSERT_TRUE(rs1);
@@ -211,6 +231,13 @@ TEST(RangeSetTest, GetBlockNumber) {
 
   // Out of bound.
   ASSERT_EXIT(rs.GetBlockNumber(9), ::testing::KilledBySignal(SIGABRT), "");
+
+  RangeSet rs2 = RangeSet::Parse("10,20,22,1,2,7,10,30,31,3,5");
+  std::vector<size_t> expected = { 20, 21, 1, 7, 8, 9, 30, 3, 4 };
+  ASSERT_EQ(expected.size(), rs2.blocks());
+  for (size_t i = 0; i < expected.size(); i++) {
+    ASSERT_EQ(expected[i], rs2.GetBlockNumber(i));
+  }
 }
 
 TEST(RangeSetTest, equality) {
@@ -240,6 +267,26 @@ TEST(RangeSetTest, iterators) {
   ASSERT_EQ((std::vector<Range>{ Range{ 8, 10 }, Range{ 1, 5 } }), ranges);
 }
 
+TEST(RangeSetTest, copy_and_move) {
+  // Goes over the inline storage.
+  RangeSet rs;
+  for (size_t i = 0; i < RangeSet::kInlineRanges * 3; i++) {
+    ASSERT_TRUE(rs.PushBack({ i * 2, i * 2 + 1 }));
+  }
+  RangeSet copy = rs;
+  ASSERT_EQ(rs, copy);
+  RangeSet moved = std::move(copy);
+  ASSERT_EQ(rs, moved);
+  ASSERT_EQ(RangeSet::kInlineRanges * 3, moved.blocks());
+
+  RangeSet small = RangeSet::Parse("4,1,5,8,10");
+  moved = small;
+  ASSERT_EQ(small, moved);
+  moved = std::move(rs);
+  ASSERT_EQ(RangeSet::kInlineRanges * 3, moved.size());
+  ASSERT_EQ(static_cast<size_t>(22), moved.GetBlockNumber(11));
+}
+
 TEST(RangeSetTest, ToString) {
   ASSERT_EQ("", RangeSet::Parse("").ToString());
   ASSERT_EQ("2,1,6", RangeSet::Parse("2,1,6").ToString());
@@ -267,6 +314,42 @@ TEST(SortedRangeSetTest, Insert) {
   ASSERT_EQ(static_cast<size_t>(22), rs.blocks());
 }
 
+TEST(SortedRangeSetTest, ctor) {
+  SortedRangeSet rs({ { 20, 25 }, { 1, 5 }, { 3, 8 }, { 10, 12 } });
+  ASSERT_TRUE(rs.sorted());
+  ASSERT_EQ(SortedRangeSet({ { 1, 8 }, { 10, 12 }, { 20, 25 } }), rs);
+  ASSERT_EQ(static_cast<size_t>(14), rs.blocks());
+
+  ASSERT_EQ(rs, SortedRangeSet(RangeSet::Parse("8,20,25,10,12,1,5,3,8")));
+}
+
+TEST(SortedRangeSetTest, Union) {
+  SortedRangeSet r1({ { 1, 5 }, { 10, 15 }, { 30, 40 } });
+  SortedRangeSet r2({ { 5, 7 }, { 12, 20 }, { 25, 26 } });
+  ASSERT_EQ(SortedRangeSet({ { 1, 7 }, { 10, 20 }, { 25, 26 }, { 30, 40 } }), r1.Union(r2));
+  ASSERT_EQ(r1.Union(r2), r2.Union(r1));
+  ASSERT_EQ(r1, r1.Union(SortedRangeSet()));
+  ASSERT_EQ(r1, SortedRangeSet().Union(r1));
+}
+
+TEST(SortedRangeSetTest, Intersect) {
+  SortedRangeSet r1({ { 1, 5 }, { 10, 15 }, { 30, 40 } });
+  SortedRangeSet r2({ { 3, 12 }, { 14, 31 }, { 35, 36 } });
+  ASSERT_EQ(SortedRangeSet({ { 3, 5 }, { 10, 12 }, { 14, 15 }, { 30, 31 }, { 35, 36 } }),
+            r1.Intersect(r2));
+  ASSERT_EQ(r1.Intersect(r2), r2.Intersect(r1));
+  ASSERT_FALSE(r1.Intersect(SortedRangeSet({ { 5, 10 }, { 15, 30 } })));
+}
+
+TEST(SortedRangeSetTest, Subtract) {
+  SortedRangeSet r1({ { 1, 5 }, { 10, 15 }, { 30, 40 } });
+  SortedRangeSet r2({ { 3, 12 }, { 14, 31 }, { 35, 36 } });
+  ASSERT_EQ(SortedRangeSet({ { 1, 3 }, { 12, 14 }, { 31, 35 }, { 36, 40 } }), r1.Subtract(r2));
+  ASSERT_EQ(SortedRangeSet({ { 5, 10 }, { 15, 30 } }), r2.Subtract(r1));
+  ASSERT_FALSE(r1.Subtract(r1));
+  ASSERT_EQ(r1, r1.Subtract(SortedRangeSet()));
+}
+
 TEST(SortedRangeSetTest, file_range) {
   SortedRangeSet rs;
   rs.Insert(4096, 4096);
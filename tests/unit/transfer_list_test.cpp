@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "updater/transfer_list.h"
+
+static void AppendVarint(std::string* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static void AppendRanges(std::string* out, const std::vector<int64_t>& values) {
+  AppendVarint(out, values.size());
+  int64_t previous = 0;
+  for (int64_t value : values) {
+    int64_t delta = value - previous;
+    AppendVarint(out, (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    previous = value;
+  }
+}
+
+static void AppendHash(std::string* out, uint8_t byte) {
+  out->append(20, static_cast<char>(byte));
+}
+
+TEST(TransferListTest, ReadLine) {
+  std::string_view text = "4\n\nnew 2,0,1";
+  std::string_view line;
+  ASSERT_TRUE(ReadLine(&text, &line));
+  ASSERT_EQ("4", line);
+  ASSERT_TRUE(ReadLine(&text, &line));
+  ASSERT_EQ("", line);
+  ASSERT_TRUE(ReadLine(&text, &line));
+  ASSERT_EQ("new 2,0,1", line);
+  ASSERT_FALSE(ReadLine(&text, &line));
+
+  // A trailing newline doesn't produce an extra line.
+  text = "zero 2,0,1\n";
+  ASSERT_TRUE(ReadLine(&text, &line));
+  ASSERT_EQ("zero 2,0,1", line);
+  ASSERT_FALSE(ReadLine(&text, &line));
+}
+
+TEST(TransferListTest, SplitView) {
+  std::vector<std::string_view> pieces = { "stale" };
+  SplitView("move abc 2,0,1", ' ', &pieces);
+  ASSERT_EQ((std::vector<std::string_view>{ "move", "abc", "2,0,1" }), pieces);
+
+  SplitView("a::b:", ':', &pieces);
+  ASSERT_EQ((std::vector<std::string_view>{ "a", "", "b", "" }), pieces);
+
+  SplitView("", ' ', &pieces);
+  ASSERT_EQ((std::vector<std::string_view>{ "" }), pieces);
+}
+
+TEST(TransferListTest, ParseDecimal) {
+  size_t value;
+  ASSERT_TRUE(ParseDecimal("0", &value));
+  ASSERT_EQ(0u, value);
+  ASSERT_TRUE(ParseDecimal("4096", &value));
+  ASSERT_EQ(4096u, value);
+  ASSERT_TRUE(ParseDecimal("5", &value, 5));
+  ASSERT_FALSE(ParseDecimal("6", &value, 5));
+  ASSERT_FALSE(ParseDecimal("", &value));
+  ASSERT_FALSE(ParseDecimal("-1", &value));
+  ASSERT_FALSE(ParseDecimal("12a", &value));
+  ASSERT_FALSE(ParseDecimal("99999999999999999999999", &value));
+}
+
+TEST(TransferListTest, ExpandBinaryTransferList) {
+  std::string binary = "5\n";
+  AppendVarint(&binary, 300);  // total blocks
+  AppendVarint(&binary, 2);    // max stash entries
+  AppendVarint(&binary, 10);   // max stash blocks
+  AppendVarint(&binary, 6);    // commands
+
+  // zero 4,0,10,300,290 (ranges don't need to be sorted)
+  binary.push_back(7);
+  AppendRanges(&binary, { 0, 10, 300, 290 });
+  // stash 1111... 2,10,20
+  binary.push_back(6);
+  AppendHash(&binary, 0x11);
+  AppendRanges(&binary, { 10, 20 });
+  // move 2222... 2,20,30 10 2,10,20
+  binary.push_back(4);
+  AppendHash(&binary, 0x22);
+  AppendRanges(&binary, { 20, 30 });
+  AppendVarint(&binary, 10);
+  binary.push_back(1);
+  AppendRanges(&binary, { 10, 20 });
+  AppendVarint(&binary, 0);
+  // bsdiff 0 200 aaaa... bbbb... 2,30,40 10 - 1111...:2,0,10
+  binary.push_back(0);
+  AppendVarint(&binary, 0);
+  AppendVarint(&binary, 200);
+  AppendHash(&binary, 0xaa);
+  AppendHash(&binary, 0xbb);
+  AppendRanges(&binary, { 30, 40 });
+  AppendVarint(&binary, 10);
+  binary.push_back(0);
+  AppendVarint(&binary, 1);
+  AppendHash(&binary, 0x11);
+  AppendRanges(&binary, { 0, 10 });
+  // free 1111...
+  binary.push_back(2);
+  AppendHash(&binary, 0x11);
+  // imgdiff 200 100 cccc... dddd... 2,40,50 10 2,50,55 2,0,5 1111...:2,5,10
+  binary.push_back(3);
+  AppendVarint(&binary, 200);
+  AppendVarint(&binary, 100);
+  AppendHash(&binary, 0xcc);
+  AppendHash(&binary, 0xdd);
+  AppendRanges(&binary, { 40, 50 });
+  AppendVarint(&binary, 10);
+  binary.push_back(2);
+  AppendRanges(&binary, { 50, 55 });
+  AppendRanges(&binary, { 0, 5 });
+  AppendVarint(&binary, 1);
+  AppendHash(&binary, 0x11);
+  AppendRanges(&binary, { 5, 10 });
+
+  ASSERT_TRUE(IsBinaryTransferList(binary));
+  std::string text;
+  ASSERT_TRUE(ExpandBinaryTransferList(binary, &text));
+
+  std::string h11(40, '1');
+  std::string expected = "5\n300\n2\n10\n"
+                         "zero 4,0,10,300,290\n"
+                         "stash " + h11 + " 2,10,20\n"
+                         "move " + std::string(40, '2') + " 2,20,30 10 2,10,20\n"
+                         "bsdiff 0 200 " + std::string(40, 'a') + " " + std::string(40, 'b') +
+                         " 2,30,40 10 - " + h11 + ":2,0,10\n"
+                         "free " + h11 + "\n"
+                         "imgdiff 200 100 " + std::string(40, 'c') + " " + std::string(40, 'd') +
+                         " 2,40,50 10 2,50,55 2,0,5 " + h11 + ":2,5,10\n";
+  ASSERT_EQ(expected, text);
+
+  // Truncated input.
+  ASSERT_FALSE(ExpandBinaryTransferList(binary.substr(0, binary.size() - 1), &text));
+  // Trailing data.
+  ASSERT_FALSE(ExpandBinaryTransferList(binary + '\0', &text));
+}
+
+TEST(TransferListTest, ExpandBinaryTransferList_invalid) {
+  std::string header = "5\n";
+  AppendVarint(&header, 10);
+  AppendVarint(&header, 0);
+  AppendVarint(&header, 0);
+  AppendVarint(&header, 1);
+  std::string text;
+
+  // Unknown opcode.
+  ASSERT_FALSE(ExpandBinaryTransferList(header + '\x08', &text));
+
+  // Odd number of range values.
+  std::string odd = header + '\x07';
+  AppendRanges(&odd, { 0, 1, 2 });
+  ASSERT_FALSE(ExpandBinaryTransferList(odd, &text));
+
+  // Values going below zero.
+  std::string negative = header + '\x07';
+  AppendRanges(&negative, { 5, -1 });
+  ASSERT_FALSE(ExpandBinaryTransferList(negative, &text));
+
+  // Stashes without the source locations.
+  std::string move = header + '\x04';
+  AppendHash(&move, 0x11);
+  AppendRanges(&move, { 0, 1 });
+  AppendVarint(&move, 1);
+  move.push_back(1);
+  AppendRanges(&move, { 1, 2 });
+  AppendVarint(&move, 1);
+  AppendHash(&move, 0x22);
+  AppendRanges(&move, { 0, 1 });
+  ASSERT_FALSE(ExpandBinaryTransferList(move, &text));
+
+  // Text transfer lists aren't binary.
+  ASSERT_FALSE(IsBinaryTransferList("4\n10\n0\n0\n"));
+  ASSERT_FALSE(IsBinaryTransferList("5"));
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/zero_filler.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+TEST(ZeroFillerTest, zero_ranges) {
+  TemporaryFile temp_file;
+  std::string content(64 * kBlockSize, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  ZeroFiller zero_filler(temp_file.fd);
+  ASSERT_TRUE(zero_filler.Zero(kBlockSize, 2 * kBlockSize));
+  ASSERT_NE(ZeroFiller::Method::kUnknown, zero_filler.method());
+  // The method picked above gets reused.
+  ASSERT_TRUE(zero_filler.Zero(10 * kBlockSize, 20 * kBlockSize));
+  ASSERT_TRUE(zero_filler.Zero(0, 0));
+  ASSERT_EQ(22 * kBlockSize, zero_filler.bytes());
+
+  std::string expected = content;
+  expected.replace(kBlockSize, 2 * kBlockSize, 2 * kBlockSize, '\0');
+  expected.replace(10 * kBlockSize, 20 * kBlockSize, 20 * kBlockSize, '\0');
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  ASSERT_EQ(expected, content);
+}
+
+TEST(ZeroFillerTest, zero_past_end_of_file) {
+  TemporaryFile temp_file;
+  std::string content(4 * kBlockSize, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  // A regular file grows to cover the whole range.
+  ZeroFiller zero_filler(temp_file.fd);
+  ASSERT_TRUE(zero_filler.Zero(2 * kBlockSize, 1024 * kBlockSize));
+
+  std::string expected = content.substr(0, 2 * kBlockSize) + std::string(1024 * kBlockSize, '\0');
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &content));
+  ASSERT_EQ(expected, content);
+}
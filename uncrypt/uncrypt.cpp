@@ -90,11 +90,14 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -102,6 +105,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -118,8 +122,16 @@
 
 #include "otautil/error_code.h"
 
-static constexpr int WINDOW_SIZE = 5;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+// Number of extents to fetch with each FS_IOC_FIEMAP call.
+static constexpr uint32_t FIEMAP_EXTENT_BATCH = 256;
+// Size of each read/write when rewriting the file contents to the block device.
+static constexpr size_t COPY_BUFFER_SIZE = 1024 * 1024;
+// Extents we can't read back from the block device as is.
+static constexpr uint32_t FIEMAP_UNUSABLE_FLAGS =
+    FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+    FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL |
+    FIEMAP_EXTENT_UNWRITTEN;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -150,15 +162,23 @@ static int write_at_offset(unsigned char* buffer, size_t size, int wfd, off64_t
     return 0;
 }
 
-static void add_block_to_ranges(std::vector<int>& ranges, int new_block) {
-    if (!ranges.empty() && new_block == ranges.back()) {
-        // If the new block comes immediately after the current range,
-        // all we have to do is extend the current range.
-        ++ranges.back();
+// A run of file blocks that are also contiguous on the block device.
+struct BlockExtent {
+    int file_block;  // first block within the file
+    int block;       // first block on the block device
+    int count;
+};
+
+static void add_blocks_to_extents(std::vector<BlockExtent>& extents, int file_block, int block,
+                                  int count) {
+    if (!extents.empty() && extents.back().file_block + extents.back().count == file_block &&
+        extents.back().block + extents.back().count == block) {
+        // If the new blocks come immediately after the current extent,
+        // all we have to do is extend the current extent.
+        extents.back().count += count;
     } else {
-        // We need to start a new range.
-        ranges.push_back(new_block);
-        ranges.push_back(new_block + 1);
+        // We need to start a new extent.
+        extents.push_back({ file_block, block, count });
     }
 }
 
@@ -251,6 +271,107 @@ static int retry_fibmap(const int fd, const char* name, int* block, const int he
     return kUncryptIoctlError;
 }
 
+// Maps the first |blocks| blocks of the file with FS_IOC_FIEMAP, which returns whole extents
+// instead of a single block per ioctl. Returns false if the kernel or the filesystem doesn't
+// support it, or if any extent can't be read back from the block device (holes, inline data,
+// unwritten extents, etc); the caller then falls back to FIBMAP.
+static bool map_blocks_with_fiemap(const int fd, const char* name, const int blocks,
+                                   const off64_t blksize, std::vector<BlockExtent>* extents) {
+    CHECK(extents != nullptr);
+    std::vector<uint8_t> buffer(sizeof(struct fiemap) +
+                                FIEMAP_EXTENT_BATCH * sizeof(struct fiemap_extent));
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(buffer.data());
+
+    // FIEMAP_FLAG_SYNC flushes the file first, so that there are no delayed allocations left.
+    uint32_t flags = FIEMAP_FLAG_SYNC;
+    int next_block = 0;
+    while (next_block < blocks) {
+        std::fill(buffer.begin(), buffer.end(), 0);
+        fm->fm_start = static_cast<uint64_t>(next_block) * blksize;
+        fm->fm_length = static_cast<uint64_t>(blocks - next_block) * blksize;
+        fm->fm_flags = flags;
+        fm->fm_extent_count = FIEMAP_EXTENT_BATCH;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+            PLOG(WARNING) << "FIEMAP failed on \"" << name << "\"";
+            return false;
+        }
+        flags = 0;
+        if (fm->fm_mapped_extents == 0) {
+            LOG(WARNING) << "FIEMAP found no extent for block " << next_block;
+            return false;
+        }
+
+        for (uint32_t i = 0; i < fm->fm_mapped_extents && next_block < blocks; ++i) {
+            const struct fiemap_extent& fe = fm->fm_extents[i];
+            if ((fe.fe_flags & FIEMAP_UNUSABLE_FLAGS) != 0 || fe.fe_logical % blksize != 0 ||
+                fe.fe_physical % blksize != 0 || fe.fe_length % blksize != 0) {
+                LOG(WARNING) << "unusable extent at offset " << fe.fe_logical << " (flags 0x"
+                             << std::hex << fe.fe_flags << std::dec << ")";
+                return false;
+            }
+            uint64_t file_block = fe.fe_logical / blksize;
+            uint64_t length = fe.fe_length / blksize;
+            // The first returned extent may start before fm_start.
+            if (file_block > static_cast<uint64_t>(next_block)) {
+                LOG(WARNING) << "hole at block " << next_block;
+                return false;
+            }
+            if (file_block + length <= static_cast<uint64_t>(next_block)) {
+                continue;
+            }
+            uint64_t skip = next_block - file_block;
+            uint64_t count = std::min<uint64_t>(length - skip, blocks - next_block);
+            uint64_t block = fe.fe_physical / blksize + skip;
+            if (block == 0 || block + count > static_cast<uint64_t>(INT_MAX)) {
+                LOG(WARNING) << "invalid block " << block << " for block " << next_block;
+                return false;
+            }
+            add_blocks_to_extents(*extents, next_block, static_cast<int>(block),
+                                  static_cast<int>(count));
+            next_block += static_cast<int>(count);
+        }
+        if (next_block < blocks && (fm->fm_extents[fm->fm_mapped_extents - 1].fe_flags &
+                                    FIEMAP_EXTENT_LAST) != 0) {
+            LOG(WARNING) << "FIEMAP ended at block " << next_block << " of " << blocks;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rewrites the file contents to the given extents of the block device, in batches of up to
+// COPY_BUFFER_SIZE bytes. Each batch is read through the filesystem before the same blocks get
+// overwritten.
+static int copy_extents_to_block_device(const int fd, const char* path, const int wfd,
+                                        const std::vector<BlockExtent>& extents,
+                                        const off64_t file_size, const off64_t blksize,
+                                        const std::function<void(off64_t)>& update_progress) {
+    size_t blocks_per_batch = std::max<size_t>(COPY_BUFFER_SIZE / blksize, 1);
+    std::vector<unsigned char> buffer(blocks_per_batch * blksize);
+    for (const auto& extent : extents) {
+        for (int done = 0; done < extent.count;) {
+            int count = std::min<int>(extent.count - done, blocks_per_batch);
+            off64_t offset = static_cast<off64_t>(extent.file_block + done) * blksize;
+            size_t length = static_cast<size_t>(count) * blksize;
+            size_t to_read = static_cast<size_t>(
+                    std::min(static_cast<off64_t>(length), file_size - offset));
+            if (!android::base::ReadFullyAtOffset(fd, buffer.data(), to_read, offset)) {
+                PLOG(ERROR) << "failed to read " << path;
+                return kUncryptReadError;
+            }
+            // Pad the partial last block.
+            std::fill(buffer.begin() + to_read, buffer.begin() + length, 0);
+            if (write_at_offset(buffer.data(), length, wfd,
+                                static_cast<off64_t>(extent.block + done) * blksize) != 0) {
+                return kUncryptWriteError;
+            }
+            done += count;
+            update_progress(offset + to_read);
+        }
+    }
+    return kUncryptNoError;
+}
+
 static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
                              bool encrypted, bool f2fs_fs, int socket) {
     std::string err;
@@ -283,8 +404,6 @@ static int produce_block_map(const char* path, const char* map_file, const char*
     int blocks = ((sb.st_size-1) / sb.st_blksize) + 1;
     LOG(INFO) << "  file size: " << sb.st_size << " bytes, " << blocks << " blocks";
 
-    std::vector<int> ranges;
-
     std::string s = android::base::StringPrintf("%s\n%" PRId64 " %" PRId64 "\n",
                        blk_dev, static_cast<int64_t>(sb.st_size),
                        static_cast<int64_t>(sb.st_blksize));
@@ -293,13 +412,6 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         return kUncryptWriteError;
     }
 
-    std::vector<std::vector<unsigned char>> buffers;
-    if (encrypted) {
-        buffers.resize(WINDOW_SIZE, std::vector<unsigned char>(sb.st_blksize));
-    }
-    int head_block = 0;
-    int head = 0, tail = 0;
-
     android::base::unique_fd fd(open(path, O_RDWR));
     if (fd == -1) {
         PLOG(ERROR) << "failed to open " << path << " for reading";
@@ -341,18 +453,21 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         }
     }
 
-    off64_t pos = 0;
     int last_progress = 0;
-    while (pos < sb.st_size) {
+    auto update_progress = [&](off64_t pos) {
         // Update the status file, progress must be between [0, 99].
         int progress = static_cast<int>(100 * (double(pos) / double(sb.st_size)));
-        if (progress > last_progress) {
+        if (progress > last_progress && progress < 100) {
             last_progress = progress;
             write_status_to_socket(progress, socket);
         }
+    };
 
-        if ((tail+1) % WINDOW_SIZE == head) {
-            // write out head buffer
+    std::vector<BlockExtent> extents;
+    if (!map_blocks_with_fiemap(fd, path, blocks, sb.st_blksize, &extents)) {
+        LOG(INFO) << "falling back to FIBMAP";
+        extents.clear();
+        for (int head_block = 0; head_block < blocks; ++head_block) {
             int block = head_block;
             if (ioctl(fd, FIBMAP, &block) != 0) {
                 PLOG(ERROR) << "failed to find block " << head_block;
@@ -367,60 +482,31 @@ static int produce_block_map(const char* path, const char* map_file, const char*
                 }
             }
 
-            add_block_to_ranges(ranges, block);
-            if (encrypted) {
-                if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                    static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                    return kUncryptWriteError;
-                }
-            }
-            head = (head + 1) % WINDOW_SIZE;
-            ++head_block;
-        }
-
-        // read next block to tail
-        if (encrypted) {
-            size_t to_read = static_cast<size_t>(
-                    std::min(static_cast<off64_t>(sb.st_blksize), sb.st_size - pos));
-            if (!android::base::ReadFully(fd, buffers[tail].data(), to_read)) {
-                PLOG(ERROR) << "failed to read " << path;
-                return kUncryptReadError;
+            add_blocks_to_extents(extents, head_block, block, 1);
+            if (!encrypted) {
+                update_progress(static_cast<off64_t>(head_block) * sb.st_blksize);
             }
-            pos += to_read;
-        } else {
-            // If we're not encrypting; we don't need to actually read
-            // anything, just skip pos forward as if we'd read a
-            // block.
-            pos += sb.st_blksize;
         }
-        tail = (tail+1) % WINDOW_SIZE;
     }
+    LOG(INFO) << "  mapped " << blocks << " blocks in " << extents.size() << " extents";
 
-    while (head != tail) {
-        // write out head buffer
-        int block = head_block;
-        if (ioctl(fd, FIBMAP, &block) != 0) {
-            PLOG(ERROR) << "failed to find block " << head_block;
-            return kUncryptIoctlError;
-        }
-
-        if (block == 0) {
-            LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-            int error = retry_fibmap(fd, path, &block, head_block);
-            if (error != kUncryptNoError) {
-                return error;
-            }
+    if (encrypted) {
+        int error = copy_extents_to_block_device(fd, path, wfd, extents, sb.st_size,
+                                                 sb.st_blksize, update_progress);
+        if (error != kUncryptNoError) {
+            return error;
         }
+    }
 
-        add_block_to_ranges(ranges, block);
-        if (encrypted) {
-            if (write_at_offset(buffers[head].data(), sb.st_blksize, wfd,
-                                static_cast<off64_t>(sb.st_blksize) * block) != 0) {
-                return kUncryptWriteError;
-            }
+    // Extents that are adjacent on the block device collapse into a single range.
+    std::vector<int> ranges;
+    for (const auto& extent : extents) {
+        if (!ranges.empty() && ranges.back() == extent.block) {
+            ranges.back() += extent.count;
+        } else {
+            ranges.push_back(extent.block);
+            ranges.push_back(extent.block + extent.count);
         }
-        head = (head + 1) % WINDOW_SIZE;
-        ++head_block;
     }
 
     if (!android::base::WriteStringToFd(
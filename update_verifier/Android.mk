@@ -33,6 +33,8 @@ LOCAL_SHARED_LIBRARIES := \
 
 LOCAL_CFLAGS := -Wall -Werror
 
+LOCAL_CPP_STD := c++17
+
 LOCAL_EXPORT_C_INCLUDE_DIRS := \
     $(LOCAL_PATH)/include
 
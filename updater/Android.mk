@@ -59,7 +59,9 @@ LOCAL_MODULE := libupdater
 
 LOCAL_SRC_FILES := \
     install.cpp \
-    blockimg.cpp
+    block_io.cpp \
+    blockimg.cpp \
+    transfer_list.cpp
 
 LOCAL_C_INCLUDES := \
     $(LOCAL_PATH)/.. \
@@ -70,6 +72,8 @@ LOCAL_CFLAGS := \
     -Wall \
     -Werror
 
+LOCAL_CPP_STD := c++17
+
 LOCAL_EXPORT_C_INCLUDE_DIRS := \
     $(LOCAL_PATH)/include
 
@@ -95,6 +99,8 @@ LOCAL_CFLAGS := \
     -Wall \
     -Werror
 
+LOCAL_CPP_STD := c++17
+
 LOCAL_STATIC_LIBRARIES := \
     libupdater \
     $(TARGET_RECOVERY_UPDATER_LIBS) \
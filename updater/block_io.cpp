@@ -0,0 +1,614 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/block_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#include "otafault/config.h"
+#include "otafault/ota_io.h"
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Defined in libotafault; set on EIO so that the update can be retried.
+extern std::atomic<bool> have_eio_error;
+
+// The maximum number of iovecs in a single vectored I/O.
+static constexpr size_t kMaxIovecs = IOV_MAX;
+// Batches with fewer bytes are served on the calling thread.
+static constexpr size_t kMinParallelBytes = 1024 * 1024;
+// The maximum number of threads used by the preadv / pwritev backend.
+static constexpr size_t kMaxIoThreads = 4;
+// The size of the pipe used to splice data, i.e. the most bytes moved by a splice() call.
+static constexpr int kSplicePipeSize = 1024 * 1024;
+
+// A vectored I/O that covers one or more adjacent requests.
+struct IoOp {
+  off64_t offset;
+  std::vector<iovec> iov;
+  size_t length;
+};
+
+static std::vector<IoOp> MergeRequests(const std::vector<BlockIoRequest>& requests) {
+  std::vector<IoOp> ops;
+  for (const auto& request : requests) {
+    if (request.length == 0) {
+      continue;
+    }
+    if (!ops.empty()) {
+      IoOp& last = ops.back();
+      if (last.offset + static_cast<off64_t>(last.length) == request.offset &&
+          last.iov.size() < kMaxIovecs && last.length <= SSIZE_MAX - request.length) {
+        last.iov.push_back({ request.data, request.length });
+        last.length += request.length;
+        continue;
+      }
+    }
+    ops.push_back({ request.offset, { { request.data, request.length } }, request.length });
+  }
+  return ops;
+}
+
+// Skips the first |done| bytes of the given op, after a short read or write.
+static void AdvanceIoOp(IoOp* op, size_t done) {
+  op->offset += done;
+  op->length -= done;
+  auto it = op->iov.begin();
+  while (done > 0 && done >= it->iov_len) {
+    done -= it->iov_len;
+    it++;
+  }
+  op->iov.erase(op->iov.begin(), it);
+  if (done > 0) {
+    op->iov.front().iov_base = static_cast<uint8_t*>(op->iov.front().iov_base) + done;
+    op->iov.front().iov_len -= done;
+  }
+}
+
+// Finishes the given op with (possibly repeated) preadv / pwritev calls.
+static bool DoSyncIo(int fd, bool write, IoOp op) {
+  while (op.length > 0) {
+    ssize_t n = write ? TEMP_FAILURE_RETRY(ota_pwritev(fd, op.iov.data(), op.iov.size(), op.offset))
+                      : TEMP_FAILURE_RETRY(ota_preadv(fd, op.iov.data(), op.iov.size(), op.offset));
+    if (n == -1) {
+      PLOG(ERROR) << (write ? "pwritev" : "preadv") << " of " << op.length << " bytes at "
+                  << op.offset << " failed";
+      return false;
+    }
+    if (n == 0) {
+      LOG(ERROR) << (write ? "pwritev" : "preadv") << " of " << op.length << " bytes at "
+                 << op.offset << " reached unexpected EOF.";
+      return false;
+    }
+    AdvanceIoOp(&op, n);
+  }
+  return true;
+}
+
+// Serves the batch with preadv / pwritev. Large batches are split evenly (by bytes) into a few
+// groups that are handled concurrently.
+class BlockIoSync : public BlockIo {
+ public:
+  bool Read(int fd, const std::vector<BlockIoRequest>& requests) override {
+    return Submit(fd, false, MergeRequests(requests));
+  }
+
+  bool Write(int fd, const std::vector<BlockIoRequest>& requests) override {
+    return Submit(fd, true, MergeRequests(requests));
+  }
+
+  const char* name() const override {
+    return "preadv/pwritev";
+  }
+
+  bool Submit(int fd, bool write, const std::vector<IoOp>& ops) {
+    size_t total = 0;
+    for (const auto& op : ops) {
+      total += op.length;
+    }
+
+    size_t groups = std::min(kMaxIoThreads, ops.size());
+    if (groups <= 1 || total < kMinParallelBytes) {
+      for (const auto& op : ops) {
+        if (!DoSyncIo(fd, write, op)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    size_t bytes_per_group = (total + groups - 1) / groups;
+    std::vector<std::future<bool>> threads;
+    size_t begin = 0;
+    while (begin < ops.size()) {
+      size_t end = begin;
+      size_t bytes = 0;
+      while (end < ops.size() && (bytes < bytes_per_group || end == begin)) {
+        bytes += ops[end].length;
+        end++;
+      }
+      threads.emplace_back(std::async(std::launch::async, [fd, write, &ops, begin, end]() {
+        for (size_t i = begin; i < end; i++) {
+          if (!DoSyncIo(fd, write, ops[i])) {
+            return false;
+          }
+        }
+        return true;
+      }));
+      begin = end;
+    }
+
+    bool result = true;
+    for (auto& thread : threads) {
+      result = thread.get() && result;
+    }
+    return result;
+  }
+};
+
+#ifdef HAVE_IO_URING
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+// A single io_uring instance, which must be used by one thread at a time.
+class IoUringQueue {
+ public:
+  // The number of submission queue entries.
+  static constexpr unsigned kQueueDepth = 64;
+
+  ~IoUringQueue() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+      munmap(cq_ptr_, cq_ring_size_);
+    }
+    if (sq_ptr_ != MAP_FAILED) {
+      munmap(sq_ptr_, sq_ring_size_);
+    }
+  }
+
+  bool Init() {
+    io_uring_params params = {};
+    ring_fd_.reset(io_uring_setup(kQueueDepth, &params));
+    if (ring_fd_ == -1) {
+      PLOG(INFO) << "io_uring is not available";
+      return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      single_mmap = true;
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+#endif
+
+    sq_ptr_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to map the io_uring submission queue";
+      return false;
+    }
+    if (single_mmap) {
+      cq_ptr_ = sq_ptr_;
+    } else {
+      cq_ptr_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd_, IORING_OFF_CQ_RING);
+      if (cq_ptr_ == MAP_FAILED) {
+        PLOG(ERROR) << "Failed to map the io_uring completion queue";
+        return false;
+      }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                 IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to map the io_uring submission queue entries";
+      return false;
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+
+    uint8_t* cq = static_cast<uint8_t*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  // Performs all the ops, keeping up to kQueueDepth of them in flight. Short reads or writes are
+  // completed synchronously.
+  bool Submit(int fd, bool write, std::vector<IoOp>& ops) {
+    size_t next = 0;
+    size_t in_flight = 0;
+    unsigned to_submit = 0;
+    bool result = true;
+
+    while ((result && next < ops.size()) || in_flight > 0) {
+      unsigned tail = *sq_tail_;
+      while (result && next < ops.size() && in_flight < sq_entries_) {
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->off = ops[next].offset;
+        sqe->addr = reinterpret_cast<uint64_t>(ops[next].iov.data());
+        sqe->len = ops[next].iov.size();
+        sqe->user_data = next;
+        sq_array_[index] = index;
+        tail++;
+        next++;
+        in_flight++;
+        to_submit++;
+      }
+      __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+      int ret = TEMP_FAILURE_RETRY(io_uring_enter(ring_fd_, to_submit, 1, IORING_ENTER_GETEVENTS));
+      if (ret == -1) {
+        PLOG(ERROR) << "io_uring_enter failed with " << in_flight << " requests in flight";
+        // Tearing down the ring doesn't stop the requests taken by the kernel, which would still
+        // complete into |ops| and the caller's buffers. Wait for them before giving up the queue.
+        unsigned unsubmitted = tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        Drain(in_flight - unsubmitted);
+        broken_ = true;
+        return false;
+      }
+      to_submit -= std::min<unsigned>(to_submit, ret);
+
+      unsigned head = *cq_head_;
+      while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        IoOp& op = ops[cqe.user_data];
+        if (cqe.res < 0) {
+          errno = -cqe.res;
+          if (errno == EIO) {
+            have_eio_error = true;
+          }
+          PLOG(ERROR) << (write ? "write" : "read") << " of " << op.length << " bytes at "
+                      << op.offset << " failed";
+          result = false;
+        } else if (static_cast<size_t>(cqe.res) < op.length) {
+          if (cqe.res == 0 && !write) {
+            LOG(ERROR) << "read of " << op.length << " bytes at " << op.offset
+                       << " reached unexpected EOF.";
+            result = false;
+          } else {
+            AdvanceIoOp(&op, cqe.res);
+            result = DoSyncIo(fd, write, op) && result;
+          }
+        }
+        in_flight--;
+        head++;
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      }
+    }
+    return result;
+  }
+
+  // Whether the queue has failed and must not be used again.
+  bool broken() const {
+    return broken_;
+  }
+
+ private:
+  // Reaps |pending| completions, discarding their results.
+  void Drain(size_t pending) {
+    bool logged = false;
+    while (true) {
+      unsigned head = *cq_head_;
+      while (pending > 0 && head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        head++;
+        pending--;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      if (pending == 0) {
+        return;
+      }
+      if (TEMP_FAILURE_RETRY(io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS)) == -1 &&
+          !logged) {
+        PLOG(ERROR) << "io_uring_enter failed while waiting for " << pending << " requests";
+        logged = true;
+      }
+    }
+  }
+
+  android::base::unique_fd ring_fd_;
+  bool broken_ = false;
+  void* sq_ptr_ = MAP_FAILED;
+  void* cq_ptr_ = MAP_FAILED;
+  void* sqes_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_entries_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+};
+
+// Submits the batch through io_uring. Each caller takes an idle IoUringQueue (or creates a new
+// one), so that multiple threads can perform I/O concurrently.
+class BlockIoUring : public BlockIo {
+ public:
+  // Returns nullptr if io_uring isn't supported by the kernel.
+  static std::unique_ptr<BlockIoUring> Create() {
+    std::unique_ptr<IoUringQueue> queue = std::make_unique<IoUringQueue>();
+    if (!queue->Init()) {
+      return nullptr;
+    }
+    std::unique_ptr<BlockIoUring> block_io(new BlockIoUring());
+    block_io->idle_queues_.push_back(std::move(queue));
+    return block_io;
+  }
+
+  bool Read(int fd, const std::vector<BlockIoRequest>& requests) override {
+    // Fault injection only applies to the libotafault wrappers.
+    if (should_fault_inject(OTAIO_READ)) {
+      return fallback_.Read(fd, requests);
+    }
+    return Submit(fd, false, requests);
+  }
+
+  bool Write(int fd, const std::vector<BlockIoRequest>& requests) override {
+    if (should_fault_inject(OTAIO_WRITE)) {
+      return fallback_.Write(fd, requests);
+    }
+    return Submit(fd, true, requests);
+  }
+
+  const char* name() const override {
+    return "io_uring";
+  }
+
+ private:
+  BlockIoUring() = default;
+
+  bool Submit(int fd, bool write, const std::vector<BlockIoRequest>& requests) {
+    std::vector<IoOp> ops = MergeRequests(requests);
+    if (ops.empty()) {
+      return true;
+    }
+
+    std::unique_ptr<IoUringQueue> queue;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_queues_.empty()) {
+        queue = std::move(idle_queues_.back());
+        idle_queues_.pop_back();
+      }
+    }
+    if (queue == nullptr) {
+      queue = std::make_unique<IoUringQueue>();
+      if (!queue->Init()) {
+        return fallback_.Submit(fd, write, ops);
+      }
+    }
+
+    bool result = queue->Submit(fd, write, ops);
+    if (queue->broken()) {
+      // Redo the whole batch synchronously, as |ops| may have been partly advanced.
+      return fallback_.Submit(fd, write, MergeRequests(requests));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_queues_.push_back(std::move(queue));
+    return result;
+  }
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<IoUringQueue>> idle_queues_;
+  BlockIoSync fallback_;
+};
+
+#endif  // HAVE_IO_URING
+
+// The ways to copy data in the kernel, in the order they're tried.
+enum class CopyMethod {
+  kUnknown,
+  kCopyFileRange,
+  kSplice,
+  kUnsupported,
+};
+
+static std::atomic<CopyMethod> copy_method{ CopyMethod::kUnknown };
+
+// Errors that mean the method doesn't support the file, rather than an I/O error.
+static bool IsUnsupportedCopy(int error) {
+  return error == EINVAL || error == EXDEV || error == ENOSYS || error == EOPNOTSUPP ||
+         error == EBADF;
+}
+
+// Copies a request with copy_file_range(). Sets |*unsupported| if the file isn't supported.
+static bool CopyFileRange(int fd, BlockCopyRequest request, bool* unsupported) {
+#ifdef __NR_copy_file_range
+  while (request.length > 0) {
+    loff_t src = request.src;
+    loff_t dst = request.dst;
+    ssize_t n =
+        TEMP_FAILURE_RETRY(syscall(__NR_copy_file_range, fd, &src, fd, &dst, request.length, 0));
+    if (n == -1) {
+      *unsupported = IsUnsupportedCopy(errno);
+      PLOG(*unsupported ? INFO : ERROR) << "copy_file_range of " << request.length << " bytes from "
+                                        << request.src << " to " << request.dst << " failed";
+      return false;
+    }
+    if (n == 0) {
+      LOG(ERROR) << "copy_file_range from " << request.src << " reached unexpected EOF.";
+      return false;
+    }
+    request.src += n;
+    request.dst += n;
+    request.length -= n;
+  }
+  return true;
+#else
+  (void)fd;
+  (void)request;
+  *unsupported = true;
+  return false;
+#endif
+}
+
+// Copies a request by splicing it into a pipe and then out of it. Sets |*unsupported| if the file
+// isn't supported.
+static bool SpliceRange(int fd, BlockCopyRequest request, bool* unsupported) {
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+    PLOG(ERROR) << "Failed to create pipe";
+    return false;
+  }
+  android::base::unique_fd pipe_read(pipe_fds[0]);
+  android::base::unique_fd pipe_write(pipe_fds[1]);
+  // Use a larger pipe if allowed; the default one holds 64 KiB.
+  int pipe_size = fcntl(pipe_write, F_SETPIPE_SZ, kSplicePipeSize);
+  size_t chunk = pipe_size > 0 ? pipe_size : 64 * 1024;
+
+  while (request.length > 0) {
+    loff_t src = request.src;
+    ssize_t in = TEMP_FAILURE_RETRY(
+        splice(fd, &src, pipe_write, nullptr, std::min(chunk, request.length), SPLICE_F_MOVE));
+    if (in == -1) {
+      *unsupported = IsUnsupportedCopy(errno);
+      PLOG(*unsupported ? INFO : ERROR) << "splice from " << request.src << " failed";
+      return false;
+    }
+    if (in == 0) {
+      LOG(ERROR) << "splice from " << request.src << " reached unexpected EOF.";
+      return false;
+    }
+    for (ssize_t out_total = 0; out_total < in;) {
+      loff_t dst = request.dst + out_total;
+      ssize_t out = TEMP_FAILURE_RETRY(
+          splice(pipe_read, nullptr, fd, &dst, in - out_total, SPLICE_F_MOVE));
+      if (out <= 0) {
+        *unsupported = (out == -1 && IsUnsupportedCopy(errno));
+        PLOG(*unsupported ? INFO : ERROR) << "splice to " << request.dst + out_total << " failed";
+        return false;
+      }
+      out_total += out;
+    }
+    request.src += in;
+    request.dst += in;
+    request.length -= in;
+  }
+  return true;
+}
+
+bool BlockIo::Copy(int fd, const std::vector<BlockCopyRequest>& requests) {
+  // Fault injection only applies to the libotafault wrappers.
+  if (should_fault_inject(OTAIO_READ) || should_fault_inject(OTAIO_WRITE)) {
+    return false;
+  }
+
+  for (const auto& request : requests) {
+    if (request.length == 0) {
+      continue;
+    }
+    // Each method gets tried until one copies a request; the first working method is kept for the
+    // rest of the process.
+    CopyMethod method = copy_method;
+    while (true) {
+      bool unsupported = false;
+      if (method == CopyMethod::kUnknown || method == CopyMethod::kCopyFileRange) {
+        if (CopyFileRange(fd, request, &unsupported)) {
+          method = CopyMethod::kCopyFileRange;
+          break;
+        }
+      } else if (method == CopyMethod::kSplice) {
+        if (SpliceRange(fd, request, &unsupported)) {
+          break;
+        }
+      } else {
+        return false;
+      }
+      if (!unsupported) {
+        return false;
+      }
+      // Move on to the next method. Any partial copy gets redone from the start of the request.
+      method = (method == CopyMethod::kSplice) ? CopyMethod::kUnsupported : CopyMethod::kSplice;
+      if (method == CopyMethod::kUnsupported) {
+        LOG(INFO) << "Copying in the kernel isn't supported";
+        copy_method = method;
+        return false;
+      }
+    }
+    if (copy_method != method) {
+      LOG(INFO) << "Copying with "
+                << (method == CopyMethod::kSplice ? "splice" : "copy_file_range");
+      copy_method = method;
+    }
+  }
+  return true;
+}
+
+static BlockIo* CreateBlockIo() {
+  BlockIo* block_io = nullptr;
+#ifdef HAVE_IO_URING
+  block_io = BlockIoUring::Create().release();
+#endif
+  if (block_io == nullptr) {
+    block_io = new BlockIoSync();
+  }
+  LOG(INFO) << "Using " << block_io->name() << " for block I/O";
+  return block_io;
+}
+
+BlockIo& BlockIo::Get() {
+  static BlockIo* block_io = CreateBlockIo();
+  return *block_io;
+}
@@ -33,10 +33,19 @@
 #include <unistd.h>
 #include <fec/io.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -50,14 +59,19 @@
 #include <openssl/sha.h>
 #include <private/android_filesystem_config.h>
 #include <ziparchive/zip_archive.h>
+#include <zlib.h>
 
 #include "edify/expr.h"
 #include "otafault/ota_io.h"
 #include "otautil/cache_location.h"
 #include "otautil/error_code.h"
+#include "otautil/hash.h"
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
+#include "otautil/zero_filler.h"
+#include "updater/block_io.h"
 #include "updater/install.h"
+#include "updater/transfer_list.h"
 #include "updater/updater.h"
 
 // Set this to 0 to interpret 'erase' transfers to mean do a
@@ -69,10 +83,58 @@ static constexpr size_t BLOCKSIZE = 4096;
 static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
 
-static CauseCode failure_type = kNoCause;
+// The maximum number of worker threads that execute transfer commands concurrently.
+static constexpr size_t kMaxCommandThreads = 4;
+// The maximum number of threads that decode framed new data (see FramedNewData).
+static constexpr size_t kMaxNewDataDecoders = 4;
+// The initial and the maximum depth of the ring that buffers the decoded new data (see
+// NewDataRing).
+static constexpr size_t kNewDataRingMinDepth = 1024 * 1024;
+static constexpr size_t kNewDataRingCapacity = 16 * 1024 * 1024;
+// The block device gets flushed at least every kFlushIntervalBytes written bytes or
+// kFlushIntervalMs (see DurabilityScheduler).
+static constexpr size_t kFlushIntervalBytes = 64 * 1024 * 1024;
+static constexpr int kFlushIntervalMs = 5000;
+// The number of blocks read at a time by range_sha1().
+static constexpr size_t kRangeSha1BatchBlocks = 256;
+// The maximum number of threads that hash the ranges ahead of block_image_verify (see
+// VerifyHashCache).
+static constexpr size_t kMaxVerifyThreads = 4;
+
+static std::atomic<CauseCode> failure_type(kNoCause);
 static bool is_retry = false;
+// Guards stash_map, which may be accessed by multiple command threads.
+static std::mutex stash_map_mutex;
 static std::unordered_map<std::string, RangeSet> stash_map;
 
+// Saves the source RangeSet for the given stash id.
+static void SaveStashedRange(const std::string& id, const RangeSet& src) {
+  std::lock_guard<std::mutex> lock(stash_map_mutex);
+  stash_map[id] = src;
+}
+
+// Removes the source RangeSet for the given stash id.
+static void EraseStashedRange(const std::string& id) {
+  std::lock_guard<std::mutex> lock(stash_map_mutex);
+  stash_map.erase(id);
+}
+
+// Looks up the source RangeSet for the given stash id. Returns false if it's not found.
+static bool FindStashedRange(const std::string& id, RangeSet* src) {
+  std::lock_guard<std::mutex> lock(stash_map_mutex);
+  auto it = stash_map.find(id);
+  if (it == stash_map.end()) {
+    return false;
+  }
+  *src = it->second;
+  return true;
+}
+
+// The resume journal (see ResumeJournal) lives next to the last command file.
+static std::string GetResumeJournalFile() {
+  return CacheLocation::location().last_command_file() + ".blocks";
+}
+
 static void DeleteLastCommandFile() {
   std::string last_command_file = CacheLocation::location().last_command_file();
   if (unlink(last_command_file.c_str()) == -1 && errno != ENOENT) {
@@ -80,6 +142,13 @@ static void DeleteLastCommandFile() {
   }
 }
 
+static void DeleteResumeJournal() {
+  std::string journal_file = GetResumeJournalFile();
+  if (unlink(journal_file.c_str()) == -1 && errno != ENOENT) {
+    PLOG(ERROR) << "Failed to unlink: " << journal_file;
+  }
+}
+
 // Parse the last command index of the last update and save the result to |last_command_index|.
 // Return true if we successfully read the index.
 static bool ParseLastCommandFile(int* last_command_index) {
@@ -116,50 +185,150 @@ static bool ParseLastCommandFile(int* last_command_index) {
   return true;
 }
 
-// Update the last command index in the last_command_file if the current command writes to the
-// stash either explicitly or implicitly.
-static bool UpdateLastCommandIndex(int command_index, const std::string& command_string) {
-  std::string last_command_file = CacheLocation::location().last_command_file();
-  std::string last_command_tmp = last_command_file + ".tmp";
-  std::string content = std::to_string(command_index) + "\n" + command_string;
+// Replaces the given file with |content|, via a temporary file that gets synced and renamed.
+static bool WriteFileAtomically(const std::string& filename, const std::string& content) {
+  std::string tmp_file = filename + ".tmp";
   android::base::unique_fd wfd(
-      TEMP_FAILURE_RETRY(open(last_command_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660)));
+      TEMP_FAILURE_RETRY(open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660)));
   if (wfd == -1 || !android::base::WriteStringToFd(content, wfd)) {
-    PLOG(ERROR) << "Failed to update last command";
+    PLOG(ERROR) << "Failed to write " << tmp_file;
     return false;
   }
 
   if (fsync(wfd) == -1) {
-    PLOG(ERROR) << "Failed to fsync " << last_command_tmp;
+    PLOG(ERROR) << "Failed to fsync " << tmp_file;
     return false;
   }
 
-  if (chown(last_command_tmp.c_str(), AID_SYSTEM, AID_SYSTEM) == -1) {
-    PLOG(ERROR) << "Failed to change owner for " << last_command_tmp;
+  if (chown(tmp_file.c_str(), AID_SYSTEM, AID_SYSTEM) == -1) {
+    PLOG(ERROR) << "Failed to change owner for " << tmp_file;
     return false;
   }
 
-  if (rename(last_command_tmp.c_str(), last_command_file.c_str()) == -1) {
-    PLOG(ERROR) << "Failed to rename" << last_command_tmp;
+  if (rename(tmp_file.c_str(), filename.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename" << tmp_file;
     return false;
   }
 
-  std::string last_command_dir = android::base::Dirname(last_command_file);
-  android::base::unique_fd dfd(
-      TEMP_FAILURE_RETRY(ota_open(last_command_dir.c_str(), O_RDONLY | O_DIRECTORY)));
+  std::string dir = android::base::Dirname(filename);
+  android::base::unique_fd dfd(TEMP_FAILURE_RETRY(ota_open(dir.c_str(), O_RDONLY | O_DIRECTORY)));
   if (dfd == -1) {
-    PLOG(ERROR) << "Failed to open " << last_command_dir;
+    PLOG(ERROR) << "Failed to open " << dir;
     return false;
   }
 
   if (fsync(dfd) == -1) {
-    PLOG(ERROR) << "Failed to fsync " << last_command_dir;
+    PLOG(ERROR) << "Failed to fsync " << dir;
     return false;
   }
 
   return true;
 }
 
+// Update the last command index in the last_command_file if the current command writes to the
+// stash either explicitly or implicitly.
+static bool UpdateLastCommandIndex(int command_index, const std::string& command_string) {
+  std::string content = std::to_string(command_index) + "\n" + command_string;
+  if (!WriteFileAtomically(CacheLocation::location().last_command_file(), content)) {
+    LOG(ERROR) << "Failed to update last command";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * ResumeJournal records how far each command has written its target blocks, so that a resumed
+ * update doesn't need to write them again. The last command index only advances on commands that
+ * touch the stash, which leaves long "new" or "bsdiff" commands to be redone from scratch after an
+ * interruption. The commands write their targets in order, so the progress of a command is the
+ * number of leading target blocks written. The journal is saved to /cache at each flush of the
+ * block device (see DurabilityScheduler), hence it only covers blocks that have landed on disk.
+ *
+ * The saved journal starts with a key that identifies the transfer list and the partition; it's
+ * ignored unless resuming the same update. All the methods are thread-safe.
+ */
+class ResumeJournal {
+ public:
+  explicit ResumeJournal(std::string key)
+      : filename_(GetResumeJournalFile()), key_(std::move(key)), changed_(false) {}
+
+  // Loads the journal saved by an interrupted run of the same update, if any.
+  void Load() {
+    std::string content;
+    if (!android::base::ReadFileToString(filename_, &content)) {
+      return;
+    }
+    std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+    if (lines.empty() || lines[0] != key_) {
+      LOG(INFO) << "Ignoring the resume journal of a different update";
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 1; i < lines.size(); i++) {
+      std::vector<std::string> pieces = android::base::Split(lines[i], " ");
+      int cmdindex;
+      size_t blocks;
+      if (pieces.size() != 2 || !android::base::ParseInt(pieces[0], &cmdindex, 0) ||
+          !android::base::ParseUint(pieces[1], &blocks)) {
+        LOG(ERROR) << "Discarding the malformed resume journal at line " << i;
+        progress_.clear();
+        return;
+      }
+      progress_[cmdindex] = blocks;
+    }
+    resumed_ = progress_;
+    LOG(INFO) << "Loaded the progress of " << resumed_.size() << " commands";
+  }
+
+  // Returns the number of leading target blocks of the given command that have been written by an
+  // interrupted run.
+  size_t ResumedBlocks(int cmdindex) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = resumed_.find(cmdindex);
+    return it == resumed_.end() ? 0 : it->second;
+  }
+
+  // Records that the first |blocks| target blocks of the given command have been written.
+  void Progress(int cmdindex, size_t blocks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t& current = progress_[cmdindex];
+    if (blocks > current) {
+      current = blocks;
+      changed_ = true;
+    }
+  }
+
+  // Returns the journal content to be saved, or false if nothing has changed since the last save.
+  bool Serialize(std::string* content) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!changed_) {
+      return false;
+    }
+    *content = key_ + "\n";
+    for (const auto& [cmdindex, blocks] : progress_) {
+      *content += std::to_string(cmdindex) + " " + std::to_string(blocks) + "\n";
+    }
+    changed_ = false;
+    return true;
+  }
+
+  bool Save(const std::string& content) {
+    return WriteFileAtomically(filename_, content);
+  }
+
+ private:
+  const std::string filename_;
+  const std::string key_;
+
+  mutable std::mutex mutex_;
+  // The progress loaded from the interrupted run.
+  std::map<int, size_t> resumed_;
+  // The progress loaded, plus what has been written by this run.
+  std::map<int, size_t> progress_;
+  bool changed_;
+};
+
 static int read_all(int fd, uint8_t* data, size_t size) {
     size_t so_far = 0;
     while (so_far < size) {
@@ -201,28 +370,22 @@ static int write_all(int fd, const std::vector<uint8_t>& buffer, size_t size) {
     return write_all(fd, buffer.data(), size);
 }
 
-static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
-  // Don't discard blocks unless the update is a retry run.
-  if (!is_retry) {
-    return true;
-  }
-
-  uint64_t args[2] = { static_cast<uint64_t>(offset), size };
-  if (ioctl(fd, BLKDISCARD, &args) == -1 && errno != ENOTSUP) {
-    PLOG(ERROR) << "BLKDISCARD ioctl failed";
+// Reads all the |requests| with the block I/O engine. The file offset of |fd| isn't used, so that
+// multiple commands can share the block device fd.
+static bool ReadRequests(int fd, const std::vector<BlockIoRequest>& requests) {
+  if (!BlockIo::Get().Read(fd, requests)) {
+    failure_type = kFreadFailure;
     return false;
   }
   return true;
 }
 
-static bool check_lseek(int fd, off64_t offset, int whence) {
-    off64_t rc = TEMP_FAILURE_RETRY(lseek64(fd, offset, whence));
-    if (rc == -1) {
-        failure_type = kLseekFailure;
-        PLOG(ERROR) << "lseek64 failed";
-        return false;
-    }
-    return true;
+static bool WriteRequests(int fd, const std::vector<BlockIoRequest>& requests) {
+  if (!BlockIo::Get().Write(fd, requests)) {
+    failure_type = kFwriteFailure;
+    return false;
+  }
+  return true;
 }
 
 static void allocate(size_t size, std::vector<uint8_t>& buffer) {
@@ -243,10 +406,25 @@ class RangeSinkWriter {
         tgt_(tgt),
         next_range_(0),
         current_range_left_(0),
-        bytes_written_(0) {
+        current_offset_(0),
+        bytes_written_(0),
+        resume_bytes_(0) {
     CHECK_NE(tgt.size(), static_cast<size_t>(0));
   };
 
+  // Skips writing the first |blocks| target blocks, which an interrupted run has written already.
+  // The data for them still needs to be passed to Write().
+  void ResumeAfter(size_t blocks) {
+    resume_bytes_ = std::min(blocks, tgt_.blocks()) * BLOCKSIZE;
+  }
+
+  // Sets the callback that receives the number of leading target blocks that have been written
+  // (including the skipped ones), and the number of bytes just written. Returning false fails the
+  // write.
+  void SetProgressCallback(std::function<bool(size_t, size_t)> progress) {
+    progress_ = std::move(progress);
+  }
+
   bool Finished() const {
     return next_range_ == tgt_.size() && current_range_left_ == 0;
   }
@@ -262,7 +440,10 @@ class RangeSinkWriter {
       return 0;
     }
 
+    // Split the data along the target ranges, and write all the pieces in one batch.
+    std::vector<BlockIoRequest> requests;
     size_t written = 0;
+    size_t written_to_disk = 0;
     while (size > 0) {
       // Move to the next range as needed.
       if (!SeekToOutputRange()) {
@@ -274,18 +455,32 @@ class RangeSinkWriter {
         write_now = current_range_left_;
       }
 
-      if (write_all(fd_, data, write_now) == -1) {
-        break;
+      // Leave out the part that has been written by the interrupted run.
+      size_t position = bytes_written_ + written;
+      size_t skip = position < resume_bytes_ ? std::min(write_now, resume_bytes_ - position) : 0;
+      if (skip < write_now) {
+        requests.push_back(
+            { current_offset_ + static_cast<off64_t>(skip), const_cast<uint8_t*>(data) + skip,
+              write_now - skip });
+        written_to_disk += write_now - skip;
       }
 
       data += write_now;
       size -= write_now;
 
       current_range_left_ -= write_now;
+      current_offset_ += write_now;
       written += write_now;
     }
 
+    if (!requests.empty() && !WriteRequests(fd_, requests)) {
+      return 0;
+    }
+
     bytes_written_ += written;
+    if (progress_ && !progress_(bytes_written_ / BLOCKSIZE, written_to_disk)) {
+      return 0;
+    }
     return written;
   }
 
@@ -310,13 +505,7 @@ class RangeSinkWriter {
     off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
     current_range_left_ = (range.second - range.first) * BLOCKSIZE;
     next_range_++;
-
-    if (!discard_blocks(fd_, offset, current_range_left_)) {
-      return false;
-    }
-    if (!check_lseek(fd_, offset, SEEK_SET)) {
-      return false;
-    }
+    current_offset_ = offset;
     return true;
   }
 
@@ -328,8 +517,13 @@ class RangeSinkWriter {
   size_t next_range_;
   // The number of bytes to write before moving to the next range.
   size_t current_range_left_;
+  // The device offset to write the next byte to.
+  off64_t current_offset_;
   // Total bytes written by the writer.
   size_t bytes_written_;
+  // The number of leading bytes that don't need to be written again.
+  size_t resume_bytes_;
+  std::function<bool(size_t, size_t)> progress_;
 };
 
 /**
@@ -338,66 +532,222 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
+ * To achieve this, we expand the new data from the archive in a background thread into a bounded
+ * single-producer / single-consumer ring, and the 'new' commands drain the ring into their target
+ * ranges. The decoder keeps running while the update is busy with the other commands, and only
+ * waits once the ring is full.
  *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * Both sides only publish their own position on the fast path; a thread sleeps on the condition
+ * variable only when the ring is full (or empty). The usable depth of the ring starts small, and
+ * doubles up to the capacity whenever the decoder finds it full while nobody is draining it.
  */
+class NewDataRing {
+ public:
+  NewDataRing(size_t min_depth, size_t capacity)
+      : capacity_(capacity), depth_(min_depth), buffer_(new uint8_t[capacity]) {
+    CHECK_EQ(capacity & (capacity - 1), static_cast<size_t>(0));
+    CHECK_LE(min_depth, capacity);
+  }
+
+  // Producer. Returns a contiguous region to write into and sets |*size| to its length, waiting for
+  // space as needed. Returns nullptr once the consumer has aborted.
+  uint8_t* AcquireWrite(size_t* size) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      if (aborted_.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      size_t used = tail - head_.load(std::memory_order_acquire);
+      if (used < depth_) {
+        size_t offset = tail & (capacity_ - 1);
+        *size = std::min(depth_ - used, capacity_ - offset);
+        return buffer_.get() + offset;
+      }
+      // The update is busy with other commands; keep decoding into a deeper ring.
+      if (depth_ < capacity_ && !draining_.load(std::memory_order_acquire)) {
+        depth_ = std::min(depth_ * 2, capacity_);
+        continue;
+      }
+      Wait(
+          [this, tail] {
+            return aborted_.load(std::memory_order_acquire) ||
+                   tail - head_.load(std::memory_order_acquire) < depth_;
+          },
+          &producer_stall_ns_);
+    }
+  }
+
+  // Producer. Publishes |size| bytes written into the region from AcquireWrite().
+  void CommitWrite(size_t size) {
+    tail_.store(tail_.load(std::memory_order_relaxed) + size, std::memory_order_release);
+    Notify();
+  }
+
+  // Producer. Marks the end of the new data, be it complete or not.
+  void Finish() {
+    finished_.store(true, std::memory_order_release);
+    Notify();
+  }
+
+  // Consumer. Moves data from the ring to |writer| until it's finished. Returns false if the new
+  // data runs out or the write fails.
+  bool Drain(RangeSinkWriter* writer) {
+    draining_.store(true, std::memory_order_release);
+    size_t head = head_.load(std::memory_order_relaxed);
+    bool success = true;
+    while (!writer->Finished()) {
+      size_t tail = tail_.load(std::memory_order_acquire);
+      if (tail == head) {
+        if (finished_.load(std::memory_order_acquire) &&
+            tail_.load(std::memory_order_acquire) == head) {
+          LOG(ERROR) << "missing " << writer->AvailableSpace() << " bytes of new data";
+          success = false;
+          break;
+        }
+        Wait(
+            [this, head] {
+              return finished_.load(std::memory_order_acquire) ||
+                     tail_.load(std::memory_order_acquire) != head;
+            },
+            &consumer_stall_ns_);
+        continue;
+      }
+
+      size_t offset = head & (capacity_ - 1);
+      size_t write_now = std::min({ tail - head, capacity_ - offset, writer->AvailableSpace() });
+      if (writer->Write(buffer_.get() + offset, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+        success = false;
+        break;
+      }
+      head += write_now;
+      head_.store(head, std::memory_order_release);
+      Notify();
+    }
+    draining_.store(false, std::memory_order_release);
+    return success;
+  }
+
+  // Consumer. Stops the producer, which fails any further AcquireWrite().
+  void Abort() {
+    aborted_.store(true, std::memory_order_release);
+    Notify();
+  }
+
+  // Returns true if the producer has finished and all the data has been drained.
+  bool Exhausted() const {
+    return finished_.load(std::memory_order_acquire) &&
+           tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+  }
+
+  // The time the decoder spent waiting for space, and the 'new' commands waiting for data.
+  uint64_t producer_stall_ms() const {
+    return producer_stall_ns_.load() / 1000000;
+  }
+  uint64_t consumer_stall_ms() const {
+    return consumer_stall_ns_.load() / 1000000;
+  }
+
+ private:
+  // Spins briefly, then sleeps until |ready| holds, and adds the time spent to |*stall_ns|.
+  template <typename Predicate>
+  void Wait(Predicate ready, std::atomic<uint64_t>* stall_ns) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kSpinCount && !ready(); i++) {
+      std::this_thread::yield();
+    }
+    if (!ready()) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      sleepers_.fetch_add(1);
+      cv_.wait(lock, ready);
+      sleepers_.fetch_sub(1);
+    }
+    *stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  }
+
+  // Wakes up the other side, if it's asleep. The fence orders the position update before reading
+  // |sleepers_|, which pairs with the increment in Wait().
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load() > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+  }
+
+  static constexpr size_t kSpinCount = 64;
+
+  const size_t capacity_;
+  // Only accessed by the producer.
+  size_t depth_;
+  std::unique_ptr<uint8_t[]> buffer_;
+
+  // Total bytes consumed and produced. Only the owning side stores to each of them.
+  std::atomic<size_t> head_{ 0 };
+  std::atomic<size_t> tail_{ 0 };
+  std::atomic<bool> finished_{ false };
+  std::atomic<bool> aborted_{ false };
+  std::atomic<bool> draining_{ false };
+
+  std::atomic<uint64_t> producer_stall_ns_{ 0 };
+  std::atomic<uint64_t> consumer_stall_ns_{ 0 };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<int> sleepers_{ 0 };
+};
+
 struct NewThreadInfo {
   ZipArchiveHandle za;
   ZipEntry entry;
   bool brotli_compressed;
 
-  std::unique_ptr<RangeSinkWriter> writer;
+  std::unique_ptr<NewDataRing> ring;
   BrotliDecoderState* brotli_decoder_state;
-  bool receiver_available;
 
-  pthread_mutex_t mu;
-  pthread_cond_t cv;
+  pthread_t thread;
+  bool thread_started;
+
+  // Stops the decoder thread if it's running, which may still be filling the ring on an early exit.
+  void StopThread() {
+    if (!thread_started) {
+      return;
+    }
+    ring->Abort();
+    int ret = pthread_join(thread, nullptr);
+    if (ret != 0) {
+      LOG(WARNING) << "pthread join returned with " << strerror(ret);
+    }
+    thread_started = false;
+  }
+
+  ~NewThreadInfo() {
+    StopThread();
+    if (brotli_decoder_state != nullptr) {
+      BrotliDecoderDestroyInstance(brotli_decoder_state);
+    }
+  }
 };
 
 static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+    size_t available;
+    uint8_t* dest = nti->ring->AcquireWrite(&available);
+    // End the new data receiver if we encounter an error when performing block image update.
+    if (dest == nullptr) {
       return false;
     }
 
+    size_t write_now = std::min(size, available);
+    memcpy(dest, data, write_now);
+    nti->ring->CommitWrite(write_now);
+
     data += write_now;
     size -= write_now;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
   }
 
   return true;
@@ -407,32 +757,17 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
+    size_t available_out;
+    uint8_t* next_out = nti->ring->AcquireWrite(&available_out);
+    // End the receiver if we encounter an error when performing block image update.
+    if (next_out == nullptr) {
       return false;
     }
-    uint8_t buffer[buffer_size];
+    uint8_t* out = next_out;
     size_t available_in = size;
-    size_t available_out = buffer_size;
-    uint8_t* next_out = buffer;
 
-    // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
+    // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|; the
+    // output goes straight into the ring.
     BrotliDecoderResult result = BrotliDecoderDecompressStream(
         nti->brotli_decoder_state, &available_in, &data, &available_out, &next_out, nullptr);
 
@@ -442,26 +777,13 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
       return false;
     }
 
-    LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
+    LOG(DEBUG) << "bytes to write: " << next_out - out << ", bytes consumed "
                << size - available_in << ", decoder status " << result;
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
+    nti->ring->CommitWrite(next_out - out);
 
     // Update the remaining size. The input data ptr is already updated by brotli decoder function.
     size = available_in;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
   }
 
   return true;
@@ -474,80 +796,493 @@ static void* unzip_new_data(void* cookie) {
   } else {
     ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
   }
-  pthread_mutex_lock(&nti->mu);
-  nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
-  }
-  pthread_mutex_unlock(&nti->mu);
+  nti->ring->Finish();
   return nullptr;
 }
 
+/**
+ * The new data may also come as a sequence of independently compressed frames, which allows them to
+ * be decoded on several threads. The frames are concatenated into the new data entry, which must be
+ * stored uncompressed in the package so that it can be addressed in place. They are described by an
+ * index entry named "<new data>.frames", which looks like:
+ *
+ *   1                                  (format version)
+ *   brotli                             (codec: "brotli", or "deflate" for raw deflate streams)
+ *   3                                  (number of frames)
+ *   <compressed size> <decoded size>   (one line per frame, in stream order)
+ *   ...
+ *
+ * A pool of decoder threads expands the frames ahead of the 'new' commands into a bounded ring of
+ * buffers, and PerformCommandNew() copies the decoded data out of the ring in order.
+ */
+class FramedNewData {
+ public:
+  enum class Codec {
+    BROTLI,
+    DEFLATE,
+  };
+
+  // Parses the frame index for the new data at |data| (|size| bytes), and starts |num_threads|
+  // decoders. Returns nullptr if the index is invalid.
+  static std::unique_ptr<FramedNewData> Create(const uint8_t* data, size_t size,
+                                               const std::string& index, size_t num_threads) {
+    std::vector<std::string> lines = android::base::Split(android::base::Trim(index), "\n");
+    if (lines.size() < 3 || lines[0] != "1") {
+      LOG(ERROR) << "unexpected new data frame index version [" << lines[0] << "]";
+      return nullptr;
+    }
+
+    Codec codec;
+    if (lines[1] == "brotli") {
+      codec = Codec::BROTLI;
+    } else if (lines[1] == "deflate") {
+      codec = Codec::DEFLATE;
+    } else {
+      LOG(ERROR) << "unknown new data codec [" << lines[1] << "]";
+      return nullptr;
+    }
+
+    size_t count;
+    if (!android::base::ParseUint(lines[2], &count) || lines.size() != count + 3) {
+      LOG(ERROR) << "invalid new data frame count [" << lines[2] << "]";
+      return nullptr;
+    }
+
+    std::vector<Frame> frames;
+    size_t offset = 0;
+    for (size_t i = 3; i < lines.size(); i++) {
+      std::vector<std::string> pieces = android::base::Split(lines[i], " ");
+      Frame frame;
+      if (pieces.size() != 2 || !android::base::ParseUint(pieces[0], &frame.compressed_size) ||
+          !android::base::ParseUint(pieces[1], &frame.size, kMaxFrameSize) ||
+          frame.compressed_size > size - offset) {
+        LOG(ERROR) << "invalid new data frame [" << lines[i] << "]";
+        return nullptr;
+      }
+      frame.data = data + offset;
+      offset += frame.compressed_size;
+      frames.push_back(frame);
+    }
+    if (offset != size) {
+      LOG(ERROR) << "new data frames cover " << offset << " bytes; expected " << size;
+      return nullptr;
+    }
+
+    LOG(INFO) << "decoding " << count << " " << lines[1] << " frames of new data on "
+              << num_threads << " threads";
+    return std::unique_ptr<FramedNewData>(
+        new FramedNewData(codec, std::move(frames), std::max<size_t>(num_threads, 1)));
+  }
+
+  ~FramedNewData() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    decoder_cv_.notify_all();
+    for (auto& thread : decoders_) {
+      thread.join();
+    }
+  }
+
+  // Writes decoded new data to |writer| until it's finished. Returns false if a frame fails to be
+  // decoded, the write fails, or the new data runs out.
+  bool Write(RangeSinkWriter* writer) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!writer->Finished()) {
+      if (next_consume_ == frames_.size()) {
+        LOG(ERROR) << "missing " << writer->AvailableSpace() << " bytes of new data";
+        return false;
+      }
+
+      Slot& slot = slots_[next_consume_ % slots_.size()];
+      if (slot.frame != next_consume_ || slot.state == SlotState::DECODING) {
+        auto start = std::chrono::steady_clock::now();
+        consumer_cv_.wait(lock, [this, &slot] {
+          return slot.frame == next_consume_ && slot.state != SlotState::DECODING;
+        });
+        stall_time_ += std::chrono::steady_clock::now() - start;
+      }
+      if (slot.state == SlotState::FAILED) {
+        LOG(ERROR) << "failed to decode frame " << next_consume_ << " of new data";
+        return false;
+      }
+
+      // The slot can't be reused until the frame has been fully consumed, so it's safe to write it
+      // out without holding the lock.
+      lock.unlock();
+      const Frame& frame = frames_[next_consume_];
+      size_t write_now = std::min(frame.size - consume_offset_, writer->AvailableSpace());
+      if (writer->Write(slot.data.data() + consume_offset_, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+        return false;
+      }
+      lock.lock();
+
+      consume_offset_ += write_now;
+      if (consume_offset_ == frame.size) {
+        consume_offset_ = 0;
+        next_consume_++;
+        decoder_cv_.notify_all();
+      }
+    }
+    return true;
+  }
+
+  // Returns true if all the new data has been consumed.
+  bool Exhausted() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return next_consume_ == frames_.size();
+  }
+
+  // The total time the 'new' commands spent waiting for frames to be decoded.
+  std::chrono::milliseconds stall_time() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(stall_time_);
+  }
+
+ private:
+  // Upper bound of the decoded size of a frame, which caps the memory held by the ring.
+  static constexpr size_t kMaxFrameSize = 64 * 1024 * 1024;
+
+  struct Frame {
+    const uint8_t* data;
+    size_t compressed_size;
+    size_t size;
+  };
+
+  enum class SlotState {
+    DECODING,
+    READY,
+    FAILED,
+  };
+
+  // A ring buffer entry, which holds frame |frame| once it's READY or FAILED. Frame i always goes
+  // into slot (i % slots_.size()), after frame (i - slots_.size()) has been consumed.
+  struct Slot {
+    size_t frame = std::numeric_limits<size_t>::max();
+    SlotState state = SlotState::DECODING;
+    std::vector<uint8_t> data;
+  };
+
+  FramedNewData(Codec codec, std::vector<Frame> frames, size_t num_threads)
+      : codec_(codec), frames_(std::move(frames)), slots_(num_threads * 2) {
+    for (size_t i = 0; i < num_threads; i++) {
+      decoders_.emplace_back(&FramedNewData::DecoderLoop, this);
+    }
+  }
+
+  void DecoderLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      decoder_cv_.wait(lock, [this] {
+        return stopped_ || (next_decode_ < frames_.size() &&
+                            next_decode_ < next_consume_ + slots_.size());
+      });
+      if (stopped_) {
+        return;
+      }
+
+      size_t index = next_decode_++;
+      Slot& slot = slots_[index % slots_.size()];
+      slot.frame = index;
+      slot.state = SlotState::DECODING;
+      lock.unlock();
+
+      const Frame& frame = frames_[index];
+      slot.data.resize(frame.size);
+      bool success = Decode(frame, slot.data.data());
+
+      lock.lock();
+      slot.state = success ? SlotState::READY : SlotState::FAILED;
+      consumer_cv_.notify_all();
+    }
+  }
+
+  bool Decode(const Frame& frame, uint8_t* out) const {
+    if (codec_ == Codec::BROTLI) {
+      size_t decoded_size = frame.size;
+      if (BrotliDecoderDecompress(frame.compressed_size, frame.data, &decoded_size, out) !=
+          BROTLI_DECODER_RESULT_SUCCESS) {
+        LOG(ERROR) << "brotli decompression of new data frame failed";
+        return false;
+      }
+      if (decoded_size != frame.size) {
+        LOG(ERROR) << "new data frame decoded to " << decoded_size << " bytes; expected "
+                   << frame.size;
+        return false;
+      }
+      return true;
+    }
+
+    // zlib rejects a null output buffer, even for an empty frame.
+    uint8_t empty;
+    z_stream strm = {};
+    strm.next_in = const_cast<Bytef*>(frame.data);
+    strm.avail_in = frame.compressed_size;
+    strm.next_out = frame.size == 0 ? &empty : out;
+    strm.avail_out = frame.size;
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+      LOG(ERROR) << "failed to initialize inflate";
+      return false;
+    }
+    int ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END || strm.avail_out != 0 || strm.avail_in != 0) {
+      LOG(ERROR) << "inflating new data frame failed: " << ret << ", " << strm.avail_out
+                 << " bytes short";
+      return false;
+    }
+    return true;
+  }
+
+  const Codec codec_;
+  const std::vector<Frame> frames_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable decoder_cv_;
+  std::condition_variable consumer_cv_;
+  std::vector<Slot> slots_;
+  // The next frame to be claimed by a decoder.
+  size_t next_decode_ = 0;
+  // The next frame to be written out, and how much of it has been written already.
+  size_t next_consume_ = 0;
+  size_t consume_offset_ = 0;
+  std::chrono::steady_clock::duration stall_time_{};
+  bool stopped_ = false;
+
+  std::vector<std::thread> decoders_;
+};
+
 static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>& buffer, int fd) {
+  std::vector<BlockIoRequest> requests;
   size_t p = 0;
   for (const auto& range : src) {
-    if (!check_lseek(fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
-      return -1;
-    }
-
+    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
     size_t size = (range.second - range.first) * BLOCKSIZE;
-    if (read_all(fd, buffer.data() + p, size) == -1) {
-      return -1;
-    }
+    requests.push_back({ offset, buffer.data() + p, size });
 
     p += size;
   }
 
-  return 0;
+  return ReadRequests(fd, requests) ? 0 : -1;
 }
 
 static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
+  std::vector<BlockIoRequest> requests;
   size_t written = 0;
   for (const auto& range : tgt) {
     off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
     size_t size = (range.second - range.first) * BLOCKSIZE;
-    if (!discard_blocks(fd, offset, size)) {
-      return -1;
+    requests.push_back({ offset, const_cast<uint8_t*>(buffer.data()) + written, size });
+    written += size;
+  }
+
+  return WriteRequests(fd, requests) ? 0 : -1;
+}
+
+/**
+ * DurabilityScheduler decides when the block device needs to be flushed. Instead of an fsync after
+ * every transfer command, the written blocks are only flushed when resuming from a power loss
+ * depends on them:
+ *   - before a stash is freed, as the stash may hold the only copy of the data needed to redo the
+ *     commands that have written since the last flush;
+ *   - before the last command index is updated, as all the commands up to that index are skipped
+ *     when resuming;
+ *   - before overwriting the source blocks of a command whose writes haven't been flushed, so that
+ *     command can still be redone;
+ *   - after |flush_bytes| bytes have been written, or |flush_interval| has passed, to bound the
+ *     amount of work that needs to be redone. This also applies within a long command that reports
+ *     its progress, which then gets saved to the resume journal (if any) after the flush.
+ * All the methods are thread-safe.
+ */
+class DurabilityScheduler {
+ public:
+  DurabilityScheduler(int fd, size_t flush_bytes, std::chrono::milliseconds flush_interval,
+                      ResumeJournal* journal)
+      : fd_(fd),
+        flush_bytes_(flush_bytes),
+        flush_interval_(flush_interval),
+        journal_(journal),
+        dirty_(false),
+        unflushed_bytes_(0),
+        progress_bytes_(0),
+        last_flush_(std::chrono::steady_clock::now()),
+        flushes_(0),
+        skipped_flushes_(0) {}
+
+  // Called before a command writes to |tgt|. Flushes the pending writes if |tgt| overlaps any
+  // source blocks of the unflushed commands.
+  bool BeforeWrite(const RangeSet& tgt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (tgt.size() == 0) {
+      return true;
     }
+    dirty_ = true;
+    for (const auto& src : pending_sources_) {
+      if (src.Overlaps(tgt)) {
+        // Ordering writes doesn't need the journal to be saved.
+        return FlushLocked(false);
+      }
+    }
+    return true;
+  }
 
-    if (!check_lseek(fd, offset, SEEK_SET)) {
-      return -1;
+  // Called as the command at |cmdindex| writes its target in order, i.e. the leading |blocks|
+  // target blocks have been written, |bytes| of them just now.
+  bool Progress(int cmdindex, size_t blocks, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (journal_ == nullptr || cmdindex == -1) {
+      return true;
     }
+    dirty_ = true;
+    journal_->Progress(cmdindex, blocks);
+    progress_bytes_ += bytes;
+    if (progress_bytes_ >= flush_bytes_ ||
+        std::chrono::steady_clock::now() - last_flush_ >= flush_interval_) {
+      return FlushLocked(true);
+    }
+    return true;
+  }
 
-    if (write_all(fd, buffer.data() + written, size) == -1) {
-      return -1;
+  // Called after the command at |cmdindex| that wrote |tgt| from |sources| has completed. The
+  // sources need to stay intact until the written blocks are flushed.
+  bool CommandDone(int cmdindex, const RangeSet& tgt, const std::vector<RangeSet>& sources) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (tgt.size() == 0) {
+      return true;
+    }
+    dirty_ = true;
+    if (journal_ != nullptr && cmdindex != -1) {
+      journal_->Progress(cmdindex, tgt.blocks());
+    }
+    unflushed_bytes_ += tgt.blocks() * BLOCKSIZE;
+    for (const auto& src : sources) {
+      pending_sources_.push_back(src);
     }
 
-    written += size;
+    if (unflushed_bytes_ >= flush_bytes_ ||
+        std::chrono::steady_clock::now() - last_flush_ >= flush_interval_) {
+      return FlushLocked(true);
+    }
+    skipped_flushes_++;
+    return true;
   }
 
-  return 0;
-}
+  // Flushes all the writes so far, if any.
+  bool Barrier() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return FlushLocked(true);
+  }
+
+  size_t flushes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return flushes_;
+  }
+
+  size_t skipped_flushes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return skipped_flushes_;
+  }
+
+ private:
+  // Must be called with mutex_ held. The journal snapshot is taken before the flush, so that it
+  // only covers the writes that have landed.
+  bool FlushLocked(bool save_journal) {
+    if (!dirty_) {
+      return true;
+    }
+    std::string journal;
+    save_journal = save_journal && journal_ != nullptr && journal_->Serialize(&journal);
+    if (ota_fsync(fd_) == -1) {
+      failure_type = kFsyncFailure;
+      PLOG(ERROR) << "fsync failed";
+      return false;
+    }
+    flushes_++;
+    dirty_ = false;
+    unflushed_bytes_ = 0;
+    progress_bytes_ = 0;
+    pending_sources_.clear();
+    last_flush_ = std::chrono::steady_clock::now();
+    // The journal only saves work on resuming; the update carries on without it.
+    if (save_journal && !journal_->Save(journal)) {
+      LOG(WARNING) << "Failed to save the resume journal";
+    }
+    return true;
+  }
+
+  const int fd_;
+  const size_t flush_bytes_;
+  const std::chrono::milliseconds flush_interval_;
+  ResumeJournal* const journal_;
+
+  mutable std::mutex mutex_;
+  // Whether there are writes since the last flush.
+  bool dirty_;
+  size_t unflushed_bytes_;
+  // The bytes written by the in-flight commands since the last flush, as reported by Progress().
+  size_t progress_bytes_;
+  // The source blocks of the commands whose writes haven't been flushed.
+  std::vector<RangeSet> pending_sources_;
+  std::chrono::steady_clock::time_point last_flush_;
+
+  size_t flushes_;
+  size_t skipped_flushes_;
+};
+
+class FramedNewData;
+class StashStore;
+class VerifyHashCache;
 
 // Parameters for transfer list command functions
 struct CommandParameters {
-    std::vector<std::string> tokens;
+    std::vector<std::string_view> tokens;  // Views into the transfer list.
     size_t cpos;
     int cmdindex;
-    const char* cmdname;
-    const char* cmdline;
+    std::string_view cmdname;
+    std::string_view cmdline;
     std::string freestash;
     std::string stashbase;
     bool canwrite;
     int createdstash;
-    android::base::unique_fd fd;
+    int fd;  // Owned by PerformBlockImageUpdate(); shared by all the command threads.
     bool foundwrites;
     bool isunresumable;
     int version;
     size_t written;
     size_t stashed;
-    NewThreadInfo nti;
-    pthread_t thread;
+    NewThreadInfo* nti;
+    FramedNewData* framed_new_data;  // Replaces nti when the new data comes in frames.
+    DurabilityScheduler* durability;  // Only set when the update can write.
+    ResumeJournal* journal;           // Only set when the update can write.
+    StashStore* stashes;              // Only set when the update can write.
+    ZeroFiller* zero_filler;          // Only set when the update can write.
+    // The hashes computed ahead of the commands; only set when verifying with multiple threads.
+    const VerifyHashCache* verify_hashes;
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
+    size_t patch_threads;  // The number of threads that apply the chunks of an image patch.
     bool target_verified;  // The target blocks have expected contents already.
 };
 
+// Sets up |writer| to skip the target blocks of the current command that an interrupted run has
+// written, and to report the progress to the resume journal.
+static void TrackProgress(const CommandParameters& params, RangeSinkWriter* writer) {
+  if (params.journal == nullptr || params.cmdindex == -1) {
+    return;
+  }
+  size_t resumed = params.journal->ResumedBlocks(params.cmdindex);
+  if (resumed > 0) {
+    LOG(INFO) << " resuming after " << resumed << " blocks written by the interrupted run";
+    writer->ResumeAfter(resumed);
+  }
+  writer->SetProgressCallback(
+      [durability = params.durability, cmdindex = params.cmdindex](size_t blocks, size_t bytes) {
+        return durability->Progress(cmdindex, blocks, bytes);
+      });
+}
+
 // Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
 // handled separately).
 static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
@@ -603,14 +1338,19 @@ static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
   }
 
   LOG(INFO) << "printing hash in hex for " << src.blocks() << " source blocks";
+  std::vector<uint8_t> digests(src.blocks() * SHA_DIGEST_LENGTH);
+  std::vector<HashRequest> requests;
   for (size_t i = 0; i < src.blocks(); i++) {
-    size_t block_num = src.GetBlockNumber(i);
     size_t buffer_index = locs.GetBlockNumber(i);
     CHECK_LE((buffer_index + 1) * BLOCKSIZE, buffer.size());
+    requests.push_back(
+        { buffer.data() + buffer_index * BLOCKSIZE, BLOCKSIZE, &digests[i * SHA_DIGEST_LENGTH] });
+  }
+  ComputeDigests(HashAlgorithm::SHA1, requests);
 
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + buffer_index * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
+  for (size_t i = 0; i < src.blocks(); i++) {
+    size_t block_num = src.GetBlockNumber(i);
+    std::string hexdigest = print_sha1(&digests[i * SHA_DIGEST_LENGTH]);
     LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
   }
 }
@@ -623,12 +1363,11 @@ static void PrintHashForCorruptedStashedBlocks(const std::string& id,
   LOG(INFO) << "printing hash in hex for stash_id: " << id;
   CHECK_EQ(src.blocks() * BLOCKSIZE, buffer.size());
 
+  std::vector<uint8_t> digests =
+      ComputeBlockDigests(HashAlgorithm::SHA1, buffer.data(), BLOCKSIZE, src.blocks());
   for (size_t i = 0; i < src.blocks(); i++) {
     size_t block_num = src.GetBlockNumber(i);
-
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
+    std::string hexdigest = print_sha1(&digests[i * SHA_DIGEST_LENGTH]);
     LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
   }
 }
@@ -636,13 +1375,13 @@ static void PrintHashForCorruptedStashedBlocks(const std::string& id,
 // If the stash file doesn't exist, read the source blocks this stash contains and print the
 // SHA-1 for these blocks.
 static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
-  if (stash_map.find(id) == stash_map.end()) {
+  RangeSet src;
+  if (!FindStashedRange(id, &src)) {
     LOG(ERROR) << "No stash saved for id: " << id;
     return;
   }
 
   LOG(INFO) << "print hash in hex for source blocks in missing stash: " << id;
-  const RangeSet& src = stash_map[id];
   std::vector<uint8_t> buffer(src.blocks() * BLOCKSIZE);
   if (ReadBlocks(src, buffer, fd) == -1) {
       LOG(ERROR) << "failed to read source blocks for stash: " << id;
@@ -651,12 +1390,158 @@ static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
   PrintHashForCorruptedStashedBlocks(id, buffer, src);
 }
 
+// Computes the SHA-1 of the given blocks without loading them all at once. The ranges are read in
+// batches of up to kRangeSha1BatchBlocks blocks, which get hashed while the next batch is being
+// read. On a read failure, errno is left as the read set it.
+static bool HashBlocks(const RangeSet& rs, int fd, uint8_t* digest) {
+  int read_errno = 0;
+  size_t next_range = 0;
+  size_t next_block = rs.size() > 0 ? rs[0].first : 0;
+  auto reader = [&](uint8_t* buffer, size_t capacity) -> ssize_t {
+    std::vector<BlockIoRequest> requests;
+    size_t buffered = 0;
+    while (next_range < rs.size() && buffered < capacity) {
+      const Range& range = rs[next_range];
+      size_t count = std::min(range.second - next_block, (capacity - buffered) / BLOCKSIZE);
+      off64_t offset = static_cast<off64_t>(next_block) * BLOCKSIZE;
+      requests.push_back({ offset, buffer + buffered, count * BLOCKSIZE });
+      buffered += count * BLOCKSIZE;
+      next_block += count;
+      if (next_block == range.second && ++next_range < rs.size()) {
+        next_block = rs[next_range].first;
+      }
+    }
+    if (!ReadRequests(fd, requests)) {
+      read_errno = errno;
+      return -1;
+    }
+    return buffered;
+  };
+
+  if (!ComputeStreamDigest(HashAlgorithm::SHA1, kRangeSha1BatchBlocks * BLOCKSIZE, reader,
+                           digest)) {
+    errno = read_errno;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * VerifyHashCache hashes the block ranges that block_image_verify checks as a whole, ahead of the
+ * commands and on a pool of threads. These are the target ranges of move/bsdiff/imgdiff, their
+ * source ranges when no stash is involved, and the source ranges of stash. Verification doesn't
+ * write anything, so the ranges can be hashed in any order.
+ *
+ * The commands still run serially, and only use a cached hash when it matches the expected one. A
+ * mismatch goes through the usual path that reads the blocks, so the errors get reported the same
+ * way.
+ */
+class VerifyHashCache {
+ public:
+  // Collects the ranges from the commands in |transfer_list|, without the header.
+  void Plan(std::string_view transfer_list) {
+    std::string_view line;
+    std::vector<std::string_view> tokens;
+    while (ReadLine(&transfer_list, &line)) {
+      if (line.empty()) continue;
+      SplitView(line, ' ', &tokens);
+      if (tokens[0] == "stash") {
+        // stash <stash_id> <src_range>
+        if (tokens.size() == 3) {
+          Add(tokens[2]);
+        }
+      } else if (tokens[0] == "move" || tokens[0] == "bsdiff" || tokens[0] == "imgdiff") {
+        // move <onehash> <tgt_range> <src_blk_count> <src_range> [<src_loc> <stashed_blocks>]
+        // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_blk_count> <src_range>
+        //        [<src_loc> <stashed_blocks>]
+        size_t tgt_pos = (tokens[0] == "move") ? 2 : 5;
+        if (tgt_pos + 2 >= tokens.size()) {
+          continue;
+        }
+        Add(tokens[tgt_pos]);
+        if (tgt_pos + 3 == tokens.size() && tokens[tgt_pos + 2] != "-") {
+          Add(tokens[tgt_pos + 2]);
+        }
+      }
+    }
+  }
+
+  // Hashes all the collected ranges on up to |num_threads| threads. The largest ranges go first to
+  // balance the threads. A range that fails to be read is left out of the cache.
+  void Run(int fd, size_t num_threads) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Entry*> entries;
+    size_t blocks = 0;
+    for (auto& [key, entry] : entries_) {
+      entries.push_back(&entry);
+      blocks += entry.ranges.blocks();
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry* a, const Entry* b) {
+      return a->ranges.blocks() > b->ranges.blocks();
+    });
+
+    std::atomic<size_t> next(0);
+    auto worker = [&entries, &next, fd]() {
+      for (size_t i = next++; i < entries.size(); i = next++) {
+        uint8_t digest[SHA_DIGEST_LENGTH];
+        if (HashBlocks(entries[i]->ranges, fd, digest)) {
+          entries[i]->hexdigest = print_sha1(digest);
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(num_threads, entries.size()); i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    LOG(INFO) << "hashed " << entries.size() << " ranges (" << blocks << " blocks) on "
+              << threads.size() + 1 << " threads in " << duration.count()
+              << " ms";
+  }
+
+  // Returns whether |rs| has been hashed, and sets |hexdigest| to the hash.
+  bool Lookup(const RangeSet& rs, std::string* hexdigest) const {
+    auto it = entries_.find(rs.ToString());
+    if (it == entries_.end() || it->second.hexdigest.empty()) {
+      return false;
+    }
+    *hexdigest = it->second.hexdigest;
+    return true;
+  }
+
+ private:
+  struct Entry {
+    RangeSet ranges;
+    std::string hexdigest;
+  };
+
+  void Add(std::string_view range_text) {
+    RangeSet rs = RangeSet::Parse(range_text);
+    if (!rs) {
+      return;
+    }
+    std::string key = rs.ToString();
+    if (entries_.find(key) == entries_.end()) {
+      entries_.emplace(std::move(key), Entry{ std::move(rs), "" });
+    }
+  }
+
+  // Keyed by RangeSet::ToString().
+  std::unordered_map<std::string, Entry> entries_;
+};
+
 static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
         const size_t blocks, bool printerror) {
     uint8_t digest[SHA_DIGEST_LENGTH];
     const uint8_t* data = buffer.data();
 
-    SHA1(data, blocks * BLOCKSIZE, digest);
+    ComputeDigest(HashAlgorithm::SHA1, data, blocks * BLOCKSIZE, digest);
 
     std::string hexdigest = print_sha1(digest);
 
@@ -733,13 +1618,238 @@ static void DeleteStash(const std::string& base) {
   }
 }
 
+static int WriteStash(const std::string& base, const std::string& id, int blocks,
+                      std::vector<uint8_t>& buffer, bool checkspace, bool* exists);
+
+// Returns the amount of memory that can be used for keeping stashes in memory, i.e. a quarter of
+// MemAvailable in /proc/meminfo. Returns 0 (all the stashes go to /cache) on errors.
+static size_t GetStashMemoryBudget() {
+  std::string meminfo;
+  if (!android::base::ReadFileToString("/proc/meminfo", &meminfo)) {
+    PLOG(WARNING) << "Failed to read /proc/meminfo";
+    return 0;
+  }
+  for (const auto& line : android::base::Split(meminfo, "\n")) {
+    // MemAvailable:    1234567 kB
+    if (!android::base::StartsWith(line, "MemAvailable:")) {
+      continue;
+    }
+    std::vector<std::string> fields = android::base::Split(line.substr(13), " ");
+    fields.erase(std::remove(fields.begin(), fields.end(), ""), fields.end());
+    size_t available_kb;
+    if (fields.empty() || !android::base::ParseUint(fields[0], &available_kb)) {
+      break;
+    }
+    return available_kb / 4 * 1024;
+  }
+  LOG(WARNING) << "Failed to find MemAvailable in /proc/meminfo";
+  return 0;
+}
+
+/**
+ * StashStore keeps the stashes in memory (up to a budget), and only writes them to /cache when
+ * resuming an interrupted update would need them. Most stashes are freed shortly after being
+ * created, which saves writing, fsync'ing and reading back the stash files.
+ *
+ * The last command index only moves past a stash command when all the live stashes have been
+ * written to /cache (see Commit()), so the skipped commands never include one that created an
+ * in-memory stash. Until then, a resumed update re-executes the stash commands, which requires
+ * their source blocks to be intact: any write to the source blocks of an uncommitted stash commits
+ * first (see BeforeWrite()). Stashes are also written out early, without moving the last command
+ * index, when the memory budget is exceeded.
+ *
+ * All the methods are thread-safe.
+ */
+class StashStore {
+ public:
+  StashStore(const std::string& base, DurabilityScheduler* durability, size_t budget)
+      : base_(base),
+        durability_(durability),
+        budget_(budget),
+        size_(0),
+        last_index_(-1),
+        uncommitted_(false),
+        hits_(0),
+        spills_(0) {}
+
+  // Saves the stash with the given id, which holds the contents of |src|.
+  bool Put(const std::string& id, const RangeSet& src, const std::vector<uint8_t>& buffer,
+           int cmdindex, std::string_view cmdline) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t size = src.blocks() * BLOCKSIZE;
+
+    // Make room by writing out the oldest stashes.
+    while (!stashes_.empty() && size_ + size > budget_) {
+      if (!SpillLocked(stashes_.begin())) {
+        return false;
+      }
+    }
+    if (size > budget_) {
+      std::vector<uint8_t> data(buffer.begin(), buffer.begin() + size);
+      spills_++;
+      if (WriteStash(base_, id, src.blocks(), data, false, nullptr) != 0) {
+        return false;
+      }
+    } else {
+      stashes_.push_back({ id, std::vector<uint8_t>(buffer.begin(), buffer.begin() + size) });
+      size_ += size;
+    }
+
+    // Only a stored stash may be saved as the last command index.
+    uncommitted_sources_.push_back(src);
+    last_index_ = cmdindex;
+    last_cmdline_ = cmdline;
+    uncommitted_ = true;
+    return true;
+  }
+
+  // Returns whether the given stash is in memory.
+  bool Contains(const std::string& id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Find(id) != stashes_.end();
+  }
+
+  // Copies the given stash into |buffer| if it's in memory. Returns false otherwise.
+  bool Get(const std::string& id, std::vector<uint8_t>& buffer, size_t* blocks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = Find(id);
+    if (it == stashes_.end()) {
+      return false;
+    }
+    allocate(it->data.size(), buffer);
+    std::copy(it->data.begin(), it->data.end(), buffer.begin());
+    *blocks = it->data.size() / BLOCKSIZE;
+    hits_++;
+    return true;
+  }
+
+  // Drops the given stash if it's in memory. Returns false if it isn't.
+  bool Erase(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = Find(id);
+    if (it == stashes_.end()) {
+      return false;
+    }
+    size_ -= it->data.size();
+    stashes_.erase(it);
+    return true;
+  }
+
+  // Called before a command writes to |tgt|. Commits if |tgt| overlaps the source blocks of any
+  // stash created since the last commit (including the freed ones), as the stash commands could no
+  // longer be re-executed.
+  bool BeforeWrite(const RangeSet& tgt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& src : uncommitted_sources_) {
+      if (src.Overlaps(tgt)) {
+        return CommitLocked();
+      }
+    }
+    return true;
+  }
+
+  // Writes all the in-memory stashes to /cache, and saves the last stash command as the last
+  // command index.
+  bool Commit() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return CommitLocked();
+  }
+
+  // Same as above, but saves the given command as the last command index.
+  bool Commit(int cmdindex, std::string_view cmdline) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_index_ = cmdindex;
+    last_cmdline_ = cmdline;
+    uncommitted_ = true;
+    return CommitLocked();
+  }
+
+  // The number of stash loads that were served from memory.
+  size_t hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+  }
+
+  // The number of stashes that were written to /cache.
+  size_t spills() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return spills_;
+  }
+
+ private:
+  struct Stash {
+    std::string id;
+    std::vector<uint8_t> data;
+  };
+
+  std::vector<Stash>::const_iterator Find(const std::string& id) const {
+    return std::find_if(stashes_.cbegin(), stashes_.cend(),
+                        [&id](const Stash& stash) { return stash.id == id; });
+  }
+
+  // Must be called with mutex_ held. The stash stays in memory if it fails to be written.
+  bool SpillLocked(std::vector<Stash>::const_iterator it) {
+    Stash& stash = stashes_[it - stashes_.cbegin()];
+    LOG(INFO) << "spilling stash " << stash.id << " to /cache";
+    int blocks = stash.data.size() / BLOCKSIZE;
+    if (WriteStash(base_, stash.id, blocks, stash.data, false, nullptr) != 0) {
+      return false;
+    }
+    spills_++;
+    size_ -= stash.data.size();
+    stashes_.erase(it);
+    return true;
+  }
+
+  // Must be called with mutex_ held.
+  bool CommitLocked() {
+    if (!uncommitted_) {
+      return true;
+    }
+    while (!stashes_.empty()) {
+      if (!SpillLocked(stashes_.begin())) {
+        return false;
+      }
+    }
+    // All the commands up to the saved index will be skipped when resuming; make sure their
+    // writes have landed.
+    if (!durability_->Barrier()) {
+      return false;
+    }
+    if (!UpdateLastCommandIndex(last_index_, last_cmdline_)) {
+      LOG(WARNING) << "Failed to update the last command file.";
+    }
+    uncommitted_ = false;
+    uncommitted_sources_.clear();
+    return true;
+  }
+
+  const std::string base_;
+  DurabilityScheduler* durability_;
+  const size_t budget_;
+
+  mutable std::mutex mutex_;
+  // The in-memory stashes, from the oldest to the newest.
+  std::vector<Stash> stashes_;
+  size_t size_;
+  // The last stash command, which will be saved as the last command index on commit.
+  int last_index_;
+  std::string last_cmdline_;
+  bool uncommitted_;
+  // The source blocks of the stashes created since the last commit.
+  std::vector<RangeSet> uncommitted_sources_;
+
+  size_t hits_;
+  size_t spills_;
+};
+
 static int LoadStash(CommandParameters& params, const std::string& id, bool verify, size_t* blocks,
                      std::vector<uint8_t>& buffer, bool printnoent) {
   // In verify mode, if source range_set was saved for the given hash, check contents in the source
   // blocks first. If the check fails, search for the stashed files on /cache as usual.
   if (!params.canwrite) {
-    if (stash_map.find(id) != stash_map.end()) {
-      const RangeSet& src = stash_map[id];
+    RangeSet src;
+    if (FindStashedRange(id, &src)) {
       allocate(src.blocks() * BLOCKSIZE, buffer);
 
       if (ReadBlocks(src, buffer, params.fd) == -1) {
@@ -760,6 +1870,11 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
     blocks = &blockcount;
   }
 
+  // In-memory stashes have been verified when they were created.
+  if (params.stashes != nullptr && params.stashes->Get(id, buffer, blocks)) {
+    return 0;
+  }
+
   std::string fn = GetStashFileName(params.stashbase, id, "");
 
   struct stat sb;
@@ -794,11 +1909,11 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
 
   if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
     LOG(ERROR) << "unexpected contents in " << fn;
-    if (stash_map.find(id) == stash_map.end()) {
+    RangeSet src;
+    if (!FindStashedRange(id, &src)) {
       LOG(ERROR) << "failed to find source blocks number for stash " << id
                  << " when executing command: " << params.cmdname;
     } else {
-      const RangeSet& src = stash_map[id];
       PrintHashForCorruptedStashedBlocks(id, buffer, src);
     }
     DeleteFile(fn);
@@ -979,6 +2094,20 @@ static int FreeStash(const std::string& base, const std::string& id) {
   return 0;
 }
 
+// Releases the given stash once it's no longer needed.
+static int ReleaseStash(CommandParameters& params, const std::string& id) {
+  // The source blocks of an in-memory stash are still intact, so the stash can be dropped without
+  // flushing.
+  if (params.stashes != nullptr && params.stashes->Erase(id)) {
+    return 0;
+  }
+  // Otherwise the stash may hold the only copy of some overwritten source blocks.
+  if (params.canwrite && !params.durability->Barrier()) {
+    return -1;
+  }
+  return FreeStash(params.stashbase, id);
+}
+
 // Source contains packed data, which we want to move to the locations given in locs in the dest
 // buffer. source and dest may be the same buffer.
 static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
@@ -1017,8 +2146,8 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
   CHECK(overlap != nullptr);
 
   // <src_block_count>
-  const std::string& token = params.tokens[params.cpos++];
-  if (!android::base::ParseUint(token, src_blocks)) {
+  std::string_view token = params.tokens[params.cpos++];
+  if (!ParseDecimal(token, src_blocks)) {
     LOG(ERROR) << "invalid src_block_count \"" << token << "\"";
     return -1;
   }
@@ -1052,21 +2181,23 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
   while (params.cpos < params.tokens.size()) {
     // Each word is a an index into the stash table, a colon, and then a RangeSet describing where
     // in the source block that stashed data should go.
-    std::vector<std::string> tokens = android::base::Split(params.tokens[params.cpos++], ":");
-    if (tokens.size() != 2) {
+    std::string_view word = params.tokens[params.cpos++];
+    size_t colon = word.find(':');
+    if (colon == std::string_view::npos || word.find(':', colon + 1) != std::string_view::npos) {
       LOG(ERROR) << "invalid parameter";
       return -1;
     }
 
+    std::string id(word.substr(0, colon));
     std::vector<uint8_t> stash;
-    if (LoadStash(params, tokens[0], false, nullptr, stash, true) == -1) {
+    if (LoadStash(params, id, false, nullptr, stash, true) == -1) {
       // These source blocks will fail verification if used later, but we
       // will let the caller decide if this is a fatal failure
-      LOG(ERROR) << "failed to load stash " << tokens[0];
+      LOG(ERROR) << "failed to load stash " << id;
       continue;
     }
 
-    RangeSet locs = RangeSet::Parse(tokens[1]);
+    RangeSet locs = RangeSet::Parse(word.substr(colon + 1));
     CHECK(static_cast<bool>(locs));
     MoveRange(params.buffer, locs, stash);
   }
@@ -1110,7 +2241,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
     return -1;
   }
 
-  std::string srchash = params.tokens[params.cpos++];
+  std::string srchash(params.tokens[params.cpos++]);
   std::string tgthash;
 
   if (onehash) {
@@ -1120,7 +2251,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
       LOG(ERROR) << "missing target hash";
       return -1;
     }
-    tgthash = params.tokens[params.cpos++];
+    tgthash = std::string(params.tokens[params.cpos++]);
   }
 
   // At least it needs to provide three parameters: <tgt_range>, <src_block_count> and
@@ -1134,14 +2265,34 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   tgt = RangeSet::Parse(params.tokens[params.cpos++]);
   CHECK(static_cast<bool>(tgt));
 
-  std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
-  if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
-    return -1;
+  std::string hexdigest;
+  if (params.verify_hashes != nullptr && params.verify_hashes->Lookup(tgt, &hexdigest)) {
+    if (hexdigest == tgthash) {
+      return 1;
+    }
+  } else {
+    std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
+    if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
+      return -1;
+    }
+
+    // Return now if target blocks already have expected content.
+    if (VerifyBlocks(tgthash, tgtbuffer, tgt.blocks(), false) == 0) {
+      return 1;
+    }
   }
 
-  // Return now if target blocks already have expected content.
-  if (VerifyBlocks(tgthash, tgtbuffer, tgt.blocks(), false) == 0) {
-    return 1;
+  // A source that comes from the partition only may have been hashed ahead. The blocks don't need
+  // to be loaded in verify mode, unless they have unexpected contents that need to be reported.
+  if (params.verify_hashes != nullptr && params.cpos + 2 == params.tokens.size() &&
+      params.tokens[params.cpos + 1] != "-") {
+    RangeSet src = RangeSet::Parse(params.tokens[params.cpos + 1]);
+    if (src && params.verify_hashes->Lookup(src, &hexdigest) && hexdigest == srchash &&
+        ParseDecimal(params.tokens[params.cpos], src_blocks) && *src_blocks == src.blocks()) {
+      params.cpos += 2;
+      *overlap = src.Overlaps(tgt);
+      return 0;
+    }
   }
 
   // Load source blocks.
@@ -1156,15 +2307,17 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
     if (*overlap && params.canwrite) {
       LOG(INFO) << "stashing " << *src_blocks << " overlapping blocks to " << srchash;
 
-      bool stash_exists = false;
-      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true,
-                     &stash_exists) != 0) {
+      // The source blocks get overwritten right away, so the stash goes to /cache directly. An
+      // in-memory stash with the same id will be written out by the commit below.
+      bool stash_exists = params.stashes->Contains(srchash);
+      if (!stash_exists && WriteStash(params.stashbase, srchash, *src_blocks, params.buffer,
+                                      true, &stash_exists) != 0) {
         LOG(ERROR) << "failed to stash overlapping source blocks";
         return -1;
       }
 
-      if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
+      if (!params.stashes->Commit(params.cmdindex, params.cmdline)) {
+        return -1;
       }
 
       params.stashed += *src_blocks;
@@ -1194,7 +2347,78 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   return -1;
 }
 
+// Moves the blocks in the kernel (see BlockIo::Copy), for a move whose source comes from the
+// partition only and doesn't overlap the target. Both hashes get checked by streaming the blocks,
+// so the command doesn't need params.buffer at all. Returns false if the command should go through
+// the buffered path instead, e.g. when the source doesn't match (which the buffered path reports),
+// or when the copy can't be offloaded. params.cpos is left unchanged in that case.
+static bool PerformMoveInKernel(CommandParameters& params) {
+  // <onehash> <tgt_range> <src_block_count> <src_range>
+  size_t pos = params.cpos;
+  if (pos + 4 != params.tokens.size() || params.tokens[pos + 3] == "-") {
+    return false;
+  }
+  std::string hash(params.tokens[pos]);
+  RangeSet tgt = RangeSet::Parse(params.tokens[pos + 1]);
+  RangeSet src = RangeSet::Parse(params.tokens[pos + 3]);
+  size_t src_blocks;
+  if (!tgt || !src || !ParseDecimal(params.tokens[pos + 2], &src_blocks) ||
+      src_blocks != src.blocks() || src.blocks() != tgt.blocks() || src.Overlaps(tgt)) {
+    return false;
+  }
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  if (!HashBlocks(tgt, params.fd, digest)) {
+    return false;
+  }
+  if (print_sha1(digest) == hash) {
+    params.target_verified = true;
+    if (params.foundwrites) {
+      LOG(WARNING) << "warning: commands executed out of order [" << params.cmdname << "]";
+    }
+    LOG(INFO) << "skipping " << src_blocks << " already moved blocks";
+  } else {
+    if (!HashBlocks(src, params.fd, digest) || print_sha1(digest) != hash) {
+      return false;
+    }
+
+    // Pair up the source and the target ranges, which hold the same number of blocks.
+    std::vector<BlockCopyRequest> requests;
+    size_t src_index = 0;
+    size_t src_block = src[0].first;
+    for (const auto& range : tgt) {
+      size_t tgt_block = range.first;
+      while (tgt_block < range.second) {
+        size_t count = std::min(range.second - tgt_block, src[src_index].second - src_block);
+        requests.push_back({ static_cast<off64_t>(src_block) * BLOCKSIZE,
+                             static_cast<off64_t>(tgt_block) * BLOCKSIZE, count * BLOCKSIZE });
+        tgt_block += count;
+        src_block += count;
+        if (src_block == src[src_index].second && ++src_index < src.size()) {
+          src_block = src[src_index].first;
+        }
+      }
+    }
+
+    params.foundwrites = true;
+    LOG(INFO) << "  moving " << src_blocks << " blocks in the kernel";
+    if (!BlockIo::Get().Copy(params.fd, requests)) {
+      // The source is intact, so the buffered path can redo the whole command.
+      LOG(INFO) << "  falling back to a buffered move";
+      return false;
+    }
+  }
+
+  params.cpos = params.tokens.size();
+  params.written += tgt.blocks();
+  return true;
+}
+
 static int PerformCommandMove(CommandParameters& params) {
+  if (params.canwrite && PerformMoveInKernel(params)) {
+    return 0;
+  }
+
   size_t blocks = 0;
   bool overlap = false;
   RangeSet tgt;
@@ -1227,7 +2451,9 @@ static int PerformCommandMove(CommandParameters& params) {
   }
 
   if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
+    if (ReleaseStash(params, params.freestash) == -1) {
+      return -1;
+    }
     params.freestash.clear();
   }
 
@@ -1243,7 +2469,7 @@ static int PerformCommandStash(CommandParameters& params) {
     return -1;
   }
 
-  const std::string& id = params.tokens[params.cpos++];
+  std::string id(params.tokens[params.cpos++]);
   size_t blocks = 0;
   if (LoadStash(params, id, true, &blocks, params.buffer, false) == 0) {
     // Stash file already exists and has expected contents. Do not read from source again, as the
@@ -1254,12 +2480,20 @@ static int PerformCommandStash(CommandParameters& params) {
   RangeSet src = RangeSet::Parse(params.tokens[params.cpos++]);
   CHECK(static_cast<bool>(src));
 
+  // In verify mode, the source blocks only need to be loaded if their hash isn't known to match.
+  std::string hexdigest;
+  if (params.verify_hashes != nullptr && params.verify_hashes->Lookup(src, &hexdigest) &&
+      hexdigest == id) {
+    SaveStashedRange(id, src);
+    return 0;
+  }
+
   allocate(src.blocks() * BLOCKSIZE, params.buffer);
   if (ReadBlocks(src, params.buffer, params.fd) == -1) {
     return -1;
   }
   blocks = src.blocks();
-  stash_map[id] = src;
+  SaveStashedRange(id, src);
 
   if (VerifyBlocks(id, params.buffer, blocks, true) != 0) {
     // Source blocks have unexpected contents. If we actually need this data later, this is an
@@ -1275,15 +2509,12 @@ static int PerformCommandStash(CommandParameters& params) {
   }
 
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
-  int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
-  if (result == 0) {
-    if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-      LOG(WARNING) << "Failed to update the last command file.";
-    }
-
-    params.stashed += blocks;
+  if (!params.stashes->Put(id, src, params.buffer, params.cmdindex, params.cmdline)) {
+    return -1;
   }
-  return result;
+
+  params.stashed += blocks;
+  return 0;
 }
 
 static int PerformCommandFree(CommandParameters& params) {
@@ -1293,11 +2524,11 @@ static int PerformCommandFree(CommandParameters& params) {
     return -1;
   }
 
-  const std::string& id = params.tokens[params.cpos++];
-  stash_map.erase(id);
+  std::string id(params.tokens[params.cpos++]);
+  EraseStashedRange(id);
 
   if (params.createdstash || params.canwrite) {
-    return FreeStash(params.stashbase, id);
+    return ReleaseStash(params, id);
   }
 
   return 0;
@@ -1314,26 +2545,15 @@ static int PerformCommandZero(CommandParameters& params) {
 
   LOG(INFO) << "  zeroing " << tgt.blocks() << " blocks";
 
-  allocate(BLOCKSIZE, params.buffer);
-  memset(params.buffer.data(), 0, BLOCKSIZE);
-
   if (params.canwrite) {
     for (const auto& range : tgt) {
       off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
       size_t size = (range.second - range.first) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size)) {
-        return -1;
-      }
-
-      if (!check_lseek(params.fd, offset, SEEK_SET)) {
+      // The zero filler offloads the whole range to the kernel when the device supports it.
+      if (!params.zero_filler->Zero(offset, size)) {
+        failure_type = kFwriteFailure;
         return -1;
       }
-
-      for (size_t j = range.first; j < range.second; ++j) {
-        if (write_all(params.fd, params.buffer, BLOCKSIZE) == -1) {
-          return -1;
-        }
-      }
     }
   }
 
@@ -1358,21 +2578,21 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
-
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
+    if (params.framed_new_data != nullptr) {
+      RangeSinkWriter writer(params.fd, tgt);
+      TrackProgress(params, &writer);
+      if (!params.framed_new_data->Write(&writer)) {
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
+      params.written += tgt.blocks();
+      return 0;
     }
 
-    pthread_mutex_unlock(&params.nti.mu);
+    RangeSinkWriter writer(params.fd, tgt);
+    TrackProgress(params, &writer);
+    if (!params.nti->ring->Drain(&writer)) {
+      return -1;
+    }
   }
 
   params.written += tgt.blocks();
@@ -1388,13 +2608,13 @@ static int PerformCommandDiff(CommandParameters& params) {
   }
 
   size_t offset;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &offset)) {
+  if (!ParseDecimal(params.tokens[params.cpos++], &offset)) {
     LOG(ERROR) << "invalid patch offset";
     return -1;
   }
 
   size_t len;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &len)) {
+  if (!ParseDecimal(params.tokens[params.cpos++], &len)) {
     LOG(ERROR) << "invalid patch len";
     return -1;
   }
@@ -1421,21 +2641,22 @@ static int PerformCommandDiff(CommandParameters& params) {
   if (params.canwrite) {
     if (status == 0) {
       LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
-      Value patch_value(
-          VAL_BLOB, std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
+      // The patch is applied in place from the mmap'd package.
+      PatchSpan patch = { params.patch_start + offset, len };
 
       RangeSinkWriter writer(params.fd, tgt);
+      TrackProgress(params, &writer);
       if (params.cmdname[0] == 'i') {  // imgdiff
-        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
+        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch,
                             std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
                                       std::placeholders::_2),
-                            nullptr, nullptr) != 0) {
+                            nullptr, nullptr, params.patch_threads) != 0) {
           LOG(ERROR) << "Failed to apply image patch.";
           failure_type = kPatchApplicationFailure;
           return -1;
         }
       } else {
-        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value, 0,
+        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch, 0,
                              std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
                                        std::placeholders::_2),
                              nullptr) != 0) {
@@ -1456,7 +2677,9 @@ static int PerformCommandDiff(CommandParameters& params) {
   }
 
   if (!params.freestash.empty()) {
-    FreeStash(params.stashbase, params.freestash);
+    if (ReleaseStash(params, params.freestash) == -1) {
+      return -1;
+    }
     params.freestash.clear();
   }
 
@@ -1517,9 +2740,436 @@ struct Command {
     CommandFunction f;
 };
 
+// The blocks and stashes that a transfer command touches. Two commands whose footprints don't
+// conflict with each other can be executed concurrently without changing the outcome of the update.
+struct CommandFootprint {
+  // Blocks read by the command (including the target blocks that are read to check whether the
+  // command has been executed already).
+  std::vector<RangeSet> reads;
+  // Blocks written by the command.
+  RangeSet writes;
+  // Source blocks that are needed to redo the command, until its writes have been flushed.
+  std::vector<RangeSet> sources;
+  // Stash ids that are created, loaded or freed by the command.
+  std::vector<std::string_view> stash_ids;
+  // Whether the command consumes the new data stream, which must be done in order.
+  bool new_data;
+  // Whether the command may update the last command index. All the commands before it must have
+  // completed, so that resuming from the saved index remains correct.
+  bool updates_index;
+  // Whether the command couldn't be analyzed, and needs to be executed on its own.
+  bool exclusive;
+};
+
+static CommandFootprint GetCommandFootprint(const std::vector<std::string_view>& tokens) {
+  CommandFootprint fp = {};
+  fp.exclusive = true;
+  if (tokens.empty()) {
+    return fp;
+  }
+
+  std::string_view cmdname = tokens[0];
+  if (cmdname == "zero" || cmdname == "erase" || cmdname == "new") {
+    // <cmd> <tgt_range>
+    if (tokens.size() < 2) {
+      return fp;
+    }
+    fp.writes = RangeSet::Parse(tokens[1]);
+    if (!fp.writes) {
+      return fp;
+    }
+    fp.new_data = (cmdname == "new");
+  } else if (cmdname == "stash") {
+    // stash <stash_id> <src_range>
+    if (tokens.size() < 3) {
+      return fp;
+    }
+    RangeSet src = RangeSet::Parse(tokens[2]);
+    if (!src) {
+      return fp;
+    }
+    fp.reads.push_back(std::move(src));
+    fp.stash_ids.push_back(tokens[1]);
+    fp.updates_index = true;
+  } else if (cmdname == "free") {
+    // free <stash_id>
+    if (tokens.size() < 2) {
+      return fp;
+    }
+    fp.stash_ids.push_back(tokens[1]);
+  } else if (cmdname == "move" || cmdname == "bsdiff" || cmdname == "imgdiff") {
+    // move <onehash> <tgt_range> <src_blk_count> <src_range> [<src_loc> <stashed_blocks>]
+    // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_blk_count> <src_range>
+    //        [<src_loc> <stashed_blocks>]
+    size_t hash_pos = (cmdname == "move") ? 1 : 3;
+    size_t tgt_pos = (cmdname == "move") ? 2 : 5;
+    if (tgt_pos + 2 >= tokens.size()) {
+      return fp;
+    }
+    fp.writes = RangeSet::Parse(tokens[tgt_pos]);
+    if (!fp.writes) {
+      return fp;
+    }
+    fp.reads.push_back(fp.writes);
+
+    size_t pos = tgt_pos + 2;
+    if (tokens[pos] == "-") {
+      pos++;
+    } else {
+      RangeSet src = RangeSet::Parse(tokens[pos++]);
+      if (!src) {
+        return fp;
+      }
+      // Overlapping source blocks get stashed under the source hash.
+      if (src.Overlaps(fp.writes)) {
+        fp.stash_ids.push_back(tokens[hash_pos]);
+        fp.updates_index = true;
+      }
+      fp.sources.push_back(src);
+      fp.reads.push_back(std::move(src));
+      // Skip <src_loc>.
+      if (pos < tokens.size()) {
+        pos++;
+      }
+    }
+
+    // <[stash_id:stash_range] ...>
+    for (; pos < tokens.size(); pos++) {
+      size_t colon = tokens[pos].find(':');
+      if (colon == std::string_view::npos) {
+        return fp;
+      }
+      fp.stash_ids.push_back(tokens[pos].substr(0, colon));
+    }
+  } else {
+    return fp;
+  }
+
+  fp.exclusive = false;
+  return fp;
+}
+
+static bool FootprintsConflict(const CommandFootprint& a, const CommandFootprint& b) {
+  if (a.exclusive || b.exclusive) {
+    return true;
+  }
+  if (a.new_data && b.new_data) {
+    return true;
+  }
+  if (a.writes.Overlaps(b.writes)) {
+    return true;
+  }
+  for (const auto& range : b.reads) {
+    if (a.writes.Overlaps(range)) {
+      return true;
+    }
+  }
+  for (const auto& range : a.reads) {
+    if (b.writes.Overlaps(range)) {
+      return true;
+    }
+  }
+  for (const auto& id : a.stash_ids) {
+    if (std::find(b.stash_ids.cbegin(), b.stash_ids.cend(), id) != b.stash_ids.cend()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the first |blocks| blocks of |rs|, in the order of the ranges.
+static SortedRangeSet LeadingBlocks(const RangeSet& rs, size_t blocks) {
+  SortedRangeSet result;
+  for (const auto& [begin, end] : rs) {
+    if (blocks == 0) {
+      break;
+    }
+    size_t count = std::min(blocks, end - begin);
+    result.Insert(Range{ begin, begin + count });
+    blocks -= count;
+  }
+  return result;
+}
+
+// The blocks to be discarded before a retry run, and the number of per-command discards they
+// replace.
+struct DiscardPlan {
+  SortedRangeSet blocks;
+  size_t replaced_discards;
+};
+
+// Plans the discards for the commands after |last_command_index| in the transfer list. A block can
+// be discarded up front if its first access is a write by "zero" or "new", which don't read their
+// target blocks. The target blocks of the diff commands are read to check whether the command has
+// been executed already, so they're never discarded. Neither are the blocks that |journal| says
+// have been written by the interrupted run. Planning stops at the first command that can't be
+// analyzed.
+static DiscardPlan PlanDiscards(std::string_view transfer_list, int last_command_index,
+                                const ResumeJournal& journal) {
+  DiscardPlan plan = {};
+  SortedRangeSet touched;
+  std::string_view line;
+  std::vector<std::string_view> tokens;
+  for (size_t i = 0; ReadLine(&transfer_list, &line); i++) {
+    if (line.empty()) continue;
+    if (i <= std::numeric_limits<int>::max() && static_cast<int>(i) <= last_command_index) {
+      continue;
+    }
+
+    SplitView(line, ' ', &tokens);
+    CommandFootprint fp = GetCommandFootprint(tokens);
+    if (fp.exclusive) {
+      break;
+    }
+    for (const auto& range : fp.reads) {
+      touched.Insert(SortedRangeSet(range));
+    }
+    if (!fp.writes) {
+      continue;
+    }
+    SortedRangeSet writes(fp.writes);
+    if (tokens[0] == "zero" || tokens[0] == "new") {
+      size_t resumed_blocks = journal.ResumedBlocks(static_cast<int>(i));
+      SortedRangeSet resumed = LeadingBlocks(fp.writes, resumed_blocks);
+      plan.blocks.Insert(writes.Subtract(touched).Subtract(resumed));
+    }
+    if (tokens[0] != "erase") {
+      plan.replaced_discards += fp.writes.size();
+    }
+    touched.Insert(writes);
+  }
+  return plan;
+}
+
+// Issues the planned discards, one BLKDISCARD per extent.
+static bool PerformDiscards(int fd, const DiscardPlan& plan, const std::string& partition) {
+  auto start = std::chrono::steady_clock::now();
+  size_t issued = 0;
+  for (const auto& range : plan.blocks) {
+    uint64_t args[2] = { range.first * static_cast<uint64_t>(BLOCKSIZE),
+                         (range.second - range.first) * static_cast<uint64_t>(BLOCKSIZE) };
+    if (ioctl(fd, BLKDISCARD, &args) == -1) {
+      if (errno == ENOTSUP) {
+        LOG(INFO) << "BLKDISCARD isn't supported on " << partition;
+        return true;
+      }
+      PLOG(ERROR) << "BLKDISCARD ioctl failed";
+      return false;
+    }
+    issued++;
+  }
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  LOG(INFO) << "discarded " << plan.blocks.blocks() << " blocks with " << issued
+            << " BLKDISCARD ioctls in " << duration.count() << " ms, instead of "
+            << plan.replaced_discards << " per-command discards";
+  return true;
+}
+
+/**
+ * CommandRunner executes the transfer commands on a pool of worker threads. Commands are dispatched
+ * in the order of the transfer list, and a command only starts once it doesn't conflict with any of
+ * the in-flight commands (see CommandFootprint). Therefore the written blocks, the stashes and the
+ * saved last command index end up the same as executing the transfer list serially.
+ */
+class CommandRunner {
+ public:
+  CommandRunner(const CommandParameters& params, size_t num_threads, FILE* cmd_pipe,
+                size_t total_blocks)
+      : num_threads_(num_threads),
+        cmd_pipe_(cmd_pipe),
+        total_blocks_(total_blocks),
+        next_id_(0),
+        failed_(false),
+        shutdown_(false),
+        written_(0),
+        stashed_(0),
+        isunresumable_(false),
+        max_buffer_size_(0),
+        patch_memory_budget_(PatchMemoryBudget()) {
+    // Each worker has its own copy of the per-command parameters, including the buffer. The
+    // commands already run concurrently, so each image patch is applied on its worker thread alone,
+    // and within its share of the patch memory budget.
+    CommandParameters worker_params = params;
+    worker_params.patch_threads = 1;
+    contexts_.resize(num_threads_, worker_params);
+    SetPatchMemoryBudget(patch_memory_budget_ / num_threads_);
+    for (size_t i = 0; i < num_threads_; i++) {
+      workers_.emplace_back(&CommandRunner::WorkerLoop, this, &contexts_[i]);
+    }
+  }
+
+  ~CommandRunner() {
+    Finish();
+  }
+
+  // Queues the given command. Blocks until the command can be executed concurrently with the
+  // in-flight ones. Returns false if any previous command has failed.
+  bool Dispatch(const Command* cmd, std::vector<std::string_view>&& tokens, int cmdindex,
+                std::string_view cmdline) {
+    CommandFootprint fp = GetCommandFootprint(tokens);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, &fp]() { return failed_ || CanStart(fp); });
+    if (failed_) {
+      return false;
+    }
+
+    uint64_t id = next_id_++;
+    queue_.push_back({ id, cmd, std::move(tokens), cmdindex, cmdline, fp.writes, fp.sources });
+    in_flight_.push_back({ id, std::move(fp) });
+    cv_.notify_all();
+    return true;
+  }
+
+  // Waits for all the dispatched commands and stops the worker threads. Returns false if any of the
+  // commands has failed.
+  bool Finish() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return in_flight_.empty(); });
+      shutdown_ = true;
+      cv_.notify_all();
+    }
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+    SetPatchMemoryBudget(patch_memory_budget_);
+    return !failed_;
+  }
+
+  // Counts the blocks of a command that has been skipped when resuming, as if it were executed.
+  void AddSkipped(size_t blocks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    written_ += blocks;
+    fprintf(cmd_pipe_, "set_progress %.4f\n", static_cast<double>(written_) / total_blocks_);
+    fflush(cmd_pipe_);
+  }
+
+  size_t written() const {
+    return written_;
+  }
+
+  size_t stashed() const {
+    return stashed_;
+  }
+
+  bool isunresumable() const {
+    return isunresumable_;
+  }
+
+  size_t max_buffer_size() const {
+    return max_buffer_size_;
+  }
+
+ private:
+  struct Job {
+    uint64_t id;
+    const Command* cmd;
+    std::vector<std::string_view> tokens;
+    int cmdindex;
+    std::string_view cmdline;
+    RangeSet writes;
+    std::vector<RangeSet> sources;
+  };
+
+  struct InFlightCommand {
+    uint64_t id;
+    CommandFootprint fp;
+  };
+
+  // Must be called with mutex_ held.
+  bool CanStart(const CommandFootprint& fp) const {
+    if (in_flight_.size() >= num_threads_) {
+      return false;
+    }
+    if (fp.updates_index || fp.exclusive) {
+      return in_flight_.empty();
+    }
+    for (const auto& command : in_flight_) {
+      if (FootprintsConflict(command.fp, fp)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void WorkerLoop(CommandParameters* worker_params) {
+    CommandParameters& ctx = *worker_params;
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return shutdown_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        job = std::move(queue_.front());
+        queue_.pop_front();
+      }
+
+      ctx.tokens = std::move(job.tokens);
+      ctx.cpos = 1;
+      ctx.cmdindex = job.cmdindex;
+      ctx.cmdname = ctx.tokens[0];
+      ctx.cmdline = job.cmdline;
+      ctx.target_verified = false;
+      ctx.written = 0;
+      ctx.stashed = 0;
+
+      bool success = true;
+      if (!ctx.stashes->BeforeWrite(job.writes) || !ctx.durability->BeforeWrite(job.writes)) {
+        success = false;
+      } else if (job.cmd->f(ctx) == -1) {
+        LOG(ERROR) << "failed to execute command [" << job.cmdline << "]";
+        success = false;
+      } else if (!ctx.durability->CommandDone(job.cmdindex, job.writes, job.sources)) {
+        success = false;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      written_ += ctx.written;
+      stashed_ += ctx.stashed;
+      isunresumable_ = isunresumable_ || ctx.isunresumable;
+      max_buffer_size_ = std::max(max_buffer_size_, ctx.buffer.size());
+      in_flight_.erase(std::find_if(in_flight_.begin(), in_flight_.end(),
+                                    [&job](const InFlightCommand& c) { return c.id == job.id; }));
+      if (success) {
+        fprintf(cmd_pipe_, "set_progress %.4f\n", static_cast<double>(written_) / total_blocks_);
+        fflush(cmd_pipe_);
+      } else {
+        failed_ = true;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  const size_t num_threads_;
+  FILE* cmd_pipe_;
+  const size_t total_blocks_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<CommandParameters> contexts_;
+  std::vector<std::thread> workers_;
+  std::deque<Job> queue_;
+  std::vector<InFlightCommand> in_flight_;
+  uint64_t next_id_;
+  bool failed_;
+  bool shutdown_;
+
+  size_t written_;
+  size_t stashed_;
+  bool isunresumable_;
+  size_t max_buffer_size_;
+  // The patch memory budget before the commands started, which gets split between the workers.
+  const size_t patch_memory_budget_;
+};
+
 // args:
 //    - block device (or file) to modify in-place
-//    - transfer list (blob)
+//    - transfer list (blob, or the name of an uncompressed entry within package.zip)
 //    - new data stream (filename within package.zip)
 //    - patch stream (filename within package.zip, must be uncompressed)
 
@@ -1528,6 +3178,11 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
                                       const Command* commands, size_t cmdcount, bool dryrun) {
   CommandParameters params = {};
   params.canwrite = !dryrun;
+  params.patch_threads = kMaxPatchThreads;
+
+  NewThreadInfo nti = {};
+  params.nti = &nti;
+  std::unique_ptr<FramedNewData> framed_new_data;
 
   LOG(INFO) << "performing " << (dryrun ? "verification" : "update");
   if (state->is_retry) {
@@ -1554,8 +3209,9 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     ErrorAbort(state, kArgsParsingFailure, "blockdev_filename argument to %s must be string", name);
     return StringValue("");
   }
-  if (transfer_list_value->type != VAL_BLOB) {
-    ErrorAbort(state, kArgsParsingFailure, "transfer_list argument to %s must be blob", name);
+  if (transfer_list_value->type != VAL_BLOB && transfer_list_value->type != VAL_STRING) {
+    ErrorAbort(state, kArgsParsingFailure, "transfer_list argument to %s must be blob or string",
+               name);
     return StringValue("");
   }
   if (new_data_fn->type != VAL_STRING) {
@@ -1587,6 +3243,28 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   }
 
   params.patch_start = ui->package_zip_addr + patch_entry.offset;
+
+  // The transfer list is tokenized in place; an entry named by a string is read straight from the
+  // mapped package.
+  std::string_view transfer_list = transfer_list_value->data;
+  if (transfer_list_value->type == VAL_STRING) {
+    ZipString transfer_list_name(transfer_list_value->data.c_str());
+    ZipEntry transfer_list_entry;
+    if (FindEntry(za, transfer_list_name, &transfer_list_entry) != 0) {
+      LOG(ERROR) << name << "(): no file \"" << transfer_list_value->data << "\" in package";
+      return StringValue("");
+    }
+    if (transfer_list_entry.method != kCompressStored) {
+      LOG(ERROR) << name << "(): transfer list \"" << transfer_list_value->data
+                 << "\" must be stored uncompressed";
+      return StringValue("");
+    }
+    transfer_list =
+        std::string_view(reinterpret_cast<const char*>(ui->package_zip_addr) +
+                             transfer_list_entry.offset,
+                         transfer_list_entry.uncompressed_length);
+  }
+
   ZipString new_data(new_data_fn->data.c_str());
   ZipEntry new_entry;
   if (FindEntry(za, new_data, &new_entry) != 0) {
@@ -1594,54 +3272,108 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
-  params.fd.reset(TEMP_FAILURE_RETRY(ota_open(blockdev_filename->data.c_str(), O_RDWR)));
+  android::base::unique_fd blockdev_fd(
+      TEMP_FAILURE_RETRY(ota_open(blockdev_filename->data.c_str(), O_RDWR)));
+  params.fd = blockdev_fd.get();
   if (params.fd == -1) {
     PLOG(ERROR) << "open \"" << blockdev_filename->data << "\" failed";
     return StringValue("");
   }
 
+  // Framed new data comes with an index entry next to it.
+  std::string frame_index;
+  ZipString frame_index_name((new_data_fn->data + ".frames").c_str());
+  ZipEntry frame_index_entry;
+  bool framed = FindEntry(za, frame_index_name, &frame_index_entry) == 0;
+  if (framed && params.canwrite) {
+    if (new_entry.method != kCompressStored) {
+      LOG(ERROR) << name << "(): framed new data \"" << new_data_fn->data
+                 << "\" must be stored uncompressed";
+      return StringValue("");
+    }
+    frame_index.resize(frame_index_entry.uncompressed_length);
+    if (ExtractToMemory(za, &frame_index_entry, reinterpret_cast<uint8_t*>(&frame_index[0]),
+                        frame_index.size()) != 0) {
+      LOG(ERROR) << name << "(): failed to extract the new data frame index";
+      return StringValue("");
+    }
+  }
+
   if (params.canwrite) {
-    params.nti.za = za;
-    params.nti.entry = new_entry;
-    params.nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
-    if (params.nti.brotli_compressed) {
+    nti.za = za;
+    nti.entry = new_entry;
+    nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
+    if (nti.brotli_compressed) {
       // Initialize brotli decoder state.
-      params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+      nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
     }
-    params.nti.receiver_available = true;
-
-    pthread_mutex_init(&params.nti.mu, nullptr);
-    pthread_cond_init(&params.nti.cv, nullptr);
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-    int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
-    if (error != 0) {
-      PLOG(ERROR) << "pthread_create failed";
+    if (framed) {
+      size_t num_threads = std::min<size_t>(
+          kMaxNewDataDecoders, std::max<size_t>(1, std::thread::hardware_concurrency()));
+      framed_new_data = FramedNewData::Create(ui->package_zip_addr + new_entry.offset,
+                                              new_entry.uncompressed_length, frame_index,
+                                              num_threads);
+      if (framed_new_data == nullptr) {
+        return StringValue("");
+      }
+      params.framed_new_data = framed_new_data.get();
+    } else {
+      nti.ring = std::make_unique<NewDataRing>(kNewDataRingMinDepth, kNewDataRingCapacity);
+      int error = pthread_create(&nti.thread, &attr, unzip_new_data, &nti);
+      if (error != 0) {
+        PLOG(ERROR) << "pthread_create failed";
+        return StringValue("");
+      }
+      nti.thread_started = true;
+    }
+  }
+
+  // A binary transfer list gets expanded into its text form, in a single buffer.
+  std::string expanded_transfer_list;
+  if (IsBinaryTransferList(transfer_list)) {
+    if (!ExpandBinaryTransferList(transfer_list, &expanded_transfer_list)) {
+      ErrorAbort(state, kArgsParsingFailure, "invalid binary transfer list");
       return StringValue("");
     }
+    transfer_list = expanded_transfer_list;
   }
 
-  std::vector<std::string> lines = android::base::Split(transfer_list_value->data, "\n");
-  if (lines.size() < 2) {
+  // The resume journal is only valid for the same transfer list.
+  uint8_t transfer_list_digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(transfer_list.data()), transfer_list.size(),
+       transfer_list_digest);
+
+  // The header takes the first four lines.
+  std::string_view header[4];
+  size_t header_lines = 0;
+  while (header_lines < 4 && ReadLine(&transfer_list, &header[header_lines])) {
+    header_lines++;
+  }
+  if (header_lines < 2) {
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zd]",
-               lines.size());
+               header_lines);
     return StringValue("");
   }
 
   // First line in transfer list is the version number.
-  if (!android::base::ParseInt(lines[0], &params.version, 3, 4)) {
-    LOG(ERROR) << "unexpected transfer list version [" << lines[0] << "]";
+  size_t version;
+  if (!ParseDecimal(header[0], &version, kBinaryTransferListVersion) || version < 3) {
+    LOG(ERROR) << "unexpected transfer list version [" << header[0] << "]";
     return StringValue("");
   }
+  params.version = version;
 
   LOG(INFO) << "blockimg version is " << params.version;
 
   // Second line in transfer list is the total number of blocks we expect to write.
   size_t total_blocks;
-  if (!android::base::ParseUint(lines[1], &total_blocks)) {
-    ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%s]", lines[1].c_str());
+  if (!ParseDecimal(header[1], &total_blocks)) {
+    ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%s]",
+               std::string(header[1]).c_str());
     return StringValue("");
   }
 
@@ -1649,21 +3381,20 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("t");
   }
 
-  size_t start = 2;
-  if (lines.size() < 4) {
+  if (header_lines < 4) {
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zu]",
-               lines.size());
+               header_lines);
     return StringValue("");
   }
 
   // Third line is how many stash entries are needed simultaneously.
-  LOG(INFO) << "maximum stash entries " << lines[2];
+  LOG(INFO) << "maximum stash entries " << header[2];
 
   // Fourth line is the maximum number of blocks that will be stashed simultaneously
   size_t stash_max_blocks;
-  if (!android::base::ParseUint(lines[3], &stash_max_blocks)) {
+  if (!ParseDecimal(header[3], &stash_max_blocks)) {
     ErrorAbort(state, kArgsParsingFailure, "unexpected maximum stash blocks [%s]",
-               lines[3].c_str());
+               std::string(header[3]).c_str());
     return StringValue("");
   }
 
@@ -1691,10 +3422,26 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     saved_last_command_index = -1;
   }
 
-  start += 2;
+  // On top of the last command index, the resume journal tells how many target blocks each command
+  // after that index has written. The commands that have completed are skipped, except for "new"
+  // which needs to consume its data; the others continue from where they were interrupted.
+  ResumeJournal journal(print_sha1(transfer_list_digest) + " " + params.stashbase);
+  if (params.canwrite) {
+    journal.Load();
+  }
+
+  // Blocks used to be discarded right before each write on a retry run. Instead, the blocks that
+  // are overwritten before being read get discarded up front, in a few large extents.
+  if (params.canwrite && is_retry) {
+    DiscardPlan plan = PlanDiscards(transfer_list, saved_last_command_index, journal);
+    if (!PerformDiscards(params.fd, plan, blockdev_filename->data)) {
+      failure_type = kFwriteFailure;
+      return StringValue("");
+    }
+  }
 
   // Build a map of the available commands
-  std::unordered_map<std::string, const Command*> cmd_map;
+  std::unordered_map<std::string_view, const Command*> cmd_map;
   for (size_t i = 0; i < cmdcount; ++i) {
     if (cmd_map.find(commands[i].name) != cmd_map.end()) {
       LOG(ERROR) << "Error: command [" << commands[i].name << "] already exists in the cmd map.";
@@ -1705,28 +3452,75 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   int rc = -1;
 
+  // The block device only gets flushed when resuming relies on the written blocks.
+  DurabilityScheduler durability(params.fd, kFlushIntervalBytes,
+                                 std::chrono::milliseconds(kFlushIntervalMs), &journal);
+  StashStore stashes(params.stashbase, &durability, params.canwrite ? GetStashMemoryBudget() : 0);
+  ZeroFiller zero_filler(params.fd);
+  if (params.canwrite) {
+    params.durability = &durability;
+    params.journal = &journal;
+    params.stashes = &stashes;
+    params.zero_filler = &zero_filler;
+    // The inflated source of large imgdiff chunks spills to /cache.
+    SetPatchSpillSpaceHandler(MakeFreeSpaceOnCache);
+  }
+
+  // Independent commands are executed concurrently when performing an update. Verification runs
+  // the commands serially so that the last command index can be checked in order, but hashes the
+  // ranges on multiple threads ahead of the commands.
+  std::unique_ptr<CommandRunner> runner;
+  VerifyHashCache verify_hashes;
+  size_t num_threads = std::min<size_t>(kMaxCommandThreads, std::thread::hardware_concurrency());
+  if (params.canwrite && num_threads > 1) {
+    LOG(INFO) << "executing commands with " << num_threads << " threads";
+    runner = std::make_unique<CommandRunner>(params, num_threads, cmd_pipe, total_blocks);
+  }
+  size_t verify_threads = std::min<size_t>(kMaxVerifyThreads, std::thread::hardware_concurrency());
+  if (!params.canwrite && verify_threads > 1) {
+    verify_hashes.Plan(transfer_list);
+    verify_hashes.Run(params.fd, verify_threads);
+    params.verify_hashes = &verify_hashes;
+  }
+
+  // The commands skipped when resuming still count towards the written blocks and the progress,
+  // which are both measured against total_blocks. "erase" doesn't count when executed either.
+  auto skip_command = [&params, &runner, cmd_pipe, total_blocks](size_t blocks) {
+    if (params.cmdname == "erase" || blocks == 0) {
+      return;
+    }
+    if (runner != nullptr) {
+      runner->AddSkipped(blocks);
+      return;
+    }
+    params.written += blocks;
+    fprintf(cmd_pipe, "set_progress %.4f\n", static_cast<double>(params.written) / total_blocks);
+    fflush(cmd_pipe);
+  };
+
   // Subsequent lines are all individual transfer commands
-  for (size_t i = start; i < lines.size(); i++) {
-    const std::string& line = lines[i];
+  std::string_view line;
+  for (size_t i = 0; ReadLine(&transfer_list, &line); i++) {
     if (line.empty()) continue;
 
-    params.tokens = android::base::Split(line, " ");
+    SplitView(line, ' ', &params.tokens);
     params.cpos = 0;
-    if (i - start > std::numeric_limits<int>::max()) {
+    if (i > std::numeric_limits<int>::max()) {
       params.cmdindex = -1;
     } else {
-      params.cmdindex = i - start;
+      params.cmdindex = i;
     }
-    params.cmdname = params.tokens[params.cpos++].c_str();
-    params.cmdline = line.c_str();
+    params.cmdname = params.tokens[params.cpos++];
+    params.cmdline = line;
     params.target_verified = false;
 
-    if (cmd_map.find(params.cmdname) == cmd_map.end()) {
+    auto cmd_it = cmd_map.find(params.cmdname);
+    if (cmd_it == cmd_map.end()) {
       LOG(ERROR) << "unexpected command [" << params.cmdname << "]";
       goto pbiudone;
     }
 
-    const Command* cmd = cmd_map[params.cmdname];
+    const Command* cmd = cmd_it->second;
 
     // Skip the command if we explicitly set the corresponding function pointer to nullptr, e.g.
     // "erase" during block_image_verify.
@@ -1739,9 +3533,35 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     if (params.canwrite && params.cmdindex != -1 && params.cmdindex <= saved_last_command_index) {
       LOG(INFO) << "Skipping already executed command: " << params.cmdindex
                 << ", last executed command for previous update: " << saved_last_command_index;
+      skip_command(GetCommandFootprint(params.tokens).writes.blocks());
+      continue;
+    }
+
+    if (params.canwrite && params.cmdname != "new" && params.cmdindex != -1) {
+      size_t resumed = journal.ResumedBlocks(params.cmdindex);
+      size_t blocks = GetCommandFootprint(params.tokens).writes.blocks();
+      if (resumed > 0 && resumed >= blocks) {
+        LOG(INFO) << "Skipping command " << params.cmdindex << " completed by the interrupted run";
+        skip_command(blocks);
+        continue;
+      }
+    }
+
+    if (runner != nullptr) {
+      if (!runner->Dispatch(cmd, std::move(params.tokens), params.cmdindex, params.cmdline)) {
+        goto pbiudone;
+      }
       continue;
     }
 
+    CommandFootprint footprint;
+    if (params.canwrite) {
+      footprint = GetCommandFootprint(params.tokens);
+      if (!stashes.BeforeWrite(footprint.writes) || !durability.BeforeWrite(footprint.writes)) {
+        goto pbiudone;
+      }
+    }
+
     if (cmd->f(params) == -1) {
       LOG(ERROR) << "failed to execute command [" << line << "]";
       goto pbiudone;
@@ -1760,12 +3580,11 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
                      << params.cmdline << " doesn't produce expected target blocks.";
         saved_last_command_index = -1;
         DeleteLastCommandFile();
+        DeleteResumeJournal();
       }
     }
     if (params.canwrite) {
-      if (ota_fsync(params.fd) == -1) {
-        failure_type = kFsyncFailure;
-        PLOG(ERROR) << "fsync failed";
+      if (!durability.CommandDone(params.cmdindex, footprint.writes, footprint.sources)) {
         goto pbiudone;
       }
       fprintf(cmd_pipe, "set_progress %.4f\n", static_cast<double>(params.written) / total_blocks);
@@ -1776,38 +3595,84 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   rc = 0;
 
 pbiudone:
+  if (runner != nullptr) {
+    if (!runner->Finish()) {
+      rc = -1;
+    }
+    params.written += runner->written();
+    params.stashed += runner->stashed();
+    params.isunresumable = params.isunresumable || runner->isunresumable();
+  }
+
   if (params.canwrite) {
-    pthread_mutex_lock(&params.nti.mu);
-    if (params.nti.receiver_available) {
-      LOG(WARNING) << "new data receiver is still available after executing all commands.";
-    }
-    params.nti.receiver_available = false;
-    pthread_cond_broadcast(&params.nti.cv);
-    pthread_mutex_unlock(&params.nti.mu);
-    int ret = pthread_join(params.thread, nullptr);
-    if (ret != 0) {
-      LOG(WARNING) << "pthread join returned with " << strerror(ret);
+    if (framed_new_data != nullptr) {
+      if (!framed_new_data->Exhausted()) {
+        LOG(WARNING) << "new data frames are left after executing all commands.";
+      }
+      LOG(INFO) << "waited " << framed_new_data->stall_time().count()
+                << " ms for new data to be decoded";
+      framed_new_data.reset();
+    } else {
+      if (!nti.ring->Exhausted()) {
+        LOG(WARNING) << "new data receiver is still available after executing all commands.";
+      }
+      nti.StopThread();
+      LOG(INFO) << "new data decoder waited " << nti.ring->producer_stall_ms()
+                << " ms for ring space; new commands waited " << nti.ring->consumer_stall_ms()
+                << " ms for data";
+    }
+
+    // The stash and the last command file can't be deleted until all the writes have landed.
+    if (rc == 0 && !durability.Barrier()) {
+      rc = -1;
+    }
+    // Write out the in-memory stashes, so that the update can be resumed.
+    if (rc != 0 && !params.isunresumable && !stashes.Commit()) {
+      LOG(ERROR) << "Failed to save the stashes";
     }
 
     if (rc == 0) {
       LOG(INFO) << "wrote " << params.written << " blocks; expected " << total_blocks;
       LOG(INFO) << "stashed " << params.stashed << " blocks";
-      LOG(INFO) << "max alloc needed was " << params.buffer.size();
+      size_t max_alloc = params.buffer.size();
+      if (runner != nullptr) {
+        max_alloc = std::max(max_alloc, runner->max_buffer_size());
+      }
+      LOG(INFO) << "max alloc needed was " << max_alloc;
+      LOG(INFO) << "issued " << durability.flushes() << " flushes; skipped "
+                << durability.skipped_flushes();
+      LOG(INFO) << "loaded " << stashes.hits() << " stashes from memory; spilled "
+                << stashes.spills() << " to /cache";
+      if (zero_filler.bytes() > 0) {
+        uint64_t elapsed_ms = std::max<uint64_t>(zero_filler.elapsed_ms(), 1);
+        LOG(INFO) << "zeroed " << zero_filler.bytes() << " bytes with "
+                  << ZeroFiller::MethodName(zero_filler.method()) << " in " << elapsed_ms
+                  << " ms (" << zero_filler.bytes() * 1000 / elapsed_ms / (1024 * 1024)
+                  << " MiB/s)";
+      }
 
       const char* partition = strrchr(blockdev_filename->data.c_str(), '/');
       if (partition != nullptr && *(partition + 1) != 0) {
         fprintf(cmd_pipe, "log bytes_written_%s: %zu\n", partition + 1, params.written * BLOCKSIZE);
         fprintf(cmd_pipe, "log bytes_stashed_%s: %zu\n", partition + 1, params.stashed * BLOCKSIZE);
+        fprintf(cmd_pipe, "log fsyncs_skipped_%s: %zu\n", partition + 1,
+                durability.skipped_flushes());
+        fprintf(cmd_pipe, "log stash_hits_%s: %zu\n", partition + 1, stashes.hits());
+        fprintf(cmd_pipe, "log stash_spills_%s: %zu\n", partition + 1, stashes.spills());
+        if (nti.ring != nullptr) {
+          fprintf(cmd_pipe, "log new_data_decoder_stall_ms_%s: %" PRIu64 "\n", partition + 1,
+                  nti.ring->producer_stall_ms());
+          fprintf(cmd_pipe, "log new_data_command_stall_ms_%s: %" PRIu64 "\n", partition + 1,
+                  nti.ring->consumer_stall_ms());
+        }
         fflush(cmd_pipe);
       }
       // Delete stash only after successfully completing the update, as it may contain blocks needed
       // to complete the update later.
       DeleteStash(params.stashbase);
       DeleteLastCommandFile();
+      DeleteResumeJournal();
     }
-
-    pthread_mutex_destroy(&params.nti.mu);
-    pthread_cond_destroy(&params.nti.cv);
   } else if (rc == 0) {
     LOG(INFO) << "verified partition contents; update may be resumed";
   }
@@ -1816,15 +3681,12 @@ pbiudone:
     failure_type = kFsyncFailure;
     PLOG(ERROR) << "fsync failed";
   }
-  // params.fd will be automatically closed because it's a unique_fd.
-
-  if (params.nti.brotli_decoder_state != nullptr) {
-    BrotliDecoderDestroyInstance(params.nti.brotli_decoder_state);
-  }
+  // blockdev_fd will be automatically closed because it's a unique_fd.
 
   // Delete the last command file if the update cannot be resumed.
   if (params.isunresumable) {
     DeleteLastCommandFile();
+    DeleteResumeJournal();
   }
 
   // Only delete the stash if the update cannot be resumed, or it's a verification run and we
@@ -1953,29 +3815,12 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
   RangeSet rs = RangeSet::Parse(ranges->data);
   CHECK(static_cast<bool>(rs));
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
-
-  std::vector<uint8_t> buffer(BLOCKSIZE);
-  for (const auto& range : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
-      ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", blockdev_filename->data.c_str(),
-                 strerror(errno));
-      return StringValue("");
-    }
-
-    for (size_t j = range.first; j < range.second; ++j) {
-      if (read_all(fd, buffer, BLOCKSIZE) == -1) {
-        ErrorAbort(state, kFreadFailure, "failed to read %s: %s", blockdev_filename->data.c_str(),
-                   strerror(errno));
-        return StringValue("");
-      }
-
-      SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
-    }
-  }
   uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1_Final(digest, &ctx);
+  if (!HashBlocks(rs, fd, digest)) {
+    ErrorAbort(state, kFreadFailure, "failed to read %s: %s", blockdev_filename->data.c_str(),
+               strerror(errno));
+    return StringValue("");
+  }
 
   return StringValue(print_sha1(digest));
 }
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_BLOCK_IO_H_
+#define _UPDATER_BLOCK_IO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+// A contiguous piece of data to be read from (or written to) the given byte offset of a file.
+struct BlockIoRequest {
+  off64_t offset;
+  // The destination of a read, or the source of a write.
+  uint8_t* data;
+  size_t length;
+};
+
+// A piece of data to be copied from one byte offset of a file to another.
+struct BlockCopyRequest {
+  off64_t src;
+  off64_t dst;
+  size_t length;
+};
+
+// BlockIo performs a batch of positioned reads or writes (e.g. all the ranges of a RangeSet) at
+// once, instead of one lseek + read / write per range. Requests that are adjacent on disk are
+// merged into vectored I/O. The io_uring backend is used when the kernel supports it; otherwise the
+// batch is served with preadv / pwritev, spread over a few threads for large batches. All the
+// backends go through the libotafault wrappers whenever fault injection is enabled.
+class BlockIo {
+ public:
+  // Returns the process-wide instance, which is safe to be used by multiple threads.
+  static BlockIo& Get();
+
+  // Reads all the requests from the given fd. Returns false on any error, including reaching EOF
+  // before filling up the requests.
+  virtual bool Read(int fd, const std::vector<BlockIoRequest>& requests) = 0;
+
+  // Writes all the requests to the given fd. Returns false on any error.
+  virtual bool Write(int fd, const std::vector<BlockIoRequest>& requests) = 0;
+
+  // Copies all the requests within the given fd in the kernel, with copy_file_range(), or splice()
+  // through a pipe if the former doesn't support the file (e.g. block devices). The source and the
+  // destination of a request must not overlap. Returns false if the copy can't be offloaded, or on
+  // any error; the caller is expected to redo the whole copy through a buffer then. Always returns
+  // false when fault injection is enabled.
+  bool Copy(int fd, const std::vector<BlockCopyRequest>& requests);
+
+  // Returns the name of the backend, for logging purpose.
+  virtual const char* name() const = 0;
+
+  virtual ~BlockIo() {}
+};
+
+#endif  // _UPDATER_BLOCK_IO_H_
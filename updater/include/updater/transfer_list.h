@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_TRANSFER_LIST_H_
+#define _UPDATER_TRANSFER_LIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Helpers to read a transfer list in place. The text formats (version 3 and 4) are tokenized into
+// views of the original buffer, instead of being split into separate strings.
+
+// Removes the first line from |text|, and saves it (without the trailing newline) into |line|.
+// Returns false if there's nothing left in |text|.
+bool ReadLine(std::string_view* text, std::string_view* line);
+
+// Splits |text| at each |delimiter| into |pieces|, which gets cleared first so that its storage can
+// be reused. Consecutive delimiters produce empty pieces, like android::base::Split().
+void SplitView(std::string_view text, char delimiter, std::vector<std::string_view>* pieces);
+
+// Parses |text| as a decimal number that's not larger than |max|.
+bool ParseDecimal(std::string_view text, size_t* value, size_t max = SIZE_MAX);
+
+// Version 5 is a binary encoding of the version 4 commands, which starts with the text line "5".
+// Everything after that line is a sequence of varints (unsigned LEB128), except for the one byte
+// opcodes and flags, and the 20-byte SHA-1 hashes:
+//
+//   <total_blocks> <max_stash_entries> <max_stash_blocks> <command_count> <command>...
+//
+// Each command starts with an opcode (0: bsdiff, 1: erase, 2: free, 3: imgdiff, 4: move, 5: new,
+// 6: stash, 7: zero), followed by the operands of its text counterpart:
+//
+//   erase / new / zero:  <ranges>
+//   free:                <hash>
+//   stash:               <hash> <ranges>
+//   move:                <hash> <tgt_ranges> <source>
+//   bsdiff / imgdiff:    <patch_offset> <patch_length> <src_hash> <tgt_hash> <tgt_ranges> <source>
+//
+// <ranges> is the number of values (twice the number of ranges), and then the values, each one
+// encoded as the zigzag delta from the previous value. <source> is the source block count, a kind
+// byte (0: stashes only, 1: source ranges only, 2: source ranges and their locations), the source
+// ranges and locations as per the kind, and then the count of the stashes followed by a <hash>
+// <ranges> pair for each one.
+constexpr int kBinaryTransferListVersion = 5;
+
+// Returns true if |transfer_list| is in the binary format.
+bool IsBinaryTransferList(std::string_view transfer_list);
+
+// Expands the binary transfer list into the equivalent text, which gets written into |text| in one
+// go. The version line stays as "5". Returns false if the binary transfer list is malformed.
+bool ExpandBinaryTransferList(std::string_view transfer_list, std::string* text);
+
+#endif  // _UPDATER_TRANSFER_LIST_H_
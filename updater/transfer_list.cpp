@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "updater/transfer_list.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/logging.h>
+
+bool ReadLine(std::string_view* text, std::string_view* line) {
+  if (text->empty()) {
+    return false;
+  }
+  size_t end = text->find('\n');
+  if (end == std::string_view::npos) {
+    *line = *text;
+    text->remove_prefix(text->size());
+  } else {
+    *line = text->substr(0, end);
+    text->remove_prefix(end + 1);
+  }
+  return true;
+}
+
+void SplitView(std::string_view text, char delimiter, std::vector<std::string_view>* pieces) {
+  pieces->clear();
+  while (true) {
+    size_t end = text.find(delimiter);
+    if (end == std::string_view::npos) {
+      pieces->push_back(text);
+      return;
+    }
+    pieces->push_back(text.substr(0, end));
+    text.remove_prefix(end + 1);
+  }
+}
+
+bool ParseDecimal(std::string_view text, size_t* value, size_t max) {
+  if (text.empty()) {
+    return false;
+  }
+  size_t result = 0;
+  for (char c : text) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    size_t digit = c - '0';
+    if (digit > max || result > (max - digit) / 10) {
+      return false;
+    }
+    result = result * 10 + digit;
+  }
+  *value = result;
+  return true;
+}
+
+bool IsBinaryTransferList(std::string_view transfer_list) {
+  return transfer_list.size() >= 2 && transfer_list[0] == '0' + kBinaryTransferListVersion &&
+         transfer_list[1] == '\n';
+}
+
+static constexpr size_t kHashSize = 20;
+
+// The opcodes of the binary format, in the order of their names.
+static constexpr const char* kCommandNames[] = {
+  "bsdiff", "erase", "free", "imgdiff", "move", "new", "stash", "zero",
+};
+
+enum Opcode : uint8_t {
+  kBsdiff,
+  kErase,
+  kFree,
+  kImgdiff,
+  kMove,
+  kNew,
+  kStash,
+  kZero,
+};
+
+enum SourceKind : uint8_t {
+  kStashesOnly,
+  kRangesOnly,
+  kRangesAndLocations,
+};
+
+// Decodes a binary transfer list, and appends the text form of each piece to the output.
+class BinaryTransferListExpander {
+ public:
+  BinaryTransferListExpander(std::string_view input, std::string* output)
+      : input_(input), output_(output) {}
+
+  bool Expand() {
+    output_->clear();
+    // Most of the values take one or two bytes, and expand to a few digits.
+    output_->reserve(input_.size() * 3);
+
+    uint64_t total_blocks;
+    uint64_t max_stash_entries;
+    uint64_t max_stash_blocks;
+    uint64_t count;
+    if (!ReadVarint(&total_blocks) || !ReadVarint(&max_stash_entries) ||
+        !ReadVarint(&max_stash_blocks) || !ReadVarint(&count)) {
+      LOG(ERROR) << "truncated binary transfer list header";
+      return false;
+    }
+    AppendNumber(kBinaryTransferListVersion);
+    output_->push_back('\n');
+    AppendNumber(total_blocks);
+    output_->push_back('\n');
+    AppendNumber(max_stash_entries);
+    output_->push_back('\n');
+    AppendNumber(max_stash_blocks);
+    output_->push_back('\n');
+
+    for (uint64_t i = 0; i < count; i++) {
+      if (!ExpandCommand()) {
+        LOG(ERROR) << "malformed command " << i << " in binary transfer list at offset " << pos_;
+        return false;
+      }
+      output_->push_back('\n');
+    }
+    if (pos_ != input_.size()) {
+      LOG(ERROR) << "trailing " << input_.size() - pos_ << " bytes in binary transfer list";
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  bool ExpandCommand() {
+    uint8_t opcode;
+    if (!ReadByte(&opcode) || opcode >= sizeof(kCommandNames) / sizeof(kCommandNames[0])) {
+      return false;
+    }
+    output_->append(kCommandNames[opcode]);
+
+    switch (opcode) {
+      case kErase:
+      case kNew:
+      case kZero:
+        return ExpandRanges();
+      case kFree:
+        return ExpandHash();
+      case kStash:
+        return ExpandHash() && ExpandRanges();
+      case kMove:
+        return ExpandHash() && ExpandRanges() && ExpandSource();
+      case kBsdiff:
+      case kImgdiff:
+        return ExpandVarint() && ExpandVarint() && ExpandHash() && ExpandHash() &&
+               ExpandRanges() && ExpandSource();
+    }
+    return false;
+  }
+
+  bool ExpandSource() {
+    uint8_t kind;
+    if (!ExpandVarint() || !ReadByte(&kind)) {
+      return false;
+    }
+    switch (kind) {
+      case kStashesOnly:
+        output_->append(" -");
+        break;
+      case kRangesOnly:
+        if (!ExpandRanges()) {
+          return false;
+        }
+        break;
+      case kRangesAndLocations:
+        if (!ExpandRanges() || !ExpandRanges()) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+
+    uint64_t stashes;
+    if (!ReadVarint(&stashes) || (kind == kRangesOnly && stashes != 0)) {
+      return false;
+    }
+    for (uint64_t i = 0; i < stashes; i++) {
+      if (!ExpandHash()) {
+        return false;
+      }
+      output_->push_back(':');
+      if (!ExpandRanges(false)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Appends " <count>,<value>,<value>...", or the same without the leading space.
+  bool ExpandRanges(bool separator = true) {
+    uint64_t count;
+    if (!ReadVarint(&count) || count == 0 || count % 2 != 0 || count > input_.size() - pos_) {
+      return false;
+    }
+    if (separator) {
+      output_->push_back(' ');
+    }
+    AppendNumber(count);
+
+    uint64_t value = 0;
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t zigzag;
+      if (!ReadVarint(&zigzag)) {
+        return false;
+      }
+      int64_t delta = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+      value += delta;
+      if (value > INT_MAX) {
+        return false;
+      }
+      output_->push_back(',');
+      AppendNumber(value);
+    }
+    return true;
+  }
+
+  bool ExpandHash() {
+    static constexpr char kHexDigits[] = "0123456789abcdef";
+    if (input_.size() - pos_ < kHashSize) {
+      return false;
+    }
+    output_->push_back(' ');
+    for (size_t i = 0; i < kHashSize; i++) {
+      uint8_t byte = input_[pos_ + i];
+      output_->push_back(kHexDigits[byte >> 4]);
+      output_->push_back(kHexDigits[byte & 0xf]);
+    }
+    pos_ += kHashSize;
+    return true;
+  }
+
+  bool ExpandVarint() {
+    uint64_t value;
+    if (!ReadVarint(&value)) {
+      return false;
+    }
+    output_->push_back(' ');
+    AppendNumber(value);
+    return true;
+  }
+
+  bool ReadByte(uint8_t* value) {
+    if (pos_ >= input_.size()) {
+      return false;
+    }
+    *value = input_[pos_++];
+    return true;
+  }
+
+  bool ReadVarint(uint64_t* value) {
+    uint64_t result = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+      uint8_t byte;
+      if (!ReadByte(&byte)) {
+        return false;
+      }
+      result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        *value = result;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void AppendNumber(uint64_t value) {
+    char digits[20];
+    size_t n = 0;
+    do {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+    } while (value != 0);
+    while (n > 0) {
+      output_->push_back(digits[--n]);
+    }
+  }
+
+  std::string_view input_;
+  std::string* output_;
+  size_t pos_ = 2;  // Skips the "5\n" version line.
+};
+
+bool ExpandBinaryTransferList(std::string_view transfer_list, std::string* text) {
+  CHECK(IsBinaryTransferList(transfer_list));
+  return BinaryTransferListExpander(transfer_list, text).Expand();
+}
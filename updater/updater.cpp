@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
 #include <string>
 
 #include <android-base/logging.h>
@@ -53,7 +54,7 @@ const char* program_name = "updater";
 // (Note it's "updateR-script", not the older "update-script".)
 static constexpr const char* SCRIPT_NAME = "META-INF/com/google/android/updater-script";
 
-extern bool have_eio_error;
+extern std::atomic<bool> have_eio_error;
 
 struct selabel_handle *sehandle;
 
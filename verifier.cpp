@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <functional>
@@ -32,10 +34,21 @@
 #include <openssl/obj_mac.h>
 
 #include "asn1_decoder.h"
+#include "otautil/hash.h"
 #include "otautil/print_sha1.h"
 
 static constexpr size_t MiB = 1024 * 1024;
 
+// Gives the kernel the |advice| for [addr, addr + length), e.g. MADV_WILLNEED to start reading it
+// into the page cache without waiting for it. This is only a hint; a failure (e.g. when the data is
+// on the heap rather than mmap'd) is harmless.
+static void AdviseRange(const unsigned char* addr, size_t length, int advice) {
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr) & ~(page_size - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr) + length;
+  madvise(reinterpret_cast<void*>(start), end - start, advice);
+}
+
 /*
  * Simple version of PKCS#7 SignedData extraction. This extracts the
  * signature OCTET STRING to be used for signature verification.
@@ -206,21 +219,40 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
     }
   }
 
-  SHA_CTX sha1_ctx;
-  SHA256_CTX sha256_ctx;
-  SHA1_Init(&sha1_ctx);
-  SHA256_Init(&sha256_ctx);
+  HashContext sha1_ctx(HashAlgorithm::SHA1);
+  HashContext sha256_ctx(HashAlgorithm::SHA256);
+
+  // The signed region is hashed window by window. Before hashing a window we ask the kernel to
+  // start reading the next one, so that the I/O (which goes through page faults on a block map
+  // package, or FUSE for sideload) overlaps with the hashing. Within a window, both digests are
+  // updated over the same cache-sized slice before moving on, so each byte is only pulled into the
+  // CPU cache once.
+  //
+  // On a Nexus 5X, experiment showed 16MiB beat 1MiB by 6% faster for a 1196MiB full OTA and 60%
+  // for an 89MiB incremental OTA. http://b/28135231.
+  constexpr size_t kWindowSize = 16 * MiB;
+  constexpr size_t kSliceSize = 256 * 1024;
+
+  // The whole package gets read front to back, which allows aggressive readahead and dropping the
+  // pages behind us sooner.
+  AdviseRange(addr, length, MADV_SEQUENTIAL);
+  AdviseRange(addr, std::min(signed_len, kWindowSize), MADV_WILLNEED);
 
   double frac = -1.0;
   size_t so_far = 0;
   while (so_far < signed_len) {
-    // On a Nexus 5X, experiment showed 16MiB beat 1MiB by 6% faster for a
-    // 1196MiB full OTA and 60% for an 89MiB incremental OTA.
-    // http://b/28135231.
-    size_t size = std::min(signed_len - so_far, 16 * MiB);
+    size_t size = std::min(signed_len - so_far, kWindowSize);
+    if (so_far + size < signed_len) {
+      AdviseRange(addr + so_far + size, std::min(signed_len - so_far - size, kWindowSize),
+                  MADV_WILLNEED);
+    }
 
-    if (need_sha1) SHA1_Update(&sha1_ctx, addr + so_far, size);
-    if (need_sha256) SHA256_Update(&sha256_ctx, addr + so_far, size);
+    for (size_t offset = 0; offset < size; offset += kSliceSize) {
+      const unsigned char* slice = addr + so_far + offset;
+      size_t slice_size = std::min(size - offset, kSliceSize);
+      if (need_sha1) sha1_ctx.Update(slice, slice_size);
+      if (need_sha256) sha256_ctx.Update(slice, slice_size);
+    }
     so_far += size;
 
     if (set_progress) {
@@ -233,9 +265,9 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
   }
 
   uint8_t sha1[SHA_DIGEST_LENGTH];
-  SHA1_Final(sha1, &sha1_ctx);
+  sha1_ctx.Final(sha1);
   uint8_t sha256[SHA256_DIGEST_LENGTH];
-  SHA256_Final(sha256, &sha256_ctx);
+  sha256_ctx.Final(sha256);
 
   const uint8_t* signature = eocd + eocd_size - signature_start;
   size_t signature_size = signature_start - FOOTER_SIZE;